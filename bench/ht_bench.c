@@ -0,0 +1,98 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * Hash table insert / lookup / remove throughput
+ *
+ * Built twice by `make bench`: against hash.c, and against hash_swiss.c
+ * with -DHT_SWISS, so the two layouts can be compared directly.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#ifdef HT_SWISS
+#define LAYOUT "swiss"
+#else
+#define LAYOUT "hash.c"
+#endif
+
+#define LOOKUPS 10000000UL
+
+static volatile unsigned long sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, unsigned long n, unsigned long ops, double t)
+{
+	printf("%-6s %8lu keys %-12s %9.1f ns/op %12.0f ops/s\n",
+	       LAYOUT, n, what, t * 1e9 / ops, ops / t);
+}
+
+static void run(unsigned long n)
+{
+	char buf[32], **keys;
+	unsigned long i;
+	struct ht *ht;
+	double t;
+
+	/* Short decimal keys */
+	if (!(keys = malloc(n * sizeof *keys)) || !(ht = ht_alloc(HT_VALUE_DEFAULT, HT_STATIC_KEYS)))
+		abort();
+
+	for (i = 0; i < n; i++) {
+		sprintf(buf, "%lu", 100000 + i * 7);
+		if (!(keys[i] = malloc(strlen(buf) + 1)))
+			abort();
+		strcpy(keys[i], buf);
+	}
+
+	t = now();
+	for (i = 0; i < n; i++)
+		ht_set(ht, keys[i], HT_PTR, keys[i]);
+	report("insert", n, n, now() - t);
+
+	t = now();
+	for (i = 0; i < LOOKUPS; i++)
+		sink += (unsigned long)ht_get_ptr_nc(ht, keys[(i * 7919) % n]);
+	report("lookup", n, LOOKUPS, now() - t);
+
+	t = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		sprintf(buf, "x%lu", i % n);
+		sink += (unsigned long)ht_get_ptr_nc(ht, buf);
+	}
+	report("lookup miss", n, LOOKUPS, now() - t);
+
+	t = now();
+	for (i = 0; i < n; i++)
+		ht_rm(ht, keys[i]);
+	report("remove", n, n, now() - t);
+
+	ht_free(ht);
+	for (i = 0; i < n; i++)
+		free(keys[i]);
+	free(keys);
+}
+
+int main(void)
+{
+	run(1000);
+	run(100000);
+	run(1000000);
+	return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * uid -> context lookup: struct uidmap vs. the struct ht keyed by
+ * decimal uid strings that it replaced.
+ *
+ * The ht side does what the server used to: keys are the contexts'
+ * uid_str (HT_STATIC_KEYS), and every lookup sprintf()s the uid first.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hash.h"
+#include "uidmap.h"
+
+#define USERS   10000
+#define LOOKUPS 10000000UL
+
+static char uid_str[USERS][11];
+static unsigned long uids[USERS];
+static volatile unsigned long sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, unsigned long n, double t)
+{
+	printf("%-24s %9.1f ns/op %12.0f ops/s\n", what, t * 1e9 / n, n / t);
+}
+
+int main(void)
+{
+	char buf[32];
+	unsigned long i, rounds = LOOKUPS / USERS;
+	struct ht *ht;
+	struct uidmap *m;
+	double t;
+
+	/* Roughly what registration hands out, with some gaps */
+	srand(1);
+	for (i = 0; i < USERS; i++) {
+		uids[i] = 2 + i * 3 + rand() % 3;
+		sprintf(uid_str[i], "%lu", uids[i]);
+	}
+
+	printf("%d users, %lu lookups\n", USERS, LOOKUPS);
+
+	if (!(ht = ht_alloc(HT_VALUE_DEFAULT, HT_STATIC_KEYS)))
+		return 1;
+	m = uidmap_alloc();
+
+	t = now();
+	for (i = 0; i < USERS; i++)
+		ht_set(ht, uid_str[i], HT_PTR, uid_str[i]);
+	report("ht_set", USERS, now() - t);
+
+	t = now();
+	for (i = 0; i < USERS; i++)
+		uidmap_set(m, uids[i], (struct pt_context *)uid_str[i]);
+	report("uidmap_set", USERS, now() - t);
+
+	t = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		sprintf(buf, "%lu", uids[(i * 7919) % USERS]);
+		sink += (unsigned long)ht_get_ptr_nc(ht, buf);
+	}
+	report("sprintf + ht_get_ptr_nc", LOOKUPS, now() - t);
+
+	t = now();
+	for (i = 0; i < LOOKUPS; i++)
+		sink += (unsigned long)uidmap_get(m, uids[(i * 7919) % USERS]);
+	report("uidmap_get", LOOKUPS, now() - t);
+
+	/* Lookups for users who aren't logged in (i.e. offline buddies) */
+	t = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		sprintf(buf, "%lu", 1000000 + i % USERS);
+		sink += (unsigned long)ht_get_ptr_nc(ht, buf);
+	}
+	report("ht_get_ptr_nc (miss)", LOOKUPS, now() - t);
+
+	t = now();
+	for (i = 0; i < LOOKUPS; i++)
+		sink += (unsigned long)uidmap_get(m, 1000000 + i % USERS);
+	report("uidmap_get (miss)", LOOKUPS, now() - t);
+
+	/* Login churn: replace every entry */
+	t = now();
+	for (i = 0; i < rounds; i++)
+		ht_set(ht, uid_str[i % USERS], HT_PTR, uid_str[(i + 1) % USERS]);
+	report("ht_set (replace)", rounds, now() - t);
+
+	t = now();
+	for (i = 0; i < rounds; i++)
+		uidmap_set(m, uids[i % USERS], (struct pt_context *)uid_str[(i + 1) % USERS]);
+	report("uidmap_set (replace)", rounds, now() - t);
+
+	ht_free(ht);
+	uidmap_free(m);
+	return 0;
+}
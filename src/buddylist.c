@@ -13,27 +13,20 @@
 #include "hash.h"
 #include "database.h"
 #include "protocol.h"
+#include "proto_ops.h"
 #include "packet.h"
 #include "logging.h"
 #include "buddylist.h"
-
-/* Prepared queries on db_w */
-static void *q_add_buddy;
-static void *q_remove_buddy;
-static void *q_block_buddy;
-static void *q_unblock_buddy;
-static void *blocked_user;
-static void *set_disp_name;
+#include "uidmap.h"
 
 /* from server.c */
-extern struct ht *uid_to_context;
+extern struct uidmap *uid_to_context;
 
 /**
  * Send our status out to our buddies
  */
 static int do_broadcast_status(void *userdata, int cols, char *val[], char *col[])
 {
-	char buf[64];
 	void **ud = (void **)userdata;
 	unsigned long uid;
 	struct pt_context *ctx, *buddy;
@@ -45,12 +38,11 @@ static int do_broadcast_status(void *userdata, int cols, char *val[], char *col[
 
 	ctx = ud[0];
 	uid = atol(val[0]);
-	sprintf(buf, "%ld", uid);
-	if (!(buddy = ht_get_ptr_nc(uid_to_context, buf)) ||
+	if (!(buddy = uidmap_get(uid_to_context, uid)) ||
 	    user_blocked_me(ctx, uid))
 		return 0;
 
-	send_packet(buddy, ud[1 + (buddy->protocol_version >= PROTOCOL_VERSION_82)]);
+	send_packet(buddy, ud[1 + buddy->ops->status_msgs]);
 	return 0;
 }
 
@@ -59,7 +51,7 @@ static int do_broadcast_status(void *userdata, int cols, char *val[], char *col[
  */
 static int send_buddy_status(void *userdata, int cols, char *val[], char *col[])
 {
-	char buf[64], uid_str[12];
+	char buf[64];
 	size_t len = 8;
 	unsigned long uid;
 	struct pt_packet *pkt;
@@ -68,7 +60,6 @@ static int send_buddy_status(void *userdata, int cols, char *val[], char *col[])
 	(void)col;
 
 	uid = atol(val[0]);
-	sprintf(uid_str, "%ld", uid);
 	buf[0] = (uid >> 24) & 0xff;
 	buf[1] = (uid >> 16) & 0xff;
 	buf[2] = (uid >> 8)  & 0xff;
@@ -83,14 +74,13 @@ static int send_buddy_status(void *userdata, int cols, char *val[], char *col[])
 		buf[5] = (char)((STATUS_BLOCKED >> 16) & 0xff);
 		buf[6] = (char)((STATUS_BLOCKED >> 8) & 0xff);
 		buf[7] = (char)(STATUS_BLOCKED & 0xff);
-	} else if ((buddy = ht_get_ptr_nc(uid_to_context, uid_str))) {
+	} else if ((buddy = uidmap_get(uid_to_context, uid))) {
 		buf[4] = (char)((buddy->status >> 24) & 0xff);
 		buf[5] = (char)((buddy->status >> 16) & 0xff);
 		buf[6] = (char)((buddy->status >> 8) & 0xff);
 		buf[7] = (char)(buddy->status & 0xff);
 
-		if (buddy->status != STATUS_ONLINE &&
-		    ctx->pkt_in.version >= PROTOCOL_VERSION_82 &&
+		if (buddy->status != STATUS_ONLINE && ctx->ops->status_msgs &&
 		    buddy->status_msg) {
 			len += min(STATUSMSG_MAX, strlen(buddy->status_msg));
 			memcpy(buf + 8, buddy->status_msg, len - 8);
@@ -107,23 +97,28 @@ static int send_buddy_status(void *userdata, int cols, char *val[], char *col[])
  */
 void send_buddy_list(struct pt_context *ctx, int blocked)
 {
-	char *s = NULL, buf[256];
-	static const char * const lists[2] = { "buddylist", "blocklist" };
+	void *stmt;
+	struct strbuf sb;
+	struct pt_packet *pkt;
+	static const char * const lists[2] = {
+		"SELECT users.uid,display,nickname,first,last,email,"
+		"verified,paid1,admin,sup FROM buddylist JOIN users ON "
+		"users.uid=buddylist.buddy WHERE buddylist.uid=?",
+
+		"SELECT users.uid,nickname,first,last,email,"
+		"verified,paid1,admin,sup FROM blocklist JOIN users ON "
+		"users.uid=blocklist.buddy WHERE blocklist.uid=?"
+	};
 
 	/* Buddy List  */
-	sprintf(buf,
-	        "SELECT users.uid,%s,first,last,email,"
-	        "verified,paid1,admin,sup FROM %s JOIN users ON "
-	         "users.uid=%s.buddy WHERE %s.uid=%ld",
-	         blocked ? "nickname" : "display,nickname",
-	         lists[blocked & 1], lists[blocked & 1], lists[blocked & 1],
-	         ctx->uid);
-	if (!db_exec(ctx->db_w, &s, buf, db_row_to_record) && s) {
-		send_packet(ctx, new_packet(
-			blocked ? PACKET_BLOCKED_BUDDIES : PACKET_BUDDY_LIST,
-			strlen(s), s, 0)
-		);
-	} else free(s);
+	if ((stmt = db_cached(ctx->db_r, lists[blocked & 1]))) {
+		packet_sb_init(&sb);
+		db_bind(stmt, "l", ctx->uid);
+		if (db_get_records(stmt, &sb, 0))
+			sb_free(&sb);
+		else if ((pkt = packet_from_sb(blocked ? PACKET_BLOCKED_BUDDIES : PACKET_BUDDY_LIST, &sb)))
+			send_packet(ctx, pkt);
+	}
 
 	/* Buddy statuses (in/out) */
 	if (!blocked) {
@@ -156,14 +151,13 @@ void broadcast_status(struct pt_context *ctx)
 	}
 
 	ud[0] = ctx;
-	ud[1] = new_packet(PACKET_BUDDY_STATUSCHANGE, 8, buf, PACKET_F_COPY);
-	ud[2] = new_packet(PACKET_BUDDY_STATUSCHANGE, len, buf, PACKET_F_COPY);
+	ud[1] = packet_ref(new_packet(PACKET_BUDDY_STATUSCHANGE, 8, buf, PACKET_F_COPY | PACKET_F_DROP));
+	ud[2] = packet_ref(new_packet(PACKET_BUDDY_STATUSCHANGE, len, buf, PACKET_F_COPY | PACKET_F_DROP));
 	sprintf(buf, "SELECT buddy FROM buddylist WHERE uid=%ld", ctx->uid);
 	db_exec(ctx->db_r, ud, buf, do_broadcast_status);
 
-	/* If these weren't used, free them instantly */
-	free_packet(ud[1]);
-	free_packet(ud[2]);
+	packet_unref(ud[1]);
+	packet_unref(ud[2]);
 }
 
 /**
@@ -181,21 +175,9 @@ void buddy_statuses(struct pt_context *ctx)
  */
 void set_buddy_display(struct pt_context *ctx, unsigned long uid, const char *disp)
 {
-	if (!set_disp_name) {
-		set_disp_name = db_prepare(
-			ctx->db_w,
-			"UPDATE buddylist SET display=? WHERE uid=? AND buddy=?"
-		);
-
-		if (!set_disp_name) {
-			ERROR(("set_buddy_display: Failed to prepare query"));
-			return;
-		}
-	}
-
-	db_reset_prepared(set_disp_name);
-	db_bind(set_disp_name, "tii", disp, ctx->uid, uid);
-	db_do_prepared(set_disp_name);
+	db_write(ctx->db_w, NULL, NULL,
+	         "UPDATE buddylist SET display=? WHERE uid=? AND buddy=?",
+	         "tll", disp, ctx->uid, uid);
 }
 
 /**
@@ -203,22 +185,10 @@ void set_buddy_display(struct pt_context *ctx, unsigned long uid, const char *di
  */
 void add_buddy(struct pt_context *ctx, unsigned long uid)
 {
-	if (!q_add_buddy) {
-		q_add_buddy = db_prepare(
-			ctx->db_w,
-			"INSERT INTO buddylist(uid, buddy) VALUES(?, ?) "
-			"ON CONFLICT DO NOTHING"
-		);
-
-		if (!q_add_buddy) {
-			ERROR(("add_buddy: Failed to prepare query"));
-			return;
-		}
-	}
-
-	db_reset_prepared(q_add_buddy);
-	db_bind(q_add_buddy, "ii", ctx->uid, uid);
-	db_do_prepared(q_add_buddy);
+	db_write(ctx->db_w, NULL, NULL,
+	         "INSERT INTO buddylist(uid, buddy) VALUES(?, ?) "
+	         "ON CONFLICT DO NOTHING",
+	         "ll", ctx->uid, uid);
 }
 
 /**
@@ -226,21 +196,9 @@ void add_buddy(struct pt_context *ctx, unsigned long uid)
  */
 void remove_buddy(struct pt_context *ctx, unsigned long uid)
 {
-	if (!q_remove_buddy) {
-		q_remove_buddy = db_prepare(
-			ctx->db_w,
-			"DELETE FROM buddylist WHERE uid=? AND buddy=?"
-		);
-
-		if (!q_remove_buddy) {
-			ERROR(("remove_buddy: Failed to prepare query"));
-			return;
-		}
-	}
-
-	db_reset_prepared(q_remove_buddy);
-	db_bind(q_remove_buddy, "ii", ctx->uid, uid);
-	db_do_prepared(q_remove_buddy);
+	db_write(ctx->db_w, NULL, NULL,
+	         "DELETE FROM buddylist WHERE uid=? AND buddy=?",
+	         "ll", ctx->uid, uid);
 }
 
 /**
@@ -248,22 +206,10 @@ void remove_buddy(struct pt_context *ctx, unsigned long uid)
  */
 void block_buddy(struct pt_context *ctx, unsigned long uid)
 {
-	if (!q_block_buddy) {
-		q_block_buddy = db_prepare(
-			ctx->db_w,
-			"INSERT INTO blocklist(uid, buddy) VALUES(?, ?) "
-			"ON CONFLICT DO NOTHING"
-		);
-
-		if (!q_block_buddy) {
-			ERROR(("block_buddy: Failed to prepare query"));
-			return;
-		}
-	}
-
-	db_reset_prepared(q_block_buddy);
-	db_bind(q_block_buddy, "ii", ctx->uid, uid);
-	db_do_prepared(q_block_buddy);
+	db_write(ctx->db_w, NULL, NULL,
+	         "INSERT INTO blocklist(uid, buddy) VALUES(?, ?) "
+	         "ON CONFLICT DO NOTHING",
+	         "ll", ctx->uid, uid);
 }
 
 /**
@@ -271,21 +217,9 @@ void block_buddy(struct pt_context *ctx, unsigned long uid)
  */
 void unblock_buddy(struct pt_context *ctx, unsigned long uid)
 {
-	if (!q_unblock_buddy) {
-		q_unblock_buddy = db_prepare(
-			ctx->db_w,
-			"DELETE FROM blocklist WHERE uid=? AND buddy=?"
-		);
-
-		if (!q_unblock_buddy) {
-			ERROR(("unblock_buddy: Failed to prepare query"));
-			return;
-		}
-	}
-
-	db_reset_prepared(q_unblock_buddy);
-	db_bind(q_unblock_buddy, "ii", ctx->uid, uid);
-	db_do_prepared(q_unblock_buddy);
+	db_write(ctx->db_w, NULL, NULL,
+	         "DELETE FROM blocklist WHERE uid=? AND buddy=?",
+	         "ll", ctx->uid, uid);
 }
 
 /**
@@ -294,21 +228,14 @@ void unblock_buddy(struct pt_context *ctx, unsigned long uid)
 int user_blocked_me(struct pt_context *ctx, unsigned long uid)
 {
 	int ret = 0;
+	void *blocked_user;
 
-	if (!blocked_user) {
-		blocked_user = db_prepare(
-			ctx->db_w,
-			"SELECT COUNT(*) FROM blocklist WHERE uid=? AND buddy=?"
-		);
-
-		if (!blocked_user) {
-			ERROR(("user_blocked_me: Failed to prepare query"));
-			return 0;
-		}
+	if (!(blocked_user = db_cached(ctx->db_r, "SELECT COUNT(*) FROM blocklist WHERE uid=? AND buddy=?"))) {
+		ERROR(("user_blocked_me: Failed to prepare query"));
+		return 0;
 	}
 
-	db_reset_prepared(blocked_user);
-	db_bind(blocked_user, "ii", uid, ctx->uid);
+	db_bind(blocked_user, "ll", uid, ctx->uid);
 	ret = db_get_count(blocked_user);
 	return !!ret;
 }
@@ -319,21 +246,14 @@ int user_blocked_me(struct pt_context *ctx, unsigned long uid)
 int i_blocked_user(struct pt_context *ctx, unsigned long uid)
 {
 	int ret = 0;
+	void *blocked_user;
 
-	if (!blocked_user) {
-		blocked_user = db_prepare(
-			ctx->db_w,
-			"SELECT COUNT(*) FROM blocklist WHERE uid=? AND buddy=?"
-		);
-
-		if (!blocked_user) {
-			ERROR(("i_blocked_user: Failed to prepare query"));
-			return 0;
-		}
+	if (!(blocked_user = db_cached(ctx->db_r, "SELECT COUNT(*) FROM blocklist WHERE uid=? AND buddy=?"))) {
+		ERROR(("i_blocked_user: Failed to prepare query"));
+		return 0;
 	}
 
-	db_reset_prepared(blocked_user);
-	db_bind(blocked_user, "ii", ctx->uid, uid);
+	db_bind(blocked_user, "ll", ctx->uid, uid);
 	ret = db_get_count(blocked_user);
 	return !!ret;
 }
@@ -7,14 +7,94 @@
  */
 
 #include <stdarg.h>
+#include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sqlite3.h>
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #include "database.h"
+#include "hash.h"
 #include "logging.h"
 #include "protocol.h"
+#include "room.h"
+
+/**
+ * Database connection, with its statement cache
+ */
+struct db_conn {
+	sqlite3 *db;
+	struct ht *stmts;     /**< SQL -> cached statement    */
+	void **cached;        /**< Cached statements          */
+	size_t ncached;
+	unsigned long hits;   /**< db_cached() found the SQL  */
+	unsigned long misses; /**< db_cached() had to compile */
+
+	/* Group commit */
+	int in_txn;           /**< A group transaction is open       */
+	unsigned commit_ms;   /**< Commit this long after the first write */
+	unsigned commit_ops;  /**< ... or after this many writes     */
+	unsigned ops;         /**< Writes in the open transaction    */
+	long deadline;        /**< When it's due to be committed (ms) */
+	unsigned long commits;
+	unsigned long writes;
+};
+
+#define HANDLE(X) ((X) ? ((struct db_conn *)(X))->db : NULL)
+
+/**
+ * A queued write
+ */
+struct db_op {
+	struct db_op *next;
+	const char *sql;      /**< NULL for a db_sync() barrier   */
+	db_done_cb done;
+	void *userdata;
+	int ok;
+	long long rowid;
+	unsigned nargs;
+	struct {
+		char type;        /**< 'i', 'l', 'n', or 't' as in db_bind() */
+		long long i;
+		char *t;          /**< Points into text[]             */
+	} args[DB_WRITE_ARGS];
+	char text[];
+};
+
+/**
+ * The writer thread, and the queues between it and the event loop
+ */
+struct db_writer {
+	struct db_conn *conn;     /**< Only touched by the writer thread */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t more;      /**< Signalled when ops are queued     */
+	pthread_cond_t room;      /**< Signalled when the queue drains   */
+	struct db_op *head, **tail;
+	struct db_op *done;       /**< Committed ops with callbacks      */
+	unsigned depth;
+	int stop;
+	int fd[2];                /**< Completion notification (r, w)    */
+
+	/* Stats */
+	unsigned long queued;
+	unsigned long stalls;     /**< db_write() had to wait for room   */
+	unsigned max_depth;
+
+	/* The writer's copy of conn's counters, read by the loop */
+	size_t ncached;
+	unsigned long hits, misses;
+	unsigned long writes, commits;
+};
 
 static const char * const schema[] = {
 "PRAGMA application_id = 0x5054dead;",
@@ -42,7 +122,7 @@ static const char * const schema[] = {
 "INSERT INTO users(nickname,email,first,last) VALUES('nxuser', 'root@localhost', 'Nonexistent', 'User');",
 
 "CREATE TABLE user_devices("
-"	uid       INTEGER PRIMARY KEY REFERENCES users,"
+"	uid       INTEGER REFERENCES users,"
 "	device_id TEXT NOT NULL COLLATE NOCASE DEFAULT '',"
 "	logins    INT NOT NULL DEFAULT 0,"
 "	PRIMARY KEY(uid, device_id)"
@@ -163,8 +243,8 @@ static const char * const schema[] = {
 ") STRICT;",
 
 /* I don't remember what these were called, but they're hard-coded. */
-"INSERT INTO rooms(id,catg,r,v,p,l,c,nm) VALUES(0x01c2, 0x7601, 'G', 1, 0, 0, \"Welcome New Users\");",
-"INSERT INTO rooms(id,catg,r,v,p,l,c,nm) VALUES(0x0258, 0x7601, 'G', 1, 0, 0, \"Paltalk Support\");",
+"INSERT INTO rooms(id,catg,r,v,p,l,nm) VALUES(0x01c2, 0x7601, 'G', 1, 0, 0, \"Welcome New Users\");",
+"INSERT INTO rooms(id,catg,r,v,p,l,nm) VALUES(0x0258, 0x7601, 'G', 1, 0, 0, \"Paltalk Support\");",
 "UPDATE rooms SET created=datetime('now','subsec');",
 
 /* TODO: room_admins, owner? */
@@ -182,8 +262,8 @@ static const char * const schema[] = {
 "	uid     INTEGER REFERENCES users,"
 "	bouncer INTEGER REFERENCES users,"
 "	reason  TEXT DEFAULT '',"
-"	ts      TEXT NOT NULL DEFAULT '',",
-"	PRIMARY KEY(id, uid)",
+"	ts      TEXT NOT NULL DEFAULT '',"
+"	PRIMARY KEY(id, uid)"
 ") STRICT;",
 
 "CREATE TRIGGER IF NOT EXISTS users_delete BEFORE DELETE ON users BEGIN "
@@ -214,35 +294,32 @@ static const char * const schema[] = {
 "	id           INTEGER PRIMARY KEY AUTOINCREMENT,"
 "	complaintant INTEGER REFERENCES users,"
 "	subject      INTEGER REFERENCES users,"
-"	complaint    TEXT,"
+"	complaint    TEXT"
 ") STRICT;"
 };
 
 /**
- * Connection-level settings / temp tables
+ * Connection-level settings
  */
 static const char * const preamble[] = {
 	"PRAGMA foreign_keys = ON;",
 	"PRAGMA journal_mode = WAL;",
 	"PRAGMA temp_store = memory;",
 	"PRAGMA synchronous = NORMAL;",
-	"PRAGMA auto_vacuum = FULL;",
-
-	"CREATE TEMPORARY TABLE room_users("
-	"	id    INTEGER REFERENCES rooms,"
-	"	uid   INTEGER REFERENCES users,"
-	"	req   INT DEFAULT 0,"
-	"	mic   INT DEFAULT 0,"
-	"	pub   TEXT DEFAULT 'N',"
-	"	away  INT DEFAULT 0,"
-	"	invis INT DEFAULT 0,"
-	"	PRIMARY KEY(id, uid)"
-	") STRICT;"
+	"PRAGMA auto_vacuum = FULL;"
 };
 
-static const char * const epilogue[] = {
-	"DROP TABLE room_users"
-};
+/**
+ * The connection that's in group commit mode, if any
+ */
+static struct db_conn *group;
+
+/**
+ * Read-only connections shared between clients
+ */
+static const char *pool_path;
+static unsigned pool_next;
+static void *pool[DB_READ_POOL];
 
 /**
  * page_count will be zero if this is a new database file
@@ -268,29 +345,44 @@ static int check_application_id(void *userdata, int cols, char *val[], char *col
 	return SQLITE_OK;
 }
 
+/**
+ * room_population(id): Number of users in a room
+ */
+static void sql_room_population(sqlite3_context *c, int argc, sqlite3_value **argv)
+{
+	(void)argc;
+	sqlite3_result_int64(c, room_population(sqlite3_value_int64(argv[0])));
+}
+
 void *db_open(const char *path, const char mode)
 {
 	size_t i;
 	char *errmsg = NULL;
 	int ret = 0, flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+	struct db_conn *conn;
 	sqlite3 *db = NULL;
 
 	if (mode == 'w')
 		flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
 
+	if (!(conn = calloc(1, sizeof *conn)) ||
+	    !(conn->stmts = ht_alloc(HT_VALUE_DEFAULT, 0)))
+		abort();
+
 	if ((ret = sqlite3_open_v2(path, &db, flags, NULL)) != SQLITE_OK)
 		goto err;
 
 	/* Create the db if empty */
+	conn->db = db;
 	if (mode == 'w' && sqlite3_exec(db, "PRAGMA page_count;", check_page_count, db, NULL) != SQLITE_OK) {
-		db_begin(db);
+		db_begin(conn);
 		for (i = 0; i < sizeof schema / sizeof *schema; i++) {
 			if (sqlite3_exec(db, schema[i], NULL, NULL, &errmsg) != SQLITE_OK) {
 				ERROR(("Error executing schema item %lu", ++i));
 				goto err;
 			}
 		}
-		db_end(db);
+		db_end(conn);
 	}
 
 	/* Apply connection-level settings */
@@ -301,9 +393,18 @@ void *db_open(const char *path, const char mode)
 		}
 	}
 
+	/**
+	 * Room membership is owned by the event loop, which is the only user
+	 * of read connections.
+	 */
+	if (mode != 'w' &&
+	    (ret = sqlite3_create_function(db, "room_population", 1, SQLITE_UTF8,
+	                                   NULL, sql_room_population, NULL, NULL)) != SQLITE_OK)
+		goto err;
+
 	/* Make sure we're not looking at another app's db */
 	if (sqlite3_exec(db, "PRAGMA application_id;", check_application_id, NULL, NULL) == SQLITE_OK)
-		return db;
+		return conn;
 
 err:
 	if (ret && !errmsg) ERROR(("db_open(): %s", sqlite3_errstr(ret)));
@@ -312,21 +413,150 @@ err:
 		sqlite3_free(errmsg);
 	}
 
-	db_close(db);
+	db_close(conn);
 	return NULL;
 
 }
 
+/**
+ * Monotonic time in milliseconds
+ */
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+ * Called before a statement is stepped. If it's going to write via the
+ * group commit connection, make sure the group transaction is open.
+ */
+static void will_write(sqlite3_stmt *stmt)
+{
+	if (!group || sqlite3_db_handle(stmt) != group->db ||
+	    sqlite3_stmt_readonly(stmt))
+		return;
+
+	if (!group->in_txn) {
+		db_begin(group);
+		group->in_txn   = 1;
+		group->deadline = now_ms() + group->commit_ms;
+	}
+
+	group->ops++;
+	group->writes++;
+}
+
+/**
+ * Commit the open group transaction, if there is one
+ */
+static void db_flush(void *db)
+{
+	struct db_conn *conn = db;
+
+	if (!conn || !conn->in_txn)
+		return;
+
+	db_end(conn);
+	conn->in_txn = 0;
+	conn->ops    = 0;
+	conn->commits++;
+}
+
+/**
+ * Milliseconds until the open group transaction is due to be
+ * committed, or -1 if there isn't one.
+ */
+static int db_commit_timeout(void *db)
+{
+	long ms;
+	struct db_conn *conn = db;
+
+	if (!conn || !conn->in_txn)
+		return -1;
+
+	ms = conn->deadline - now_ms();
+	return ms > 0 ? (int)ms : 0;
+}
+
+/**
+ * Commit the open group transaction if it's due
+ */
+static void db_commit_if_due(void *db)
+{
+	struct db_conn *conn = db;
+
+	if (conn && conn->in_txn &&
+	    (conn->ops >= conn->commit_ops || !db_commit_timeout(conn)))
+		db_flush(conn);
+}
+
+/**
+ * Put a connection into group commit mode.
+ *
+ * Statements which only read never open a transaction. The first write
+ * opens one, and later writes join it until it's committed by
+ * db_commit_if_due() or db_flush(). Only one connection can be in this
+ * mode at a time.
+ */
+static void db_group_commit(void *db, unsigned ms, unsigned ops)
+{
+	if (group) db_flush(group);
+	if ((group = db)) {
+		group->commit_ms  = ms;
+		group->commit_ops = ops ? ops : 1;
+	}
+}
+
+void db_pool_init(const char *path)
+{
+	pool_path = path;
+	pool_next = 0;
+}
+
+void *db_pool_get(void)
+{
+	void **db = pool + (pool_next++ % DB_READ_POOL);
+
+	if (!*db && pool_path)
+		*db = db_open(pool_path, 'r');
+	return *db;
+}
+
+void db_pool_print_stats(void)
+{
+	unsigned i;
+	char name[16];
+
+	for (i = 0; i < DB_READ_POOL; i++) {
+		sprintf(name, "read %u", i);
+		db_print_stats(pool[i], name);
+	}
+}
+
+void db_pool_close(void)
+{
+	unsigned i;
+
+	for (i = 0; i < DB_READ_POOL; i++) {
+		if (pool[i])
+			db_close(pool[i]);
+		pool[i] = NULL;
+	}
+}
+
 const char *db_errmsg(void *db)
 {
-	return sqlite3_errmsg(db);
+	return sqlite3_errmsg(HANDLE(db));
 }
 
 void db_begin(void *db)
 {
 	char *errmsg = NULL;
 
-	if (sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, &errmsg) != SQLITE_OK)
+	if (sqlite3_exec(HANDLE(db), "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, &errmsg) != SQLITE_OK)
 		ERROR(("db_begin(): %s", errmsg));
 	sqlite3_free(errmsg);
 	return;
@@ -336,7 +566,7 @@ void db_end(void *db)
 {
 	char *errmsg = NULL;
 
-	if (sqlite3_exec(db, "COMMIT;", NULL, NULL, &errmsg) != SQLITE_OK)
+	if (sqlite3_exec(HANDLE(db), "COMMIT;", NULL, NULL, &errmsg) != SQLITE_OK)
 		ERROR(("db_end(): %s", errmsg));
 	sqlite3_free(errmsg);
 	return;
@@ -346,8 +576,18 @@ int db_exec(void *db, void *ud, const char *sql, int (*cb)(void *userdata, int c
 {
 	int ret = 0;
 	char *errmsg = NULL;
+	sqlite3_stmt *stmt;
 
-	if (sqlite3_exec(db, sql, cb, ud, &errmsg) != SQLITE_OK) {
+	/**
+	 * sqlite3_exec() doesn't tell us whether it's going to write,
+	 * so for the group commit connection, check first.
+	 */
+	if (db && db == group && sqlite3_prepare_v2(group->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+		if (stmt) will_write(stmt);
+		sqlite3_finalize(stmt);
+	}
+
+	if (sqlite3_exec(HANDLE(db), sql, cb, ud, &errmsg) != SQLITE_OK) {
 		ERROR(("db_exec: [%s] error: %s", sql, errmsg));
 		--ret;
 	}
@@ -359,41 +599,39 @@ int db_exec(void *db, void *ud, const char *sql, int (*cb)(void *userdata, int c
 /**
  * Transform a row (or rows) to a set of records
  *
- * \a userdata here is a char ** cast to void *.
+ * \a userdata here is a struct strbuf * cast to void *.
  */
 int db_row_to_record(void *userdata, int cols, char *val[], char *col[])
 {
 	int i;
-	char *buf = NULL, **out = (char **)userdata;
+	struct strbuf *out = userdata;
 
 	if (!userdata)
 		return SQLITE_ERROR;
 
 	for (i = 0; i < cols; i++)
-		buf = append_field(buf, col[i], val[i]);
-	*out = append_record(*out, buf);
-	free(buf);
+		sb_append_field(out, col[i], val[i]);
+	sb_end_record(out);
 	return SQLITE_OK;
 }
 
 /**
  * Transform a set of row values to a set of records
  *
- * \a userdata here is a char ** cast to void *.
+ * \a userdata here is a struct strbuf * cast to void *.
  */
 int db_values_to_record(void *userdata, int cols, char *val[], char *col[])
 {
 	int i;
-	char *buf = NULL, **out = (char **)userdata;
+	struct strbuf *out = userdata;
 	(void)col;
 
 	if (!userdata)
 		return SQLITE_ERROR;
 
 	for (i = 0; i < cols; i++)
-		buf = append_value(buf, val[i]);
-	*out = append_record(*out, buf);
-	free(buf);
+		sb_append_value(out, val[i]);
+	sb_end_record(out);
 	return SQLITE_OK;
 }
 
@@ -401,17 +639,58 @@ void *db_prepare(void *db, const char *sql)
 {
 	sqlite3_stmt *stmt;
 
-	if (sqlite3_prepare_v2(db, sql, (int)strlen(sql) + 1, &stmt, NULL) == SQLITE_OK)
+	if (sqlite3_prepare_v2(HANDLE(db), sql, (int)strlen(sql) + 1, &stmt, NULL) == SQLITE_OK)
 		return stmt;
 	return NULL;
 }
 
+void *db_cached(void *db, const char *sql)
+{
+	void *stmt;
+	struct db_conn *conn = db;
+
+	if (!conn || !sql)
+		return NULL;
+
+	if ((stmt = ht_get_ptr_nc(conn->stmts, sql))) {
+		conn->hits++;
+		db_reset_prepared(stmt);
+		return stmt;
+	}
+
+	conn->misses++;
+	if (sqlite3_prepare_v3(conn->db, sql, (int)strlen(sql) + 1,
+	                       SQLITE_PREPARE_PERSISTENT,
+	                       (sqlite3_stmt **)&stmt, NULL) != SQLITE_OK)
+		return NULL;
+
+	if (!(conn->cached = realloc(conn->cached, (conn->ncached + 1) * sizeof *conn->cached)) ||
+	    ht_set(conn->stmts, sql, HT_PTR, stmt))
+		abort();
+
+	conn->cached[conn->ncached++] = stmt;
+	return stmt;
+}
+
+void db_print_stats(void *db, const char *name)
+{
+	struct db_conn *conn = db;
+
+	if (!conn) return;
+	INFO(("db %s: %lu statements cached, %lu hits, %lu misses",
+	     name, (unsigned long)conn->ncached, conn->hits, conn->misses));
+
+	if (conn == group) {
+		INFO(("db %s: %lu writes in %lu commits",
+		     name, conn->writes, conn->commits));
+	}
+}
+
 void db_bind(void *stmt, const char *fmt, ...)
 {
 	size_t i = 1;
 	va_list ap;
 	const char *s;
-	int x;
 
 	if (!stmt || !fmt || !*fmt)
 		return;
@@ -420,8 +699,10 @@ void db_bind(void *stmt, const char *fmt, ...)
 	while (*fmt) {
 		switch (*fmt++) {
 		case 'i':
-			x = va_arg(ap, int);
-			sqlite3_bind_int(stmt, i++, x);
+			sqlite3_bind_int(stmt, i++, va_arg(ap, int));
+			break;
+		case 'l':
+			sqlite3_bind_int64(stmt, i++, (sqlite3_int64)va_arg(ap, unsigned long));
 			break;
 		case 'n':
 			sqlite3_bind_null(stmt, i++);
@@ -440,6 +721,7 @@ unsigned db_get_count(void *stmt)
 {
 	unsigned cnt = 0;
 
+	will_write(stmt);
 	if (sqlite3_step(stmt) == SQLITE_ROW) {
 		cnt = (unsigned)sqlite3_column_int(stmt, 0);
 		while (sqlite3_step(stmt) == SQLITE_ROW);
@@ -453,6 +735,7 @@ char *db_get_string(void *stmt)
 	char *out = NULL;
 	const unsigned char *s;
 
+	will_write(stmt);
 	if (sqlite3_step(stmt) == SQLITE_ROW) {
 		if ((s = sqlite3_column_text(stmt, 0)))
 			out = strdup((const char *)s);
@@ -462,6 +745,88 @@ char *db_get_string(void *stmt)
 	return out;
 }
 
+int db_get_records(void *stmt, struct strbuf *sb, int values)
+{
+	int i, cols, ret;
+	const char **k = NULL;
+	size_t *klen = NULL;
+	const char *v;
+
+	if (!stmt || !sb)
+		return -1;
+
+	cols = sqlite3_column_count(stmt);
+	will_write(stmt);
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		/**
+		 * Column names don't change from row to row, but can once the
+		 * first step has (re)prepared the statement, so look them up
+		 * then, like sqlite3_exec() does.
+		 */
+		if (!values && !k && cols) {
+			if (!(k = malloc(cols * sizeof *k)) || !(klen = malloc(cols * sizeof *klen)))
+				abort();
+
+			for (i = 0; i < cols; i++)
+				klen[i] = strlen(k[i] = sqlite3_column_name(stmt, i));
+		}
+
+		for (i = 0; i < cols; i++) {
+			if (!(v = (const char *)sqlite3_column_text(stmt, i)))
+				continue;
+
+			if (values)
+				sb_append_valuen(sb, v, (size_t)sqlite3_column_bytes(stmt, i));
+			else sb_append_fieldn(sb, k[i], klen[i], v, (size_t)sqlite3_column_bytes(stmt, i));
+		}
+
+		sb_end_record(sb);
+	}
+
+	free(k);
+	free(klen);
+	if (ret != SQLITE_DONE) {
+		ERROR(("db_get_records: %s", sqlite3_errmsg(sqlite3_db_handle(stmt))));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+
+	return 0;
+}
+
+int db_get_row(void *stmt, void *ud, int (*cb)(void *userdata, int cols, char *val[], char *col[]))
+{
+	int i, cols, ret;
+	char **val;
+
+	if (!stmt || !cb)
+		return -1;
+
+	will_write(stmt);
+	if ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		cols = sqlite3_column_count(stmt);
+		if (!(val = malloc((2 * (size_t)cols + 1) * sizeof *val)))
+			abort();
+
+		for (i = 0; i < cols; i++) {
+			val[i]        = (char *)sqlite3_column_text(stmt, i);
+			val[cols + i] = (char *)sqlite3_column_name(stmt, i);
+		}
+
+		cb(ud, cols, val, val + cols);
+		free(val);
+		while ((ret = sqlite3_step(stmt)) == SQLITE_ROW);
+	}
+
+	if (ret != SQLITE_DONE) {
+		ERROR(("db_get_row: %s", sqlite3_errmsg(sqlite3_db_handle(stmt))));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+
+	return 0;
+}
+
 char *db_get_prepared_sql(void *stmt)
 {
 	return sqlite3_expanded_sql(stmt);
@@ -471,6 +836,7 @@ int db_do_prepared(void *stmt)
 {
 	int i;
 
+	will_write(stmt);
 	do { i = sqlite3_step(stmt); } while (i == SQLITE_ROW);
 	return i == SQLITE_DONE;
 }
@@ -492,23 +858,398 @@ void db_free(void *p)
 }
 
 void db_close(void *db)
+{
+	size_t i;
+	struct db_conn *conn = db;
+
+	if (!conn) return;
+	if (conn == group) {
+		db_flush(conn);
+		group = NULL;
+	}
+
+	for (i = 0; i < conn->ncached; i++)
+		sqlite3_finalize(conn->cached[i]);
+
+	sqlite3_close_v2(conn->db);
+	ht_free(conn->stmts);
+	free(conn->cached);
+	free(conn);
+}
+
+
+/**
+ * Run a queued write on the writer's connection
+ */
+static void writer_exec(struct db_writer *w, struct db_op *op)
 {
 	unsigned i;
-	char *errmsg;
+	sqlite3_stmt *stmt;
 
-	for (i = 0; i < sizeof epilogue / sizeof *epilogue; i++) {
-		if (sqlite3_exec(db, epilogue[i], NULL, NULL, &errmsg) != SQLITE_OK) {
-			ERROR(("Error executing epilogue item %lu", ++i));
-			goto err;
+	if (!op->sql) {
+		db_flush(w->conn);
+		op->ok = 1;
+		return;
+	}
+
+	if (!(stmt = db_cached(w->conn, op->sql))) {
+		ERROR(("db_write: [%s] %s", op->sql, sqlite3_errmsg(w->conn->db)));
+		return;
+	}
+
+	for (i = 0; i < op->nargs; i++) {
+		switch (op->args[i].type) {
+		case 'i':
+		case 'l':
+			sqlite3_bind_int64(stmt, i + 1, op->args[i].i);
+			break;
+		case 't':
+			if (op->args[i].t) {
+				sqlite3_bind_text(stmt, i + 1, op->args[i].t, -1, SQLITE_STATIC);
+				break;
+			}
+			/* FALLTHRU */
+		default:
+			sqlite3_bind_null(stmt, i + 1);
+		}
+	}
+
+	if ((op->ok = db_do_prepared(stmt)))
+		op->rowid = sqlite3_last_insert_rowid(w->conn->db);
+	else ERROR(("db_write: [%s] %s", op->sql, sqlite3_errmsg(w->conn->db)));
+	db_reset_prepared(stmt);
+}
+
+/**
+ * Hand committed ops back to the event loop
+ */
+static void writer_deliver(struct db_writer *w, struct db_op *ops)
+{
+	int wake;
+	struct db_op *last;
+#ifdef __linux__
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+
+	if (!ops)
+		return;
+
+	for (last = ops; last->next; last = last->next);
+	pthread_mutex_lock(&w->lock);
+	wake        = !w->done;
+	last->next  = w->done;
+	w->done     = ops;
+	pthread_mutex_unlock(&w->lock);
+
+	/* Only wake the loop if it hasn't been woken already */
+	if (wake && write(w->fd[1], &one, sizeof one) < 0 && errno != EAGAIN)
+		ERROR(("db_write: failed to notify the event loop"));
+}
+
+/**
+ * Copy the connection's counters where db_writer_print_stats() can
+ * see them. Called by the writer with the lock held.
+ */
+static void writer_copy_stats(struct db_writer *w)
+{
+	w->ncached = w->conn->ncached;
+	w->hits    = w->conn->hits;
+	w->misses  = w->conn->misses;
+	w->writes  = w->conn->writes;
+	w->commits = w->conn->commits;
+}
+
+/**
+ * The writer thread: run whatever's queued, committing as we go. Ops
+ * with callbacks are held until the transaction they're part of is
+ * committed, so that the caller can rely on the read connections
+ * seeing the write.
+ */
+static void *writer_main(void *arg)
+{
+	int ms;
+	struct timespec ts;
+	struct db_writer *w = arg;
+	struct db_op *batch, *op, *next, *waiting = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop || w->head) {
+		if (!w->head && (ms = db_commit_timeout(w->conn))) {
+			if (ms < 0) pthread_cond_wait(&w->more, &w->lock);
+			else {
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				ts.tv_sec  += ms / 1000;
+				ts.tv_nsec += (ms % 1000) * 1000000L;
+				if (ts.tv_nsec >= 1000000000L) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait(&w->more, &w->lock, &ts);
+			}
+		}
+
+		batch    = w->head;
+		w->head  = NULL;
+		w->tail  = &w->head;
+		w->depth = 0;
+		pthread_cond_broadcast(&w->room);
+		pthread_mutex_unlock(&w->lock);
+
+		for (op = batch; op; op = next) {
+			next = op->next;
+			writer_exec(w, op);
+			if (op->done) {
+				op->next = waiting;
+				waiting  = op;
+			} else free(op);
+		}
+
+		db_commit_if_due(w->conn);
+		if (!w->conn->in_txn) {
+			writer_deliver(w, waiting);
+			waiting = NULL;
 		}
+
+		pthread_mutex_lock(&w->lock);
+		writer_copy_stats(w);
 	}
 
+	pthread_mutex_unlock(&w->lock);
+	db_flush(w->conn);
+	writer_deliver(w, waiting);
+	return NULL;
+}
+
+void *db_writer_open(const char *path)
+{
+	int flags;
+	struct db_writer *w;
+	pthread_condattr_t attr;
+
+	if (!(w = calloc(1, sizeof *w)))
+		abort();
+
+	w->tail  = &w->head;
+	w->fd[0] = w->fd[1] = -1;
+	if (!(w->conn = db_open(path, 'w')))
+		goto err;
+
+	db_group_commit(w->conn, DB_COMMIT_MS, DB_COMMIT_OPS);
+#ifdef __linux__
+	if ((w->fd[0] = w->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto err;
+#else
+	if (pipe(w->fd))
+		goto err;
+
+	flags = fcntl(w->fd[0], F_GETFL, 0);
+	fcntl(w->fd[0], F_SETFL, flags | O_NONBLOCK);
+	flags = fcntl(w->fd[1], F_GETFL, 0);
+	fcntl(w->fd[1], F_SETFL, flags | O_NONBLOCK);
+#endif
+
+	/* The commit deadline is measured on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->more, &attr);
+	pthread_cond_init(&w->room, NULL);
+	pthread_condattr_destroy(&attr);
+
+	if ((flags = pthread_create(&w->thread, NULL, writer_main, w))) {
+		ERROR(("db_writer_open: failed to start the writer: %s", strerror(flags)));
+		pthread_cond_destroy(&w->room);
+		pthread_cond_destroy(&w->more);
+		pthread_mutex_destroy(&w->lock);
+		goto err;
+	}
+
+	return w;
+
 err:
-	if (errmsg) {
-		ERROR(("db_close(): %s", errmsg));
-		sqlite3_free(errmsg);
+	if (w->fd[0] >= 0) close(w->fd[0]);
+	if (w->fd[1] >= 0 && w->fd[1] != w->fd[0]) close(w->fd[1]);
+	db_close(w->conn);
+	free(w);
+	return NULL;
+}
+
+/**
+ * Queue an op, waiting for room if the queue is full
+ */
+static int writer_queue(struct db_writer *w, struct db_op *op)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->stop) {
+		pthread_mutex_unlock(&w->lock);
+		free(op);
+		return -1;
 	}
 
-	sqlite3_close_v2(db);
+	while (w->depth >= DB_WRITE_QUEUE) {
+		w->stalls++;
+		pthread_cond_wait(&w->room, &w->lock);
+	}
+
+	*w->tail = op;
+	w->tail  = &op->next;
+	if (!w->depth++)
+		pthread_cond_signal(&w->more);
+	if (w->depth > w->max_depth)
+		w->max_depth = w->depth;
+	w->queued++;
+	pthread_mutex_unlock(&w->lock);
+	return 0;
 }
 
+int db_write(void *db_w, db_done_cb done, void *userdata, const char *sql, const char *fmt, ...)
+{
+	va_list ap;
+	struct db_op *op;
+	const char *f, *t;
+	size_t n = 0, len = 0;
+
+	if (!db_w || !sql || (fmt && strlen(fmt) > DB_WRITE_ARGS))
+		return -1;
+
+	/* Size up the text parameters, so the op can carry copies */
+	va_start(ap, fmt);
+	for (f = fmt; f && *f; f++) {
+		if (*f == 'i') (void)va_arg(ap, int);
+		else if (*f == 'l') (void)va_arg(ap, unsigned long);
+		else if (*f == 't' && (t = va_arg(ap, const char *)))
+			len += strlen(t) + 1;
+	}
+	va_end(ap);
+
+	if (!(op = malloc(sizeof *op + len)))
+		abort();
+
+	op->next     = NULL;
+	op->sql      = sql;
+	op->done     = done;
+	op->userdata = userdata;
+	op->ok       = 0;
+	op->rowid    = 0;
+	op->nargs    = 0;
+
+	va_start(ap, fmt);
+	for (f = fmt; f && *f; f++) {
+		op->args[op->nargs].type = *f;
+		op->args[op->nargs].t    = NULL;
+		switch (*f) {
+		case 'i':
+			op->args[op->nargs].i = va_arg(ap, int);
+			break;
+		case 'l':
+			op->args[op->nargs].i = (long long)va_arg(ap, unsigned long);
+			break;
+		case 't':
+			if ((t = va_arg(ap, const char *))) {
+				op->args[op->nargs].t = memcpy(op->text + n, t, strlen(t) + 1);
+				n += strlen(t) + 1;
+			}
+			break;
+		}
+		op->nargs++;
+	}
+	va_end(ap);
+
+	return writer_queue(db_w, op);
+}
+
+int db_sync(void *db_w, db_done_cb done, void *userdata)
+{
+	struct db_op *op;
+
+	if (!db_w)
+		return -1;
+
+	if (!(op = calloc(1, sizeof *op)))
+		abort();
+
+	op->done     = done;
+	op->userdata = userdata;
+	return writer_queue(db_w, op);
+}
+
+int db_writer_fd(void *db_w)
+{
+	return db_w ? ((struct db_writer *)db_w)->fd[0] : -1;
+}
+
+void db_writer_complete(void *db_w)
+{
+	struct db_writer *w = db_w;
+	struct db_op *op, *next, *prev = NULL;
+#ifdef __linux__
+	uint64_t buf;
+#else
+	char buf[64];
+#endif
+
+	if (!w) return;
+	while (read(w->fd[0], &buf, sizeof buf) > 0);
+
+	pthread_mutex_lock(&w->lock);
+	op      = w->done;
+	w->done = NULL;
+	pthread_mutex_unlock(&w->lock);
+
+	/* They were delivered newest first */
+	for (; op; op = next) {
+		next     = op->next;
+		op->next = prev;
+		prev     = op;
+	}
+
+	for (op = prev; op; op = next) {
+		next = op->next;
+		op->done(op->userdata, op->ok, op->rowid);
+		free(op);
+	}
+}
+
+void db_writer_print_stats(void *db_w)
+{
+	struct db_writer *w = db_w;
+
+	if (!w) return;
+	pthread_mutex_lock(&w->lock);
+	INFO(("db writer: %lu queued, %u waiting, %u max, %lu stalls",
+	     w->queued, w->depth, w->max_depth, w->stalls));
+	INFO(("db write: %lu statements cached, %lu hits, %lu misses",
+	     (unsigned long)w->ncached, w->hits, w->misses));
+	INFO(("db write: %lu writes in %lu commits", w->writes, w->commits));
+	pthread_mutex_unlock(&w->lock);
+}
+
+void db_writer_close(void *db_w)
+{
+	struct db_writer *w = db_w;
+	struct db_op *op, *next;
+
+	if (!w) return;
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->more);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	/* Nobody's left to call back */
+	for (op = w->done; op; op = next) {
+		next = op->next;
+		free(op);
+	}
+
+	pthread_cond_destroy(&w->room);
+	pthread_cond_destroy(&w->more);
+	pthread_mutex_destroy(&w->lock);
+	close(w->fd[0]);
+	if (w->fd[1] != w->fd[0])
+		close(w->fd[1]);
+	db_close(w->conn);
+	free(w);
+}
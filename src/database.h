@@ -10,7 +10,125 @@
 
 #define db_get_int(X) db_get_count((X))
 
+struct strbuf;
+
+/**
+ * Number of read-only connections shared by all clients
+ */
+#define DB_READ_POOL 4
+
+/**
+ * Group commit defaults: writes are committed at most DB_COMMIT_MS after
+ * the first write of a transaction, or once DB_COMMIT_OPS writes have
+ * accumulated, whichever comes first. That's the window of writes that
+ * could be lost if the server were to crash.
+ */
+#ifndef DB_COMMIT_MS
+#define DB_COMMIT_MS  50
+#endif
+
+#ifndef DB_COMMIT_OPS
+#define DB_COMMIT_OPS 256
+#endif
+
+/**
+ * Maximum number of writes that may be waiting for the writer thread.
+ * Once it's full, db_write() blocks until the writer catches up.
+ */
+#ifndef DB_WRITE_QUEUE
+#define DB_WRITE_QUEUE 4096
+#endif
+
+/**
+ * Maximum number of parameters for a queued write
+ */
+#define DB_WRITE_ARGS 16
+
+/**
+ * Completion callback for a queued write, called from the event loop
+ * once the write has been committed.
+ *
+ * \param ok    Non-zero if the statement succeeded
+ * \param rowid rowid of the last row inserted on the writer's connection
+ */
+typedef void (*db_done_cb)(void *userdata, int ok, long long rowid);
+
 void *db_open(const char *path, const char mode);
+
+/**
+ * Start the writer thread, which owns the only writable connection to
+ * the database, and commits what it's given in groups (see
+ * DB_COMMIT_MS / DB_COMMIT_OPS.)
+ *
+ * \return the writer, or NULL on error.
+ */
+void *db_writer_open(const char *path);
+
+/**
+ * Queue a write for the writer thread.
+ *
+ * \a sql must remain valid until the write has been run (use a string
+ * literal), since it also keys the writer's statement cache. \a fmt
+ * describes the parameters, as for db_bind(). Text parameters are
+ * copied.
+ *
+ * \param done Called once the write is committed (may be NULL)
+ * \return 0 if the write was queued, -1 otherwise.
+ */
+int db_write(void *db_w, db_done_cb done, void *userdata, const char *sql, const char *fmt, ...);
+
+/**
+ * Commit everything queued so far, without waiting for the commit
+ * interval, and call \a done (if given) once it's committed.
+ */
+int db_sync(void *db_w, db_done_cb done, void *userdata);
+
+/**
+ * File descriptor which becomes readable when completions are waiting
+ * to be run with db_writer_complete().
+ */
+int db_writer_fd(void *db_w);
+
+/**
+ * Run the callbacks for writes which have been committed
+ */
+void db_writer_complete(void *db_w);
+
+/**
+ * Log the writer's queue and statement cache statistics
+ */
+void db_writer_print_stats(void *db_w);
+
+/**
+ * Run anything still queued, commit, and stop the writer thread.
+ * Pending callbacks are discarded.
+ */
+void db_writer_close(void *db_w);
+
+/**
+ * Set up the read connection pool. Connections aren't opened until
+ * they're first needed.
+ */
+void db_pool_init(const char *path);
+
+/**
+ * Get a read-only connection from the pool, opening it if need be.
+ * Connections are handed out round-robin, and remain owned by the pool.
+ *
+ * \return the connection, or NULL if it couldn't be opened.
+ */
+void *db_pool_get(void);
+
+/**
+ * Log the statement cache statistics for each pooled connection
+ */
+void db_pool_print_stats(void);
+
+/**
+ * Close all pooled connections
+ */
+void db_pool_close(void);
+
 const char *db_errmsg(void *db);
 void db_begin(void *db);
 void db_end(void *db);
@@ -19,21 +137,59 @@ int db_exec(void *db, void *ud, const char *sql, int (*cb)(void *userdata, int c
 /**
  * Transform a row (or rows) to a set of records
  *
- * \a userdata here is a char ** cast to void *.
+ * \a userdata here is a struct strbuf * cast to void *.
  */
 int db_row_to_record(void *userdata, int cols, char *val[], char *col[]);
 
 /**
  * Transform a set of row values to a set of records
  *
- * \a userdata here is a char ** cast to void *.
+ * \a userdata here is a struct strbuf * cast to void *.
  */
 int db_values_to_record(void *userdata, int cols, char *val[], char *col[]);
 
 void *db_prepare(void *db, const char *sql);
+
+/**
+ * Get a prepared statement for \a sql from the connection's statement
+ * cache, compiling it on first use. The statement comes back reset,
+ * with its bindings cleared.
+ *
+ * Cached statements belong to the connection, and are finalized when
+ * it's closed, so don't pass them to db_free_prepared().
+ */
+void *db_cached(void *db, const char *sql);
+
+/**
+ * Log a connection's statement cache statistics
+ */
+void db_print_stats(void *db, const char *name);
+
+/**
+ * Bind parameters to a statement. Each character of \a fmt takes the
+ * next argument: 'i' an int, 'l' an unsigned long (uids, room ids),
+ * 't' a string (NULL binds NULL), and 'n' binds NULL without one.
+ */
 void db_bind(void *stmt, const char *fmt, ...);
 unsigned db_get_count(void *stmt);
 char *db_get_string(void *stmt);
+
+/**
+ * Step a prepared statement, appending each row to \a sb as a record,
+ * as db_row_to_record() does, or with \a values, db_values_to_record().
+ * The text of each column goes straight from SQLite into \a sb.
+ *
+ * \return 0 on success, or -1 on error.
+ */
+int db_get_records(void *stmt, struct strbuf *sb, int values);
+
+/**
+ * Step a prepared statement, passing its first row to \a cb as
+ * db_exec() would.
+ *
+ * \return 0 on success (whether or not there was a row), or -1 on error.
+ */
+int db_get_row(void *stmt, void *ud, int (*cb)(void *userdata, int cols, char *val[], char *col[]));
 char *db_get_prepared_sql(void *stmt);
 int db_do_prepared(void *stmt);
 void db_reset_prepared(void *stmt);
@@ -15,6 +15,7 @@
 #include "macros.h"
 #include "packet.h"
 #include "protocol.h"
+#include "proto_ops.h"
 #include "encode.h"
 #include "logging.h"
 
@@ -162,13 +163,13 @@ err:
 	return NULL;
 }
 
-static char *pt_decode_with_codebook(struct pt_context *ctx, unsigned short challenge, const char *s)
+static char *pt_decode_with_codebook(struct pt_context *ctx, unsigned short challenge, const char *s, size_t slen)
 {
 	unsigned n = 0, x, a, s_pos, a_pos;
-	size_t slen, i, j;
+	size_t i, j;
 	char *out = NULL;
 
-	if (!s || !(slen = strlen(s)) || slen & 3)
+	if (!s || !slen || slen & 3)
 		goto err;
 
 	/* The starting position is obtained from the first group */
@@ -213,14 +214,15 @@ err:
  * \return A newly-allocated string, or NULL on error.
  */
 char *pt_encode_with_challenge(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s)
+{
+	return ctx->ops->encode(ctx, variant, challenge, s);
+}
+
+char *pt_encode_classic(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s)
 {
 	size_t slen, i, o = 0;
 	char *out = NULL;
 
-	/* The old encoding was replaced with the codebook encoding in 8.2 */
-	if (ctx->protocol_version >= PROTOCOL_VERSION_82 && ctx->cb1_offset)
-		return pt_encode_with_codebook(ctx, challenge, s);
-
 	if (!variant || variant > 3 || !s || !(slen = strlen(s)) || !(out = calloc(1 + (slen << 2), 1)))
 		goto err;
 
@@ -273,16 +275,23 @@ err:
  * \return A newly-allocated string, or NULL on error.
  */
 char *pt_decode_with_challenge(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s)
+{
+	return pt_decoden_with_challenge(ctx, variant, challenge, s, s ? strlen(s) : 0);
+}
+
+char *pt_decoden_with_challenge(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s, size_t slen)
+{
+	return ctx->ops->decode(ctx, variant, challenge, s, slen);
+}
+
+char *pt_decode_classic(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s, size_t slen)
 {
 	unsigned n;
-	size_t slen, i;
+	size_t i;
 	char *out = NULL;
+	(void)ctx;
 
-	/* The old encoding was replaced with the codebook encoding in 8.2 */
-	if (ctx->protocol_version >= PROTOCOL_VERSION_82 && ctx->cb1_offset)
-		return pt_decode_with_codebook(ctx, challenge, s);
-
-	if (!variant || variant > 3 || !s || !(slen = strlen(s)) || slen & 3 || !(out = calloc(1 + (slen >> 2), 1)))
+	if (!variant || variant > 3 || !s || !slen || slen & 3 || !(out = calloc(1 + (slen >> 2), 1)))
 		goto err;
 
 	if (slen > DECODE_MAX_LEN) {
@@ -315,6 +324,24 @@ err:
 	return NULL;
 }
 
+/**
+ * The old encoding was replaced with the codebook encoding in 8.2, once
+ * the codebook has been cooked.
+ */
+char *pt_encode_codebook(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s)
+{
+	if (!ctx->cb1_offset)
+		return pt_encode_classic(ctx, variant, challenge, s);
+	return pt_encode_with_codebook(ctx, challenge, s);
+}
+
+char *pt_decode_codebook(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s, size_t slen)
+{
+	if (!ctx->cb1_offset)
+		return pt_decode_classic(ctx, variant, challenge, s, slen);
+	return pt_decode_with_codebook(ctx, challenge, s, slen);
+}
+
 int pt_validate(struct pt_context *ctx, unsigned variant, const char *s)
 {
 	size_t slen, i;
@@ -42,6 +42,12 @@
  */
 #define pt_decode(c,v,s) pt_decode_with_challenge((c), (v), (c)->challenge, (s))
 
+/**
+ * As pt_decode(), for the \a n bytes at \a s, which needn't be
+ * NUL-terminated.
+ */
+#define pt_decoden(c,v,s,n) pt_decoden_with_challenge((c), (v), (c)->challenge, (s), (n))
+
 /**
  * Write the given unsigned short as a string into the supplied
  * buffer with the given number of digits.
@@ -80,6 +86,20 @@ char *pt_encode_with_challenge(struct pt_context *ctx, unsigned variant, unsigne
  * \return A newly-allocated string, or NULL on error.
  */
 char *pt_decode_with_challenge(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s);
+char *pt_decoden_with_challenge(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s, size_t slen);
+
+/**
+ * The encodings behind pt_encode_with_challenge() and
+ * pt_decoden_with_challenge(), selected by the context's protocol ops.
+ *
+ * The classic encoding is used by every version up to 8.2. The codebook
+ * encoding is used by 8.2+ once pt_encode_cook_codebook() has been called,
+ * before which they fall back to the classic encoding.
+ */
+char *pt_encode_classic(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s);
+char *pt_decode_classic(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s, size_t slen);
+char *pt_encode_codebook(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s);
+char *pt_decode_codebook(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s, size_t slen);
 
 /**
  * Validate the check digits in the encoded string
@@ -8,14 +8,20 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
 
+#include "logging.h"
 #include "hash.h"
 
+#ifndef HT_SWISS
+
 #define max(X,Y) ((X) > (Y) ? (X) : (Y))
+#define min(X,Y) ((X) < (Y) ? (X) : (Y))
 
 /**
  * Default table size
@@ -39,9 +45,27 @@
 #define HT_GAP_L 313
 
 /**
- * Hash table flags
+ * Resize thresholds
+ *
+ * The table grows once it's 75% full (counting tombstones), and shrinks
+ * once it's less than 12.5% full. Either resize leaves the table well
+ * away from both thresholds, so churn around one of them won't cause
+ * repeated resizes.
  */
-#define HT_RESIZE 0x10 /**< The table is being resized */
+#define HT_GROW(T) \
+	((T)->size + (T)->dead >= ((T)->capacity >> 1) + ((T)->capacity >> 2))
+#define HT_SHRINK(T) \
+	((T)->size < ((T)->capacity >> 3) && (T)->capacity > HT_DEFAULT_SIZE)
+
+/**
+ * Number of slots migrated from the old table to the new one on each
+ * ht_set() / ht_rm() during a resize.
+ *
+ * When growing, the old table is drained after capacity / 16 calls,
+ * which can add at most 1/32 of the new capacity, so the new table
+ * can't reach its own threshold before the migration is finished.
+ */
+#define HT_REHASH_STEP 16
 
 /**
  * Representation of a hash table entry
@@ -61,17 +85,33 @@ struct entry {
 };
 
 /**
- * Hash table
+ * Table of entries
  */
-struct ht {
+struct table {
 	struct entry *e;       /**< Entries                     */
 	unsigned int gap;      /**< Probe gap                   */
 	unsigned int max_pd;   /**< Max probe depth             */
 	unsigned int size;     /**< Current table size (entries)*/
+	unsigned int dead;     /**< Number of tombstones        */
 	unsigned int capacity; /**< Table capacity (power of 2) */
 	unsigned int mask;     /**< Mask (mod capacity)         */
+};
+
+/**
+ * Hash table
+ *
+ * Resizing allocates a new table, and the entries in the old table are
+ * migrated a few slots at a time, so that no single operation has to
+ * rehash the whole table. Until that's done, lookups check both tables.
+ */
+struct ht {
+	struct table t;        /**< Current table               */
+	struct table old;      /**< Table being migrated        */
+	unsigned int migrate;  /**< Next slot to migrate        */
 	unsigned int flags;    /**< Flags                       */
 	unsigned long v;       /**< Initial hash value          */
+	unsigned long resizes; /**< Number of resizes           */
+	unsigned long rs_ns;   /**< Time spent resizing (ns)    */
 };
 
 /**
@@ -103,137 +143,134 @@ static unsigned int hash(const char *s, unsigned long v)
 	return (v & ~HT_TOMBSTONE) | 1;
 }
 
-static unsigned int search(struct ht *ht, const char *key)
+static int table_alloc(struct table *t, unsigned int capacity)
 {
-	unsigned int i, h, j = 1, q = 0;
+	capacity = max(capacity, HT_DEFAULT_SIZE);
+	if (!(t->e = calloc(capacity, sizeof *t->e)))
+		return ENOMEM;
+
+	t->size     = 0;
+	t->dead     = 0;
+	t->max_pd   = 0;
+	t->capacity = capacity;
+	t->mask     = capacity - 1;
+	t->gap      = (capacity > 8000) ? HT_GAP_L : HT_GAP_S;
+	return 0;
+}
 
-	h = hash(key, ht->v);
-	i = h & ht->mask;
+static unsigned int search(const struct table *t, const char *key,
+                           unsigned int h)
+{
+	unsigned int i, j = 1, q = 0;
 
-	while (ht->e[i].h && j <= ht->max_pd) {
-		if (ht->e[i].h == h && !strcmp(ht->e[i].k, key))
+	i = h & t->mask;
+	while (t->e[i].h && j <= t->max_pd) {
+		if (t->e[i].h == h && !strcmp(t->e[i].k, key))
 			return i;
-		i = (i + (q += ht->gap)) & ht->mask;
+		++j;
+		i = (i + (q += t->gap)) & t->mask;
 	}
 
-	errno = ENOENT;
 	return UINT_MAX;
 }
 
-static unsigned int insert(struct ht *ht, const char *key,
-                           const void *v, unsigned char t)
+/**
+ * Find the table and index of the entry for \a key
+ *
+ * \return the table, or NULL (with errno = ENOENT) if not found.
+ */
+static struct table *find(struct ht *ht, const char *key, unsigned int h,
+                          unsigned int *i)
 {
-	unsigned int h, i = 0, j = 1, q = 0, ret = 0;
-	char *k = NULL;
-	assert(ht);
+	if ((*i = search(&ht->t, key, h)) != UINT_MAX)
+		return &ht->t;
 
-	/**
-	 * Copy the key unless it's static
-	 */
-	if (!(ht->flags & (HT_STATIC_KEYS | HT_RESIZE))) {
-		if (!(k = malloc(strlen(key) + 1))) {
-			errno = ENOMEM;
-			goto err;
-		}
+	if (ht->old.e && (*i = search(&ht->old, key, h)) != UINT_MAX)
+		return &ht->old;
 
-		memcpy(k, key, strlen(key) + 1);
-	} else memcpy(&k, &key, sizeof key);
+	errno = ENOENT;
+	return NULL;
+}
 
-	/**
-	 * Search for a suitable place to add the new entry
-	 */
-	h = hash(key, ht->v);
-	i = h & ht->mask;
+/**
+ * Find a free (or dead) slot for a key that isn't in the table
+ */
+static unsigned int place(struct table *t, unsigned int h)
+{
+	unsigned int i, j = 1, q = 0;
 
-	while (ht->e[i].h & ~HT_TOMBSTONE) {
-		if (ht->e[i].h == h && !strcmp(ht->e[i].k, key))
-			goto ret;
+	i = h & t->mask;
+	while (t->e[i].h && !(t->e[i].h & HT_TOMBSTONE)) {
 		++j;
-		i = (i + (q += ht->gap)) & ht->mask;
+		i = (i + (q += t->gap)) & t->mask;
 	}
 
-	/**
-	 * Finally, insert our entry
-	 */
-	ht->max_pd = max(ht->max_pd, j);
-	ht->e[i].k = k;
-	ht->e[i].h = h;
-	ht->e[i].t = t;
-	k = NULL;
-
-	switch (t) {
-	case HT_LONG: ht->e[i].v.l = *(const unsigned long *)v; break;
-	case HT_PTR:  ht->e[i].v.p = v;                         break;
-	default: /* HT_STR */
-		if (!(ht->e[i].v.s = malloc(strlen((const char *)v) + 1))) {
-			if (!(ht->flags & HT_STATIC_KEYS))
-				free(ht->e[i].k);
-			errno = ENOMEM;
-			goto err;
-		}
-		memcpy(ht->e[i].v.nc, v, strlen((const char *)v) + 1);
-	}
-
-	++ht->size;
-
-ret:
-	if (!(ht->flags & (HT_STATIC_KEYS | HT_RESIZE))) free(k);
-	return ret;
-
-err:
-	ret = UINT_MAX;
-	goto ret;
+	if (t->e[i].h) --t->dead;
+	t->max_pd = max(t->max_pd, j);
+	return i;
 }
 
-static int resize(struct ht *ht, unsigned int capacity)
+static unsigned long elapsed_ns(const struct timespec *start)
 {
-	int ret = -1;
-	unsigned int i, j, _c, _sz;
-	struct entry *e = ht->e;
-	const void *v;
-
-	assert(ht);
-	_c  = ht->capacity;
-	_sz = ht->size;
-	capacity = max(capacity, HT_DEFAULT_SIZE);
-	if (!(ht->e = calloc(capacity, sizeof *e)))
-		goto nomem;
-
-	ht->size     = 0;
-	ht->max_pd   = 0;
-	ht->capacity = capacity;
-	ht->mask     = capacity - 1;
-	ht->gap      = (capacity > 8000) ? HT_GAP_L : HT_GAP_S;
-	ht->flags   |= HT_RESIZE;
+	struct timespec ts;
 
-	/**
-	 * Re-hash entries from the original table, skipping dead and
-	 * non-existent entries.
-	 */
-	for (i=0, j = 0; i < _c && j < _sz; i++) {
-		if (e[i].h) ++j;
-		if (!e[i].k || e[i].h & HT_TOMBSTONE)
-			continue;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)((ts.tv_sec - start->tv_sec) * 1000000000L +
+	                       (ts.tv_nsec - start->tv_nsec));
+}
 
-		switch(e[i].t) {
-		case HT_LONG: v = &e[i].v.l; break;
-		default:      v = e[i].v.p;  break;
+/**
+ * Move up to \a n slots' worth of entries from the old table into the
+ * current one, freeing the old table once it's empty.
+ */
+static void migrate(struct ht *ht, unsigned int n)
+{
+	struct entry *e;
+	struct timespec start;
+
+	if (!ht->old.e)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (ht->old.e && n--) {
+		e = &ht->old.e[ht->migrate];
+		if (e->h && !(e->h & HT_TOMBSTONE)) {
+			ht->t.e[place(&ht->t, e->h)] = *e;
+			++ht->t.size;
+			--ht->old.size;
 		}
 
-		insert(ht, e[i].k, v, e[i].t);
+		if (++ht->migrate == ht->old.capacity) {
+			free(ht->old.e);
+			memset(&ht->old, 0, sizeof ht->old);
+			ht->migrate = 0;
+		}
 	}
 
-	free(e);
-	++ret;
+	ht->rs_ns += elapsed_ns(&start);
+}
 
-ret:
-	ht->flags &= ~HT_RESIZE;
-	return ret;
+/**
+ * Start migrating to a new table of the given capacity.
+ */
+static int resize(struct ht *ht, unsigned int capacity)
+{
+	struct table t;
+	struct timespec start;
 
-nomem:
-	ht->e = e;
-	ret = ENOMEM;
-	goto ret;
+	/* Finish any migration that's already in progress */
+	migrate(ht, UINT_MAX);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (table_alloc(&t, capacity))
+		return ENOMEM;
+
+	ht->old     = ht->t;
+	ht->t       = t;
+	ht->migrate = 0;
+	ht->resizes++;
+	ht->rs_ns  += elapsed_ns(&start);
+	return 0;
 }
 
 /**
@@ -249,12 +286,10 @@ struct ht *ht_alloc(unsigned long value, unsigned flags)
 	if (!(ht = calloc(sizeof *ht, 1)))
 		goto ret;
 
-	ht->flags  = flags;
-	ht->v      = value;
-	ht->gap    = HT_GAP_S;
-	ht->max_pd = 0;
+	ht->flags = flags;
+	ht->v     = value;
 
-	if (resize(ht, HT_DEFAULT_SIZE)) {
+	if (table_alloc(&ht->t, HT_DEFAULT_SIZE)) {
 		free(ht);
 		ht = NULL;
 	}
@@ -276,6 +311,7 @@ ret:
 static const void *ht_get(struct ht *ht, const char *key, unsigned int type)
 {
 	unsigned int i;
+	struct table *t;
 
 	if (!ht || !key || !*key || type > HT_MAX) {
 		errno = EINVAL;
@@ -284,16 +320,16 @@ static const void *ht_get(struct ht *ht, const char *key, unsigned int type)
 
 	errno = 0;
 
-	if ((i = search(ht, key)) == UINT_MAX)
+	if (!(t = find(ht, key, hash(key, ht->v), &i)))
 		goto ret;
 
-	if (ht->e[i].t != type)
+	if (t->e[i].t != type)
 		goto etype;
 
-	switch (ht->e[i].t) {
-	case HT_LONG: return (const void *)&ht->e[i].v.l;
-	case HT_STR:  return ht->e[i].v.s;
-	default:      return ht->e[i].v.p;
+	switch (t->e[i].t) {
+	case HT_LONG: return (const void *)&t->e[i].v.l;
+	case HT_STR:  return t->e[i].v.s;
+	default:      return t->e[i].v.p;
 	}
 
 ret:
@@ -390,12 +426,11 @@ void *ht_get_ptr_nc(struct ht *ht, const char *key)
  * Remove an entry from a hash table
  *
  * This function will shrink the table if the load factor falls below
- * 25%.
+ * 12.5%.
  *
  * Returns the following errors:
  *
  * EINVAL  - Invalid arguments
- * ENOMEM  - Out of memory while shrinking the table
  *
  * \param[in] ht  Hash table
  * \param[in] key Key to find
@@ -403,25 +438,30 @@ void *ht_get_ptr_nc(struct ht *ht, const char *key)
  */
 int ht_rm(struct ht *ht, const char *key)
 {
-	unsigned i;
-	if (!ht || !key || !*key) return EINVAL;
-	if (!ht->size)            goto ret;
+	unsigned int i;
+	struct table *t;
+	struct entry *e;
 
-	if ((i = search(ht, key)) == UINT_MAX)
-		return (errno == ENOENT) ? 0 : -1;
+	if (!ht || !key || !*key) return EINVAL;
 
-	--ht->size;
-	ht->e[i].k    = NULL;
-	ht->e[i].v.nc = NULL;
-	ht->e[i].h   |= HT_TOMBSTONE;
+	migrate(ht, HT_REHASH_STEP);
+	if (!(t = find(ht, key, hash(key, ht->v), &i)))
+		goto ret;
 
-	if (ht->e[i].t == HT_STR) free(ht->e[i].v.nc);
+	e = &t->e[i];
+	if (e->t == HT_STR) free(e->v.nc);
 	if (!(ht->flags & HT_STATIC_KEYS))
-		free(ht->e[i].k);
+		free(e->k);
 
-	/* If our load factor drops below 25%, resize the table */
-	if (ht->size < (ht->capacity >> 2))
-		resize(ht, ht->size >> 1);
+	e->k    = NULL;
+	e->v.nc = NULL;
+	e->h   |= HT_TOMBSTONE;
+	--t->size;
+	++t->dead;
+
+	/* If our load factor drops below 12.5%, shrink the table */
+	if (!ht->old.e && HT_SHRINK(&ht->t))
+		resize(ht, ht->t.capacity >> 1);
 
 ret:
 	return 0;
@@ -439,16 +479,79 @@ ret:
 int ht_set(struct ht *ht, const char *key, unsigned char type,
            const void *in)
 {
+	unsigned int i, h, n;
+	struct table *t;
+	union value v;
+	char *k;
+
 	if (!ht || !in || !key || !*key || type > HT_MAX)
 		return EINVAL;
 
+	switch (type) {
+	case HT_LONG: v.l = *(const unsigned long *)in; break;
+	case HT_PTR:  v.p = in;                         break;
+	default: /* HT_STR */
+		if (!(v.nc = malloc(strlen((const char *)in) + 1)))
+			return ENOMEM;
+		memcpy(v.nc, in, strlen((const char *)in) + 1);
+	}
+
+	migrate(ht, HT_REHASH_STEP);
+
+	/* Replace an existing entry */
+	h = hash(key, ht->v);
+	if ((t = find(ht, key, h, &i))) {
+		if (t->e[i].t == HT_STR) free(t->e[i].v.nc);
+		t->e[i].v = v;
+		t->e[i].t = type;
+		return 0;
+	}
+
 	/**
-	 * Resize the table if our load factor goes above 75%
+	 * Grow the table if our load factor goes above 75%. If that's
+	 * mostly tombstones, a new table of the same size will do.
 	 */
-	if (ht->size > (ht->capacity >> 1) + (ht->capacity >> 2))
-		resize(ht, ht->capacity << 1);
+	if (HT_GROW(&ht->t)) {
+		n = ht->t.size + ht->old.size;
+		if (resize(ht, ht->t.capacity << (n >= (ht->t.capacity >> 1))))
+			goto nomem;
+	}
 
-	return ((insert(ht, key, in, type)) == UINT_MAX) ? errno : 0;
+	/**
+	 * Copy the key unless it's static
+	 */
+	if (ht->flags & HT_STATIC_KEYS)
+		memcpy(&k, &key, sizeof key);
+	else if (!(k = malloc(strlen(key) + 1)))
+		goto nomem;
+	else memcpy(k, key, strlen(key) + 1);
+
+	i = place(&ht->t, h);
+	ht->t.e[i].k = k;
+	ht->t.e[i].h = h;
+	ht->t.e[i].t = type;
+	ht->t.e[i].v = v;
+	++ht->t.size;
+	return 0;
+
+nomem:
+	if (type == HT_STR) free(v.nc);
+	return ENOMEM;
+}
+
+static void table_free(struct table *t, unsigned int flags)
+{
+	unsigned int i;
+
+	for (i = 0; t->e && i < t->capacity; i++) {
+		if (!t->e[i].k)
+			continue;
+
+		if (t->e[i].t == HT_STR) free(t->e[i].v.nc);
+		if (!(flags & HT_STATIC_KEYS))
+			free(t->e[i].k);
+	}
+	free(t->e);
 }
 
 /**
@@ -458,14 +561,76 @@ int ht_set(struct ht *ht, const char *key, unsigned char type,
  */
 void ht_free(struct ht *ht)
 {
-	unsigned int i;
 	if (!ht) return;
 
-	if (!(ht->flags & HT_STATIC_KEYS)) {
-		for (i = 0; i < ht->capacity; i++)
-			free(ht->e[i].k);
-	}
-	free(ht->e);
+	table_free(&ht->t, ht->flags);
+	table_free(&ht->old, ht->flags);
 	free(ht);
 }
 
+/**
+ * Add the probe lengths of a table's entries to the histogram
+ */
+static void table_stats(const struct table *t, struct ht_stats *st)
+{
+	unsigned int i, j, k, q;
+
+	for (i = 0; t->e && i < t->capacity; i++) {
+		if (!t->e[i].h || t->e[i].h & HT_TOMBSTONE)
+			continue;
+
+		/* Walk the probe sequence from home, until we get here */
+		for (j = 1, q = 0, k = t->e[i].h & t->mask;
+		     k != i && j < t->max_pd; ++j)
+			k = (k + (q += t->gap)) & t->mask;
+
+		st->probes[min(j, HT_PROBE_HIST) - 1]++;
+	}
+
+	st->size       += t->size;
+	st->tombstones += t->dead;
+	st->max_pd      = max(st->max_pd, t->max_pd);
+}
+
+void ht_stats(struct ht *ht, struct ht_stats *st)
+{
+	memset(st, 0, sizeof *st);
+	if (!ht) return;
+
+	table_stats(&ht->t, st);
+	table_stats(&ht->old, st);
+	st->capacity  = ht->t.capacity;
+	st->migrating = ht->old.size;
+	st->resizes   = ht->resizes;
+	st->resize_ns = ht->rs_ns;
+}
+
+#endif /* !HT_SWISS */
+
+/**
+ * These are shared with hash_swiss.c
+ */
+void ht_log_stats(const char *name, const struct ht_stats *st)
+{
+	unsigned i;
+	char hist[HT_PROBE_HIST * 32], *p = hist;
+
+	for (i = 0; i < HT_PROBE_HIST; i++) {
+		p += sprintf(p, " %u%s:%lu", i + 1,
+		             (i == HT_PROBE_HIST - 1) ? "+" : "", st->probes[i]);
+	}
+
+	INFO(("hash %s: %lu/%lu entries, %lu tombstones, %lu migrating, "
+	      "max_pd %lu", name, st->size, st->capacity, st->tombstones,
+	      st->migrating, st->max_pd));
+	INFO(("hash %s: %lu resizes in %lu us, probes%s", name, st->resizes,
+	      st->resize_ns / 1000, hist));
+}
+
+void ht_print_stats(struct ht *ht, const char *name)
+{
+	struct ht_stats st;
+
+	ht_stats(ht, &st);
+	ht_log_stats(name, &st);
+}
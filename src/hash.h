@@ -14,9 +14,15 @@
  * Hash table implementation intended for indexing
  * small (< 32,768 entries) sets of data.
  *
+ * The default implementation (hash.c) is resized incrementally: once
+ * a resize starts, each ht_set() / ht_rm() moves a few entries to the
+ * new table, rather than rehashing everything at once.
+ *
  * Useful Preprocessor Defines:
  *
- * HT_STATS - Statistics
+ * HT_SWISS - Use the SwissTable-style implementation in hash_swiss.c,
+ *            which probes 16 slots at a time and isn't size-limited.
+ *            It rehashes every entry at once when it resizes.
  */
 
 /**
@@ -37,6 +43,30 @@
  */
 #define HT_STATIC_KEYS 0x01 /**< Don't duplicate keys */
 
+/**
+ * Number of buckets in the probe length histogram. The last bucket
+ * counts every entry that's at least that many probes from home.
+ */
+#define HT_PROBE_HIST 8
+
+/**
+ * Hash table statistics
+ */
+struct ht_stats {
+	unsigned long size;       /**< Number of entries                 */
+	unsigned long capacity;   /**< Number of slots                   */
+	unsigned long tombstones; /**< Number of dead slots              */
+	unsigned long migrating;  /**< Entries left to move in a resize  */
+	unsigned long max_pd;     /**< Max probe depth                   */
+	unsigned long resizes;    /**< Number of resizes                 */
+	unsigned long resize_ns;  /**< Time spent resizing (nanoseconds) */
+
+	/**
+	 * Number of entries found after 1, 2, ... probes
+	 */
+	unsigned long probes[HT_PROBE_HIST];
+};
+
 struct ht;
 
 /**
@@ -157,7 +187,6 @@ void *ht_get_ptr_nc(struct ht *ht, const char *key);
  * Returns the following errors:
  *
  * EINVAL  - Invalid arguments
- * ENOMEM  - Out of memory
  *
  * \param[in] ht  Hash table
  * \param[in] key Key to find
@@ -184,9 +213,26 @@ int ht_set(struct ht *ht, const char *key, unsigned char type,
  */
 void ht_free(struct ht *ht);
 
-#ifdef HT_STATS
-void ht_print_stats(struct ht *ht);
-#endif
+/**
+ * Get a hash table's statistics
+ *
+ * The counters are kept as the table is used, but the probe length
+ * histogram is built by walking the table, so this is O(capacity).
+ *
+ * \param[in]  ht Hash table
+ * \param[out] st Statistics
+ */
+void ht_stats(struct ht *ht, struct ht_stats *st);
+
+/**
+ * Log a set of hash table statistics
+ */
+void ht_log_stats(const char *name, const struct ht_stats *st);
+
+/**
+ * Log a hash table's statistics
+ */
+void ht_print_stats(struct ht *ht, const char *name);
 
 #endif /* HASH_H */
 
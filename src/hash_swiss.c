@@ -0,0 +1,510 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * Alternate hash table implementation (make CFLAGS=-DHT_SWISS)
+ *
+ * This is laid out like a SwissTable: slots are split into groups of
+ * 16, and each slot has a control byte holding 7 bits of its hash (or
+ * a marker for empty / deleted slots.) A lookup compares the control
+ * bytes of a whole group at once, and only looks at the keys whose
+ * control bytes match, so most probes only touch the control array.
+ *
+ * Keys, values and types are kept in separate arrays, and the table
+ * isn't limited in size by the hash, so it's suitable for millions of
+ * entries.
+ */
+#ifdef HT_SWISS
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hash.h"
+
+/**
+ * Slots per group, and the minimum table size
+ */
+#define HT_GROUP        16
+#define HT_DEFAULT_SIZE 32
+
+/**
+ * Control bytes. Full slots hold the low 7 bits of the hash.
+ */
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xfe
+
+/**
+ * Maximum load, including deleted slots: 7/8
+ */
+#define HT_MAX_LOAD(C) ((C) - ((C) >> 3))
+
+union value {
+	unsigned long l;
+	const char *s;
+	const void *p;
+	void *nc;
+};
+
+/**
+ * Hash table
+ */
+struct ht {
+	unsigned char *ctrl;   /**< Control bytes               */
+	char **k;              /**< Keys                        */
+	union value *v;        /**< Values                      */
+	unsigned char *t;      /**< Value types                 */
+	size_t size;           /**< Number of entries           */
+	size_t deleted;        /**< Number of deleted slots     */
+	size_t capacity;       /**< Number of slots (power of 2)*/
+	size_t gmask;          /**< Number of groups - 1        */
+	size_t max_pd;         /**< Max probe depth (groups)    */
+	unsigned int flags;    /**< Flags                       */
+	unsigned long v0;      /**< Initial hash value          */
+	unsigned long resizes; /**< Number of resizes           */
+	unsigned long rs_ns;   /**< Time spent resizing (ns)    */
+};
+
+/**
+ * 64-bit FNV-1a Hash Function
+ * See: http://isthe.com/chongo/tech/comp/fnv
+ */
+static uint64_t hash(const char *s, unsigned long v)
+{
+	uint64_t h = v ? v : UINT64_C(14695981039346656037);
+
+	assert(s && *s);
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * UINT64_C(1099511628211);
+
+	/* Fold the high bits in, since the low bits are used for the ctrl byte */
+	return h ^ (h >> 32);
+}
+
+/**
+ * Bit mask of the slots in a group whose control byte is \a c
+ */
+static unsigned match(const unsigned char *g, unsigned char c)
+{
+#ifdef __SSE2__
+	return (unsigned)_mm_movemask_epi8(
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)g), _mm_set1_epi8((char)c))
+	);
+#else
+	unsigned i, m = 0;
+
+	for (i = 0; i < HT_GROUP; i++)
+		m |= (unsigned)(g[i] == c) << i;
+	return m;
+#endif
+}
+
+/**
+ * Bit mask of the slots in a group which are empty or deleted
+ */
+static unsigned match_free(const unsigned char *g)
+{
+#ifdef __SSE2__
+	/* Only the empty and deleted markers have the high bit set */
+	return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+#else
+	unsigned i, m = 0;
+
+	for (i = 0; i < HT_GROUP; i++)
+		m |= (unsigned)(g[i] >> 7) << i;
+	return m;
+#endif
+}
+
+static unsigned lowest_bit(unsigned m)
+{
+#ifdef __GNUC__
+	return (unsigned)__builtin_ctz(m);
+#else
+	unsigned i = 0;
+
+	while (!(m & 1)) {
+		m >>= 1;
+		++i;
+	}
+	return i;
+#endif
+}
+
+/**
+ * Find the slot holding \a key
+ *
+ * Groups are probed in triangular order, which visits every group when
+ * the number of groups is a power of 2. A group with an empty slot ends
+ * the search.
+ *
+ * \return the slot index, or SIZE_MAX (with errno = ENOENT.)
+ */
+static size_t search(struct ht *ht, const char *key, uint64_t h)
+{
+	unsigned m;
+	size_t g, i, step = 0;
+	const unsigned char *ctrl;
+
+	for (g = (h >> 7) & ht->gmask;; g = (g + ++step) & ht->gmask) {
+		ctrl = ht->ctrl + g * HT_GROUP;
+		for (m = match(ctrl, h & 0x7f); m; m &= m - 1) {
+			i = g * HT_GROUP + lowest_bit(m);
+			if (!strcmp(ht->k[i], key))
+				return i;
+		}
+
+		if (match(ctrl, CTRL_EMPTY) || step > ht->gmask)
+			break;
+	}
+
+	errno = ENOENT;
+	return SIZE_MAX;
+}
+
+/**
+ * Find a free slot for a key that isn't in the table
+ */
+static size_t find_free(struct ht *ht, uint64_t h)
+{
+	unsigned m;
+	size_t g, step = 0;
+
+	for (g = (h >> 7) & ht->gmask;; g = (g + ++step) & ht->gmask) {
+		if ((m = match_free(ht->ctrl + g * HT_GROUP))) {
+			if (step + 1 > ht->max_pd)
+				ht->max_pd = step + 1;
+			return g * HT_GROUP + lowest_bit(m);
+		}
+	}
+}
+
+static int resize(struct ht *ht, size_t capacity)
+{
+	size_t i, j, old_cap = ht->capacity;
+	unsigned char *ctrl = ht->ctrl, *t = ht->t, *nctrl, *nt = NULL;
+	union value *v = ht->v, *nv = NULL;
+	char **k = ht->k, **nk = NULL;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (capacity < HT_DEFAULT_SIZE)
+		capacity = HT_DEFAULT_SIZE;
+
+	/* Leave the table as it is unless everything can be allocated */
+	if (!(nctrl = malloc(capacity)) ||
+	    !(nk = malloc(capacity * sizeof *nk)) ||
+	    !(nv = malloc(capacity * sizeof *nv)) ||
+	    !(nt = malloc(capacity))) {
+		free(nctrl);
+		free(nk);
+		free(nv);
+		return ENOMEM;
+	}
+
+	ht->ctrl = nctrl;
+	ht->k    = nk;
+	ht->v    = nv;
+	ht->t    = nt;
+	memset(ht->ctrl, CTRL_EMPTY, capacity);
+	ht->capacity = capacity;
+	ht->gmask    = capacity / HT_GROUP - 1;
+	ht->deleted  = 0;
+	ht->max_pd   = 0;
+
+	/* Re-hash the live entries into the new table */
+	for (i = 0; i < old_cap; i++) {
+		if (ctrl[i] & 0x80)
+			continue;
+
+		j = find_free(ht, hash(k[i], ht->v0));
+		ht->ctrl[j] = ctrl[i];
+		ht->k[j]    = k[i];
+		ht->v[j]    = v[i];
+		ht->t[j]    = t[i];
+	}
+
+	free(ctrl);
+	free(k);
+	free(v);
+	free(t);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ht->resizes++;
+	ht->rs_ns += (unsigned long)((end.tv_sec - start.tv_sec) * 1000000000L +
+	                             (end.tv_nsec - start.tv_nsec));
+	return 0;
+}
+
+/**
+ * Allocate space for a new hash table
+ *
+ * \param[in] value Initial hash value for the hash function
+ * \return A pointer to the new hash_table, or NULL on error
+ */
+struct ht *ht_alloc(unsigned long value, unsigned flags)
+{
+	struct ht *ht;
+
+	if (!(ht = calloc(1, sizeof *ht)))
+		return NULL;
+
+	ht->flags = flags;
+	ht->v0    = value;
+
+	if (resize(ht, HT_DEFAULT_SIZE)) {
+		free(ht);
+		return NULL;
+	}
+
+	/* Don't count the initial allocation as a resize */
+	ht->resizes = 0;
+	ht->rs_ns   = 0;
+
+	return ht;
+}
+
+/**
+ * Lookup a key in the given hash table
+ *
+ * On error, this function returns NULL, and reports the following errors
+ * via \a errno:
+ *
+ * EINVAL - Invalid arguments were supplied
+ * ENOENT - No entry found for the given key
+ * ERANGE - The type of the item doesn't match the requested type
+ */
+static const void *ht_get(struct ht *ht, const char *key, unsigned int type)
+{
+	size_t i;
+
+	if (!ht || !key || !*key || type > HT_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	errno = 0;
+	if ((i = search(ht, key, hash(key, ht->v0))) == SIZE_MAX)
+		return NULL;
+
+	if (ht->t[i] != type) {
+		errno = ERANGE;
+		return NULL;
+	}
+
+	switch (type) {
+	case HT_LONG: return (const void *)&ht->v[i].l;
+	case HT_STR:  return ht->v[i].s;
+	default:      return ht->v[i].p;
+	}
+}
+
+unsigned long ht_get_long(struct ht *ht, const char *key)
+{
+	const void *p;
+	return (p = ht_get(ht, key, HT_LONG)) ?
+	       *(const unsigned long *)p : ULONG_MAX;
+}
+
+const void *ht_get_str(struct ht *ht, const char *key)
+{
+	return ht_get(ht, key, HT_STR);
+}
+
+const void *ht_get_ptr(struct ht *ht, const char *key)
+{
+	return ht_get(ht, key, HT_PTR);
+}
+
+void *ht_get_ptr_nc(struct ht *ht, const char *key)
+{
+	void *ret;
+	const void *p;
+
+	p = ht_get(ht, key, HT_PTR);
+	memcpy(&ret, &p, sizeof p);
+	return ret;
+}
+
+/**
+ * Remove an entry from a hash table
+ *
+ * A slot in a group which still has an empty slot can be marked empty
+ * again, since no search would've continued past that group. Otherwise,
+ * it's marked deleted, so that searches keep going.
+ *
+ * The table is shrunk when the load factor falls below 25%.
+ *
+ * \param[in] ht  Hash table
+ * \param[in] key Key to find
+ * \return 0 on success, non-zero on error
+ */
+int ht_rm(struct ht *ht, const char *key)
+{
+	size_t i;
+
+	if (!ht || !key || !*key) return EINVAL;
+	if (!ht->size)            return 0;
+
+	if ((i = search(ht, key, hash(key, ht->v0))) == SIZE_MAX)
+		return 0;
+
+	if (ht->t[i] == HT_STR)
+		free(ht->v[i].nc);
+	if (!(ht->flags & HT_STATIC_KEYS))
+		free(ht->k[i]);
+
+	if (match(ht->ctrl + (i & ~(size_t)(HT_GROUP - 1)), CTRL_EMPTY)) {
+		ht->ctrl[i] = CTRL_EMPTY;
+	} else {
+		ht->ctrl[i] = CTRL_DELETED;
+		++ht->deleted;
+	}
+
+	if (--ht->size < (ht->capacity >> 2) && ht->capacity > HT_DEFAULT_SIZE)
+		resize(ht, ht->capacity >> 1);
+
+	return 0;
+}
+
+/**
+ * Add or Replace an entry in a hash table
+ *
+ * \param[in] ht   Hash table
+ * \param[in] key  Key
+ * \param[in] type The appropriate HT_* type constant
+ * \param[in] in   Pointer (or pointer to an object) to store
+ * \return 0 on success, ENOMEM on out-of-memory, EINVAL on invalid args
+ */
+int ht_set(struct ht *ht, const char *key, unsigned char type,
+           const void *in)
+{
+	size_t i;
+	uint64_t h;
+	union value v;
+	char *k;
+
+	if (!ht || !in || !key || !*key || type > HT_MAX)
+		return EINVAL;
+
+	switch (type) {
+	case HT_LONG: v.l = *(const unsigned long *)in; break;
+	case HT_PTR:  v.p = in;                         break;
+	default: /* HT_STR */
+		if (!(v.nc = malloc(strlen((const char *)in) + 1)))
+			return ENOMEM;
+		memcpy(v.nc, in, strlen((const char *)in) + 1);
+	}
+
+	/* Replace an existing entry */
+	h = hash(key, ht->v0);
+	if ((i = search(ht, key, h)) != SIZE_MAX) {
+		if (ht->t[i] == HT_STR)
+			free(ht->v[i].nc);
+		ht->v[i] = v;
+		ht->t[i] = type;
+		return 0;
+	}
+
+	/**
+	 * Grow the table once it's 7/8 full, counting deleted slots. If
+	 * most of those are deleted, rehashing at the same size will do.
+	 */
+	if (ht->size + ht->deleted + 1 > HT_MAX_LOAD(ht->capacity) &&
+	    resize(ht, ht->capacity << (ht->size >= (ht->capacity >> 1))))
+		goto nomem;
+
+	if (ht->flags & HT_STATIC_KEYS)
+		memcpy(&k, &key, sizeof key);
+	else if (!(k = malloc(strlen(key) + 1)))
+		goto nomem;
+	else memcpy(k, key, strlen(key) + 1);
+
+	i = find_free(ht, h);
+	if (ht->ctrl[i] == CTRL_DELETED)
+		--ht->deleted;
+
+	ht->ctrl[i] = h & 0x7f;
+	ht->k[i]    = k;
+	ht->v[i]    = v;
+	ht->t[i]    = type;
+	++ht->size;
+	return 0;
+
+nomem:
+	if (type == HT_STR)
+		free(v.nc);
+	return ENOMEM;
+}
+
+/**
+ * Destroy a hash table
+ *
+ * \param[in] ht Hash table
+ */
+void ht_free(struct ht *ht)
+{
+	size_t i;
+	if (!ht) return;
+
+	for (i = 0; i < ht->capacity; i++) {
+		if (ht->ctrl[i] & 0x80)
+			continue;
+
+		if (ht->t[i] == HT_STR)
+			free(ht->v[i].nc);
+		if (!(ht->flags & HT_STATIC_KEYS))
+			free(ht->k[i]);
+	}
+
+	free(ht->ctrl);
+	free(ht->k);
+	free(ht->v);
+	free(ht->t);
+	free(ht);
+}
+
+/**
+ * Probe lengths are counted in groups.
+ */
+void ht_stats(struct ht *ht, struct ht_stats *st)
+{
+	size_t i, g, step;
+
+	memset(st, 0, sizeof *st);
+	if (!ht) return;
+
+	for (i = 0; i < ht->capacity; i++) {
+		if (ht->ctrl[i] & 0x80)
+			continue;
+
+		g = (hash(ht->k[i], ht->v0) >> 7) & ht->gmask;
+		for (step = 0; g != i / HT_GROUP && step <= ht->gmask; )
+			g = (g + ++step) & ht->gmask;
+
+		st->probes[(step < HT_PROBE_HIST) ? step : HT_PROBE_HIST - 1]++;
+	}
+
+	st->size       = ht->size;
+	st->capacity   = ht->capacity;
+	st->tombstones = ht->deleted;
+	st->max_pd     = ht->max_pd;
+	st->resizes    = ht->resizes;
+	st->resize_ns  = ht->rs_ns;
+}
+
+#endif /* HT_SWISS */
@@ -12,172 +12,380 @@
 #include <assert.h>
 #include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include "logging.h"
 #include "packet.h"
+#include "pool.h"
 #include "protocol.h"
+#include "proto_ops.h"
+#include "server_handler.h"
+
+#if defined(IOV_MAX) && IOV_MAX < PACKET_OUT_IOV
+#undef PACKET_OUT_IOV
+#define PACKET_OUT_IOV IOV_MAX
+#endif
+
+/**
+ * Queued output: either a run of bytes in an output chunk, or the
+ * data of a packet which was too large to copy.
+ */
+struct pt_outseg {
+	const char *base;
+	size_t len;
+	struct pt_packet *pkt; /**< Referenced packet, or NULL if copied */
+};
+
+/**
+ * Contiguous buffer for copied output. Chunks are written out in the
+ * order they're filled, and freed once fully sent. The whole chunk is
+ * PACKET_OUT_CHUNK bytes, so that it fits its pool size class exactly.
+ */
+struct pt_outchunk {
+	struct pt_outchunk *next;
+	size_t len;  /**< Bytes used    */
+	size_t sent; /**< Bytes written */
+	char data[PACKET_OUT_CHUNK - 2 * sizeof(size_t) - sizeof(void *)];
+};
+
+/**
+ * Contexts with output queued since the event loop last looked
+ */
+static struct pt_context *pending_out;
+
+/**
+ * Slow consumer counters
+ */
+static unsigned long out_congested; /**< Times a client became congested */
+static unsigned long out_drops;     /**< Packets dropped                 */
+static unsigned long out_drop_bytes;
+static unsigned long out_kicks;     /**< Clients kicked                  */
+
+static const char slow_msg[] =
+	"You have been disconnected because the server couldn't send you data fast enough.";
 
 void pt_context_init(struct pt_context *ctx, int fd)
 {
 	assert(ctx && fd >= 0);
 	memset(ctx, 0, sizeof *ctx);
-	if (!(ctx->hdr_in.msg_iov  = calloc(3, sizeof *ctx->hdr_in.msg_iov)) ||
-	    !(ctx->data_in.msg_iov = calloc(1, sizeof *ctx->data_in.msg_iov)))
-		abort();
-
-	ctx->hdr_in.msg_iov[0].iov_base = &ctx->pkt_in.type;
-	ctx->hdr_in.msg_iov[1].iov_base = &ctx->pkt_in.version;
-	ctx->hdr_in.msg_iov[2].iov_base = &ctx->pkt_in.length;
-	ctx->hdr_in.msg_iov[0].iov_len  = 2;
-	ctx->hdr_in.msg_iov[1].iov_len  = 2;
-	ctx->hdr_in.msg_iov[2].iov_len  = 2;
-	ctx->hdr_in.msg_iovlen          = 3;
-	ctx->data_in.msg_iovlen         = 1;
-	ctx->fd                         = fd;
-	ctx->uid                        = -1;
-	ctx->challenge                  = 1 + (rand() % CHALLENGE_MAX);
+	ctx->fd        = fd;
+	ctx->uid       = -1;
+	ctx->challenge = 1 + (rand() % CHALLENGE_MAX);
+	set_protocol_version(ctx, 0);
 }
 
 void pt_context_destroy(struct pt_context *ctx)
 {
 	size_t i;
+	struct pt_context **p;
+	struct pt_outchunk *chunk;
 
 	assert(ctx);
+	if (ctx->out_pending) {
+		for (p = &pending_out; *p && *p != ctx; p = &(*p)->next_out);
+		if (*p) *p = ctx->next_out;
+	}
+
 	if (ctx->device_id)
 		free(ctx->device_id);
 
-	free(ctx->hdr_in.msg_iov);
-	free(ctx->data_in.msg_iov);
+	if (ctx->in_buf) {
+		memset(ctx->in_buf, 0, ctx->in_len);
+		pool_free(ctx->in_buf, ctx->in_size);
+	}
 
 	/* Deref any unsent packets */
-	for (i = 0; i < ctx->npkts_out; i++) {
-		if (!--ctx->pkts_out[i]->refcnt)
-			free(ctx->pkts_out[i]);
+	for (i = 0; i < ctx->nsegs_out; i++)
+		packet_unref(ctx->segs_out[(ctx->segs_head + i) & (ctx->segs_size - 1)].pkt);
+
+	while ((chunk = ctx->chunk_head)) {
+		ctx->chunk_head = chunk->next;
+		pool_free(chunk, sizeof *chunk);
 	}
 
-	free(ctx->pkts_out);
+	free(ctx->segs_out);
+	free(ctx->rooms);
 	free_user(&ctx->user);
 }
 
-void packet_in(struct pt_context *ctx)
+/**
+ * Resize the read buffer, keeping room for a NUL after the last byte
+ */
+static void resize_in_buf(struct pt_context *ctx, size_t size)
+{
+	char *buf;
+
+	if (!(buf = pool_alloc(size)))
+		abort();
+
+	if (ctx->in_len)
+		memcpy(buf, ctx->in_buf, ctx->in_len);
+	pool_free(ctx->in_buf, ctx->in_size);
+	ctx->in_buf  = buf;
+	ctx->in_size = size;
+}
+
+/**
+ * Dispatch up to \a max complete packets from the read buffer
+ *
+ * \return the number of packets dispatched
+ */
+static unsigned dispatch_packets(struct pt_context *ctx, unsigned max)
+{
+	char *p, save;
+	size_t pos = 0, need = 0;
+	unsigned n = 0;
+
+	while (n < max && ctx->in_len - pos >= 6 && !ctx->disconnect && ctx->on_packet) {
+		p    = ctx->in_buf + pos;
+		need = 6 + (((p[4] & 0xff) << 8) | (p[5] & 0xff));
+		if (ctx->in_len - pos < need)
+			break;
+
+		ctx->pkt_in.type    = ((p[0] & 0xff) << 8) | (p[1] & 0xff);
+		ctx->pkt_in.version = ((p[2] & 0xff) << 8) | (p[3] & 0xff);
+		ctx->pkt_in.length  = need - 6;
+		ctx->pkt_in.data    = p + 6;
+
+		/* Terminate the payload, without clobbering the next packet */
+		save    = p[need];
+		p[need] = '\0';
+
+#ifndef NDEBUG
+		dump_packet(0, &ctx->pkt_in);
+#endif
+
+		if (ctx->pkt_in.type == PACKET_CLIENT_DISCONNECT)
+			ctx->disconnect++;
+		else ctx->on_packet(ctx);
+
+		memset(ctx->pkt_in.data, 0, ctx->pkt_in.length);
+		p[need] = save;
+		pos    += need;
+		need    = 0;
+		n++;
+	}
+
+	memset(&ctx->pkt_in, 0, sizeof ctx->pkt_in);
+	if (pos) {
+		memmove(ctx->in_buf, ctx->in_buf + pos, ctx->in_len - pos);
+		ctx->in_len -= pos;
+	}
+
+	/* Make sure a partial packet will fit, or shrink back if it can */
+	if (need >= ctx->in_size)
+		resize_in_buf(ctx, need + 1);
+	else if (ctx->in_size > PACKET_IN_BUFSZ && ctx->in_len < PACKET_IN_BUFSZ && need < PACKET_IN_BUFSZ)
+		resize_in_buf(ctx, PACKET_IN_BUFSZ);
+
+	return n;
+}
+
+int packet_in(struct pt_context *ctx)
 {
 	ssize_t br;
+	size_t bytes = 0;
+	unsigned budget = PACKET_IN_BUDGET;
 
 	assert(ctx);
-	if (ctx->data_in.msg_iov[0].iov_len) {
-		/* Read data */
-		if ((br = recvmsg(ctx->fd, &ctx->data_in, 0)) < 0)
-			return;
 
-		if (!br) {
-			ctx->disconnect++;
-			return;
+	/* The read buffer isn't allocated until there's something to read */
+	if (!ctx->in_buf)
+		resize_in_buf(ctx, PACKET_IN_BUFSZ);
+
+	for (;;) {
+		/* Packets left over from the last pass go first */
+		budget -= dispatch_packets(ctx, budget);
+		if (ctx->disconnect || !ctx->on_packet)
+			return 0;
+
+		if (!budget || bytes >= PACKET_IN_BYTES)
+			return 1;
+
+		if ((br = recv(ctx->fd, ctx->in_buf + ctx->in_len,
+		               ctx->in_size - ctx->in_len - 1, 0)) < 0) {
+			if (errno == EINTR)
+				return 1;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ctx->disconnect++;
+			return 0;
 		}
 
-		ctx->data_in.msg_iov[0].iov_len  -= (size_t)br;
-		ctx->data_in.msg_iov[0].iov_base  = (char *)ctx->data_in.msg_iov[0].iov_base + (size_t)br;
-		if (ctx->data_in.msg_iov[0].iov_len)
-			return;
-	} else {
-		br = recvmsg(ctx->fd, &ctx->hdr_in, MSG_PEEK);
-		if (br && br < 6)
-			return;
-
 		if (!br) {
 			ctx->disconnect++;
-			return;
+			return 0;
 		}
 
-		(void)recvmsg(ctx->fd, &ctx->hdr_in, 0);
-		ctx->pkt_in.type    = ntohs(ctx->pkt_in.type);
-		ctx->pkt_in.version = ntohs(ctx->pkt_in.version);
-		ctx->pkt_in.length  = ntohs(ctx->pkt_in.length);
+		ctx->in_len += (size_t)br;
+		bytes       += (size_t)br;
+	}
+}
 
-		if (ctx->pkt_in.length) {
-			if (!(ctx->pkt_in.data = calloc(ctx->pkt_in.length + 1, 1)))
-				abort();
+/**
+ * Mark bytes of the oldest chunk(s) as sent, freeing any that are done
+ */
+static void chunk_sent(struct pt_context *ctx, size_t len)
+{
+	struct pt_outchunk *chunk;
+
+	ctx->chunk_head->sent += len;
+	while ((chunk = ctx->chunk_head) && chunk->sent >= chunk->len &&
+	       (chunk != ctx->chunk_tail || !ctx->nsegs_out)) {
+		ctx->chunk_head = chunk->next;
+		if (chunk == ctx->chunk_tail)
+			ctx->chunk_tail = NULL;
+		pool_free(chunk, sizeof *chunk);
+	}
+}
 
-			ctx->data_in.msg_iov[0].iov_base = ctx->pkt_in.data;
-			ctx->data_in.msg_iov[0].iov_len  = ctx->pkt_in.length;
-			return;
+void packet_out(struct pt_context *ctx)
+{
+	ssize_t bs;
+	size_t i, n, rem;
+	struct pt_outseg *seg;
+	struct iovec iov[PACKET_OUT_IOV];
+
+	assert(ctx);
+	while (ctx->nsegs_out) {
+		for (n = 0; n < ctx->nsegs_out && n < PACKET_OUT_IOV; n++) {
+			seg = ctx->segs_out + ((ctx->segs_head + n) & (ctx->segs_size - 1));
+			iov[n].iov_base = (char *)*(void **)&seg->base;
+			iov[n].iov_len  = seg->len;
 		}
-	}
 
-#ifndef NDEBUG
-	dump_packet(0, &ctx->pkt_in);
-#endif
+		iov[0].iov_base = (char *)iov[0].iov_base + ctx->seg_off;
+		iov[0].iov_len -= ctx->seg_off;
 
-	if (ctx->pkt_in.type == PACKET_CLIENT_DISCONNECT)
-		ctx->disconnect++;
-	else if (ctx->on_packet)
-		ctx->on_packet(ctx);
+		if ((bs = writev(ctx->fd, iov, (int)n)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				ctx->disconnect++;
+			return;
+		}
 
-	if (ctx->pkt_in.length) {
-		memset(ctx->pkt_in.data, 0, ctx->pkt_in.length);
-		free(ctx->pkt_in.data);
-		ctx->pkt_in.data = NULL;
+		ctx->out_bytes -= (size_t)bs;
+		if (ctx->out_congested && ctx->out_bytes < PACKET_OUT_LOW)
+			ctx->out_congested = 0;
+
+		/* Retire whatever was fully written */
+		for (i = 0; i < n && bs; i++) {
+			seg = ctx->segs_out + ctx->segs_head;
+			rem = seg->len - ctx->seg_off;
+			if ((size_t)bs < rem) {
+				ctx->seg_off += (size_t)bs;
+				break;
+			}
+
+			bs -= (ssize_t)rem;
+			ctx->seg_off   = 0;
+			ctx->segs_head = (ctx->segs_head + 1) & (ctx->segs_size - 1);
+			ctx->nsegs_out--;
+
+			if (seg->pkt)
+				packet_unref(seg->pkt);
+			else chunk_sent(ctx, seg->len);
+		}
+
+		/* Short write: the socket's full, so wait until it drains */
+		if (i < n)
+			break;
 	}
 
-	ctx->data_in.msg_iov[0].iov_base = NULL;
-	ctx->data_in.msg_iov[0].iov_len  = 0;
+	/* If this client was kicked, and we've drained our output, disconnect */
+	if (!ctx->on_packet && !ctx->nsegs_out)
+		ctx->disconnect++;
 }
 
-void packet_out(struct pt_context *ctx)
+/**
+ * Add a segment to the end of the output queue, growing it as needed
+ */
+static struct pt_outseg *push_seg(struct pt_context *ctx)
 {
-	ssize_t bs, bp;
-	size_t i, freed;
+	size_t i, tail;
+	struct pt_outseg *segs;
 
-	assert(ctx);
-	if (!ctx->pkt_out.msg_iovlen || (bp = bs = sendmsg(ctx->fd, &ctx->pkt_out, 0)) <= 0)
-		return;
+	if (ctx->nsegs_out == ctx->segs_size) {
+		if (!(segs = malloc((ctx->segs_size ? ctx->segs_size * 2 : 16) * sizeof *segs)))
+			abort();
 
-	/* Update our vector list */
-	for (i = 0, freed = 0; bs && i < ctx->pkt_out.msg_iovlen; i++) {
-		if (ctx->pkt_out.msg_iov[i].iov_len <= (size_t)bs) {
-			bs -= ctx->pkt_out.msg_iov[i].iov_len;
-			++freed;
-			continue;
-		}
+		/* Unwrap the ring, so that it starts at 0 again */
+		for (i = 0; i < ctx->nsegs_out; i++)
+			segs[i] = ctx->segs_out[(ctx->segs_head + i) & (ctx->segs_size - 1)];
 
-		ctx->pkt_out.msg_iov[i].iov_len  -= (size_t)bs;
-		ctx->pkt_out.msg_iov[i].iov_base  = (char *)ctx->pkt_out.msg_iov[i].iov_base + (size_t)bs;
-		break;
+		free(ctx->segs_out);
+		ctx->segs_out  = segs;
+		ctx->segs_head = 0;
+		ctx->segs_size = ctx->segs_size ? ctx->segs_size * 2 : 16;
 	}
 
-	ctx->pkt_out.msg_iovlen -= freed;
-	if (ctx->pkt_out.msg_iovlen) {
-		memmove(ctx->pkt_out.msg_iov, ctx->pkt_out.msg_iov + freed, ctx->pkt_out.msg_iovlen * sizeof *ctx->pkt_out.msg_iov);
-		ctx->pkt_out.msg_iov = realloc(ctx->pkt_out.msg_iov,        ctx->pkt_out.msg_iovlen * sizeof *ctx->pkt_out.msg_iov);
-	} else {
-		free(ctx->pkt_out.msg_iov);
-		ctx->pkt_out.msg_iov = NULL;
+	tail = (ctx->segs_head + ctx->nsegs_out++) & (ctx->segs_size - 1);
+	return memset(ctx->segs_out + tail, 0, sizeof *ctx->segs_out);
+}
+
+/**
+ * Copy bytes into the current output chunk, extending the last segment
+ * if it ends where these bytes begin.
+ */
+static void queue_copy(struct pt_context *ctx, const char *data, size_t len)
+{
+	char *p;
+	struct pt_outseg *seg = NULL;
+	struct pt_outchunk *chunk = ctx->chunk_tail;
+
+	/**
+	 * A drained tail is kept while referenced segments queued after it
+	 * are unsent. It's also the head then, so start it over rather than
+	 * chaining a new chunk behind it.
+	 */
+	if (chunk && chunk->sent >= chunk->len)
+		chunk->len = chunk->sent = 0;
+
+	if (!chunk || sizeof chunk->data - chunk->len < len) {
+		if (!(chunk = pool_alloc(sizeof *chunk)))
+			abort();
+
+		chunk->next = NULL;
+		chunk->len  = chunk->sent = 0;
+		if (ctx->chunk_tail)
+			ctx->chunk_tail->next = chunk;
+		else ctx->chunk_head = chunk;
+		ctx->chunk_tail = chunk;
+	} else if (ctx->nsegs_out) {
+		seg = ctx->segs_out + ((ctx->segs_head + ctx->nsegs_out - 1) & (ctx->segs_size - 1));
+		if (seg->pkt || seg->base + seg->len != chunk->data + chunk->len)
+			seg = NULL;
 	}
 
-	/* Deref underlying packets */
-	i = 0;
-	do {
-		if (ctx->pkts_out[i]->remaining >= (size_t)bp) {
-			ctx->pkts_out[i]->remaining -= (size_t)bp;
-			bp = 0;
-		} else bp -= ctx->pkts_out[i]->remaining;
-
-		if (!--ctx->pkts_out[i]->refcnt)
-			free_packet(ctx->pkts_out[i]);
-	} while (bp && ++i < ctx->npkts_out);
-
-	if (!(ctx->npkts_out -= i + 1)) {
-		free(ctx->pkts_out);
-		ctx->pkts_out = NULL;
-	} else {
-		memmove(ctx->pkts_out, ctx->pkts_out + i + 1,
-		       (ctx->npkts_out - i + 1) * sizeof(struct pt_packet *));
+	p = chunk->data + chunk->len;
+	memcpy(p, data, len);
+	chunk->len += len;
+
+	if (!seg) {
+		seg       = push_seg(ctx);
+		seg->base = p;
 	}
 
-	/* If this client was kicked, and we've drained pkt_out, disconnect */
-	if (!ctx->on_packet && !ctx->pkts_out)
-		ctx->disconnect++;
+	seg->len += len;
+}
+
+/**
+ * Fill in a packet's fields and encode its header
+ */
+static void init_packet(struct pt_packet *pkt, unsigned short type, unsigned short len, unsigned flags)
+{
+	pkt->flags   = flags;
+	pkt->type    = type;
+	pkt->version = PROTOCOL_VERSION;
+	pkt->length  = len;
+	pkt->hdr[0]  = (type >> 8) & 0xff;
+	pkt->hdr[1]  = type & 0xff;
+	pkt->hdr[2]  = (PROTOCOL_VERSION >> 8) & 0xff;
+	pkt->hdr[3]  = PROTOCOL_VERSION & 0xff;
+	pkt->hdr[4]  = (len >> 8) & 0xff;
+	pkt->hdr[5]  = len & 0xff;
 }
 
 struct pt_packet *new_packet(unsigned short type, unsigned short len, const char *data, unsigned flags)
@@ -185,16 +393,13 @@ struct pt_packet *new_packet(unsigned short type, unsigned short len, const char
 	struct pt_packet *ret;
 
 	len = data ? len : 0;
-	if (!(ret = calloc(1, sizeof *ret)))
+	if (!(ret = pool_alloc(sizeof *ret + ((flags & PACKET_F_COPY) ? len : 0))))
 		return NULL;
 
-	if ((flags & PACKET_F_COPY) && len) {
-		if (!(ret->data = calloc(1, len))) {
-			free(ret);
-			return NULL;
-		}
-
-		memcpy(ret->data, data, len);
+	memset(ret, 0, sizeof *ret);
+	if (flags & PACKET_F_COPY) {
+		ret->data = ret->buf;
+		if (len) memcpy(ret->buf, data, len);
 	} else {
 		/**
 		 * For PACKET_F_STATIC, and cases where the data's already on
@@ -205,56 +410,169 @@ struct pt_packet *new_packet(unsigned short type, unsigned short len, const char
 		ret->data = (char *)*(void **)&data;
 	}
 
-	ret->flags   = flags;
-	ret->type    = type;
-	ret->version = PROTOCOL_VERSION;
-	ret->length  = len;
+	init_packet(ret, type, len, flags);
 	return ret;
 }
 
+void packet_sb_init(struct strbuf *sb)
+{
+	memset(sb, 0, sizeof *sb);
+	sb->pool = 1;
+	sb_reserve(sb, offsetof(struct pt_packet, buf));
+}
+
+struct pt_packet *packet_from_sb(unsigned short type, struct strbuf *sb)
+{
+	size_t len = sb->len;
+	struct pt_packet *pkt;
+
+	if (!len) {
+		sb_free(sb);
+		return NULL;
+	}
+
+	if (len > USHRT_MAX) {
+		ERROR(("Truncating packet %04x from %lu bytes", type, (unsigned long)len));
+		len = USHRT_MAX;
+	}
+
+	/**
+	 * The packet can be made in place if its data is where new_packet()
+	 * would put it, in an allocation free_packet() will agree with.
+	 * Otherwise, copy it.
+	 */
+	if (!sb->pool || sb->off != offsetof(struct pt_packet, buf) ||
+	    pool_size(sizeof *pkt + len) != pool_size(sb->size)) {
+		pkt = new_packet(type, (unsigned short)len, sb->s + sb->off, PACKET_F_COPY);
+		sb_free(sb);
+		return pkt;
+	}
+
+	pkt = (struct pt_packet *)(void *)sb->s;
+	memset(pkt, 0, offsetof(struct pt_packet, buf));
+	pkt->data = pkt->buf;
+	init_packet(pkt, type, (unsigned short)len, PACKET_F_COPY);
+	memset(sb, 0, sizeof *sb);
+	return pkt;
+}
+
+/**
+ * Apply the slow consumer policy (see PACKET_OUT_HIGH)
+ *
+ * \return non-zero if the packet should be dropped
+ */
+static int out_limit(struct pt_context *ctx, const struct pt_packet *pkt)
+{
+	size_t len = ctx->out_bytes + 6 + pkt->length;
+
+	if (!ctx->out_congested && len > PACKET_OUT_HIGH) {
+		ctx->out_congested = 1;
+		out_congested++;
+	}
+
+	if (!ctx->out_congested)
+		return 0;
+
+	/* Once kicked, the reason is the only thing left worth sending */
+	if (!ctx->on_packet) {
+		if (pkt->type == PACKET_SERVER_DISCONNECT)
+			return 0;
+		goto drop;
+	}
+
+#ifndef PACKET_OUT_KICK
+	if (pkt->flags & PACKET_F_DROP)
+		goto drop;
+	if (len <= PACKET_OUT_MAX)
+		return 0;
+#endif
+
+	INFO(("Kicking slow client %s:%u (%lu bytes queued)",
+	     inet_ntoa(ctx->addr.sin_addr), ntohs(ctx->addr.sin_port),
+	     (unsigned long)ctx->out_bytes));
+	out_kicks++;
+	kick(ctx, slow_msg, sizeof slow_msg - 1);
+
+drop:
+	out_drops++;
+	out_drop_bytes += 6 + pkt->length;
+	return 1;
+}
+
 void send_packet(struct pt_context *ctx, struct pt_packet *pkt)
 {
-	size_t pos, newlen;
+	struct pt_outseg *seg;
 
 	assert(ctx);
-	pos    = ctx->pkt_out.msg_iovlen;
-	newlen = (pos + (pkt->length ? 4 : 3)) * sizeof(struct iovec);
-
 	if (!pkt) {
 		ERROR(("Cowardly refusing to send NULL packet"));
 		return;
 	}
 
+	if (out_limit(ctx, pkt)) {
+		packet_unref(packet_ref(pkt));
+		return;
+	}
+
+	ctx->out_bytes += 6 + pkt->length;
+
 #ifndef NDEBUG
 	dump_packet(1, pkt);
 #endif
 
-	if (!(ctx->pkts_out = realloc(ctx->pkts_out, (ctx->npkts_out + 1) * sizeof(struct pt_packet *))) ||
-	    !(ctx->pkt_out.msg_iov = realloc(ctx->pkt_out.msg_iov, newlen)))
-		abort();
+	/**
+	 * Small packets are copied. Large ones are referenced: with the header
+	 * when it's contiguous with the data, or with only the data otherwise.
+	 */
+	if (pkt->length <= PACKET_OUT_COPY) {
+		queue_copy(ctx, pkt->hdr, 6);
+		if (pkt->length)
+			queue_copy(ctx, pkt->data, pkt->length);
+		packet_unref(packet_ref(pkt));
+	} else if (pkt->data == pkt->buf) {
+		seg       = push_seg(ctx);
+		seg->base = pkt->hdr;
+		seg->len  = 6 + pkt->length;
+		seg->pkt  = packet_ref(pkt);
+	} else {
+		queue_copy(ctx, pkt->hdr, 6);
+		seg       = push_seg(ctx);
+		seg->base = pkt->data;
+		seg->len  = pkt->length;
+		seg->pkt  = packet_ref(pkt);
+	}
 
-	memset(ctx->pkt_out.msg_iov + pos, 0, newlen - (pos * sizeof *ctx->pkt_out.msg_iov));
-	ctx->pkts_out[ctx->npkts_out++]        = pkt;
-	ctx->pkt_out.msg_iov[pos].iov_base     = &pkt->type;
-	ctx->pkt_out.msg_iov[pos + 1].iov_base = &pkt->version;
-	ctx->pkt_out.msg_iov[pos + 2].iov_base = &pkt->length;
-	ctx->pkt_out.msg_iov[pos].iov_len      = 2;
-	ctx->pkt_out.msg_iov[pos + 1].iov_len  = 2;
-	ctx->pkt_out.msg_iov[pos + 2].iov_len  = 2;
-	ctx->pkt_out.msg_iovlen += 3;
-
-	if (pkt->length) {
-		ctx->pkt_out.msg_iov[pos + 3].iov_base = pkt->data;
-		ctx->pkt_out.msg_iov[pos + 3].iov_len  = pkt->length;
-		ctx->pkt_out.msg_iovlen++;
-		pkt->remaining = pkt->length;
-		pkt->length = htons(pkt->length);
+	if (!ctx->out_pending) {
+		ctx->out_pending = 1;
+		ctx->next_out    = pending_out;
+		pending_out      = ctx;
 	}
+}
 
-	pkt->type      = htons(pkt->type);
-	pkt->version   = htons(pkt->version);
-	pkt->remaining += 6;
-	pkt->refcnt++;
+struct pt_context *packet_take_pending(void)
+{
+	struct pt_context *ret = pending_out;
+
+	pending_out = NULL;
+	return ret;
+}
+
+void packet_print_stats(void)
+{
+	INFO(("output: %lu congested, %lu packets (%lu bytes) dropped, %lu kicked",
+	     out_congested, out_drops, out_drop_bytes, out_kicks));
+}
+
+struct pt_packet *packet_ref(struct pt_packet *pkt)
+{
+	if (pkt) pkt->refcnt++;
+	return pkt;
+}
+
+void packet_unref(struct pt_packet *pkt)
+{
+	if (pkt && (!pkt->refcnt || !--pkt->refcnt))
+		free_packet(pkt);
 }
 
 void free_packet(struct pt_packet *pkt)
@@ -262,9 +580,9 @@ void free_packet(struct pt_packet *pkt)
 	if (!pkt || pkt->refcnt)
 		return;
 
-	if (pkt->length && pkt->data && !(pkt->flags & PACKET_F_STATIC))
+	if (pkt->data && !(pkt->flags & (PACKET_F_STATIC | PACKET_F_COPY)))
 		free(pkt->data);
-	free(pkt);
+	pool_free(pkt, sizeof *pkt + ((pkt->flags & PACKET_F_COPY) ? pkt->length : 0));
 }
 
 static const char *hex = "0123456789abcdef";
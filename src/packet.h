@@ -14,12 +14,53 @@
 #include <netinet/in.h>
 
 #include "user.h"
+#include "timer.h"
 
 /**
  * Packet flags
  */
 #define PACKET_F_STATIC 0x01 /**< Data is static          */
 #define PACKET_F_COPY   0x02 /**< Make a copy of the data */
+#define PACKET_F_DROP   0x04 /**< Non-essential, may be dropped for a slow client */
+
+/**
+ * Initial size of a connection's read buffer, which is allocated when
+ * the client first sends something. It grows as needed to fit a larger
+ * packet, and shrinks back once that packet has been handled.
+ */
+#define PACKET_IN_BUFSZ 4096
+
+/**
+ * Input budget: each time a connection is serviced, at most this many
+ * packets are dispatched, and this many bytes read. Anything left over
+ * waits for the next pass of the event loop, so that one busy client
+ * can't hold up the rest.
+ */
+#define PACKET_IN_BUDGET 32
+#define PACKET_IN_BYTES  16384
+
+/**
+ * Output queueing: packets with up to PACKET_OUT_COPY bytes of data are
+ * copied into the connection's output chunks, so that a run of small
+ * packets goes out as a single iovec. Larger packets are referenced
+ * rather than copied. At most PACKET_OUT_IOV iovecs are passed to
+ * writev() at once.
+ */
+#define PACKET_OUT_CHUNK 4096
+#define PACKET_OUT_COPY  512
+#define PACKET_OUT_IOV   64
+
+/**
+ * Slow consumers: once more than PACKET_OUT_HIGH bytes are queued for a
+ * client, it's congested until its queue drains below PACKET_OUT_LOW.
+ * While it's congested, packets flagged PACKET_F_DROP aren't queued for
+ * it, and if its queue still grows past PACKET_OUT_MAX, it's kicked.
+ *
+ * Define PACKET_OUT_KICK to kick congested clients straight away instead.
+ */
+#define PACKET_OUT_HIGH  (256 * 1024)
+#define PACKET_OUT_LOW   (64 * 1024)
+#define PACKET_OUT_MAX   (1024 * 1024)
 
 /**
  * Length of the generated codebook
@@ -33,6 +74,11 @@
 
 /**
  * Paltalk packet
+ *
+ * Packets are immutable once created, so that the same packet can be
+ * queued for any number of clients. The header is encoded once, by
+ * new_packet(), and with PACKET_F_COPY the data follows it in the same
+ * allocation, so that the whole packet is a single buffer on the wire.
  */
 struct pt_packet {
 	unsigned short type;
@@ -41,15 +87,23 @@ struct pt_packet {
 	char *data;
 	unsigned refcnt;
 	unsigned flags;
-	size_t remaining;
+	char hdr[6];  /**< Header, in network byte order */
+	char buf[];   /**< Data, for PACKET_F_COPY        */
 };
 
+struct pt_outseg;
+struct pt_outchunk;
+struct room_ref;
+struct strbuf;
+struct pt_proto_ops;
+
 /**
  * Connection context
  */
 struct pt_context {
 	int fd;
 	int disconnect;
+	unsigned handle; /**< Connection handle, see conn_get() */
 	struct sockaddr_in addr;
 	void *db_r;
 	void *db_w;
@@ -62,6 +116,7 @@ struct pt_context {
 
 	time_t time;
 	unsigned short protocol_version;
+	const struct pt_proto_ops *ops; /**< See set_protocol_version() */
 	unsigned short challenge;
 	unsigned long ccban_level;
 	unsigned long status;
@@ -78,12 +133,33 @@ struct pt_context {
 	unsigned char codebook[CODEBOOK_LEN];
 
 	/* Packet I/O */
-	struct msghdr hdr_in;
-	struct msghdr data_in;
-	struct msghdr pkt_out;
-	struct pt_packet pkt_in;
-	struct pt_packet **pkts_out; /**< So that we can track them */
-	size_t npkts_out;
+	char *in_buf;     /**< Bytes read, but not yet handled */
+	size_t in_len;    /**< Number of bytes in in_buf       */
+	size_t in_size;   /**< Allocated size of in_buf        */
+	struct pt_packet pkt_in; /**< Data points into in_buf  */
+	struct pt_outseg *segs_out;    /**< Ring of queued output segments */
+	size_t nsegs_out;              /**< Number of queued segments      */
+	size_t segs_head;              /**< Index of the first segment     */
+	size_t segs_size;              /**< Size of the ring (power of 2)  */
+	size_t seg_off;                /**< Bytes of the first seg. sent   */
+	size_t out_bytes;              /**< Bytes queued, but not yet sent */
+	int out_congested;             /**< Over PACKET_OUT_HIGH, see above */
+	struct pt_outchunk *chunk_head; /**< Oldest output chunk           */
+	struct pt_outchunk *chunk_tail; /**< Chunk being appended to       */
+	struct pt_context *next_out;   /**< Next context with pending output */
+	int out_pending;               /**< Non-zero if linked via next_out  */
+	struct pt_context *next_close; /**< Next context to be closed        */
+	int close_pending;             /**< Non-zero if linked via next_close */
+	struct pt_context *next_ready; /**< Next context with input to handle */
+	int in_ready;                  /**< Non-zero if input is left over    */
+
+	/* Timers (see server.c) */
+	struct timer deadline; /**< Login / ping / kick deadline      */
+
+	/* Rooms (see room.c) */
+	struct room_ref *rooms; /**< Rooms this user is in       */
+	unsigned nrooms;        /**< Number of rooms in \a rooms */
+	unsigned rooms_size;    /**< Allocated size of \a rooms  */
 
 	/* Packet callback */
 	void (*on_packet)(struct pt_context *);
@@ -93,10 +169,76 @@ struct pt_context {
 void pt_context_init(struct pt_context *ctx, int fd);
 void pt_context_destroy(struct pt_context *ctx);
 
-void packet_in(struct pt_context *ctx);
+/**
+ * Read from the client, and dispatch the complete packets that have
+ * been received, up to PACKET_IN_BUDGET packets / PACKET_IN_BYTES bytes.
+ *
+ * The payload handed to on_packet is a view into the context's read
+ * buffer, which is NUL-terminated for the duration of the callback.
+ * It's only valid until the callback returns, so anything that needs
+ * to hold onto it must make a copy (i.e. PACKET_F_COPY.)
+ *
+ * \return non-zero if the budget ran out, in which case there may be
+ *         more input, and the caller should call this again on its next
+ *         pass without waiting for the socket to become readable.
+ */
+int packet_in(struct pt_context *ctx);
+
+/**
+ * Write as much queued output as the socket will take.
+ */
 void packet_out(struct pt_context *ctx);
+
+/**
+ * Take the list of contexts which have had packets queued via
+ * send_packet() since the last call, linked through next_out.
+ *
+ * The caller is responsible for clearing each context's out_pending
+ * flag as the list is walked.
+ */
+struct pt_context *packet_take_pending(void);
+
 struct pt_packet *new_packet(unsigned short type, unsigned short len, const char *data, unsigned flags);
+
+/**
+ * Start building a packet's data in \a sb. The buffer comes from the
+ * pool, with room left in front of the data for the packet itself, so
+ * that packet_from_sb() can usually make the packet without a copy.
+ */
+void packet_sb_init(struct strbuf *sb);
+
+/**
+ * Make a (PACKET_F_COPY) packet of the data in \a sb, which is left empty.
+ *
+ * \return the packet, or NULL if there's no data.
+ */
+struct pt_packet *packet_from_sb(unsigned short type, struct strbuf *sb);
+
+/**
+ * Queue a packet to be sent to the client.
+ *
+ * A new packet is unreferenced, and send_packet() consumes it. To send
+ * the same packet to more than one client, hold a reference with
+ * packet_ref() while sending it, and drop it with packet_unref() after.
+ */
 void send_packet(struct pt_context *ctx, struct pt_packet *pkt);
+
+/**
+ * Take a reference to a packet
+ */
+struct pt_packet *packet_ref(struct pt_packet *pkt);
+
+/**
+ * Drop a reference to a packet, freeing it if it was the last one (or
+ * if there were no references to begin with.)
+ */
+void packet_unref(struct pt_packet *pkt);
+
+/**
+ * Log how often slow clients have had packets dropped, or been kicked
+ */
+void packet_print_stats(void);
+
 void free_packet(struct pt_packet *pkt);
 void dump_packet(int, struct pt_packet *pkt);
 
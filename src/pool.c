@@ -0,0 +1,150 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "pool.h"
+
+/**
+ * Number of size classes, from POOL_MIN up to POOL_MAX
+ */
+#define POOL_CLASSES 11
+
+/**
+ * Space reserved at the start of each slab for linking it, so that
+ * the objects which follow are suitably aligned.
+ */
+#define SLAB_HDR 16
+
+struct pool_class {
+	void *free;           /**< Free list, linked through the objects */
+	unsigned long allocs; /**< Objects handed out                    */
+	unsigned long frees;  /**< Objects returned                      */
+	unsigned long slabs;  /**< Slabs allocated                       */
+};
+
+static struct pool_class classes[POOL_CLASSES];
+static void *slabs;                  /**< All slabs, for pool_destroy() */
+static unsigned long big_allocs;     /**< Allocations over POOL_MAX     */
+static unsigned long big_frees;
+
+/**
+ * Get the size class for a given size, or -1 if it's too large
+ */
+static int size_class(size_t size)
+{
+	int c = 0;
+	size_t n = POOL_MIN;
+
+	if (size > POOL_MAX)
+		return -1;
+
+	while (n < size) {
+		n <<= 1;
+		c++;
+	}
+
+	return c;
+}
+
+/**
+ * Carve a new slab into objects for the given class
+ */
+static int refill(int c)
+{
+	char *slab, *p;
+	size_t objsz = (size_t)POOL_MIN << c;
+	size_t n     = objsz < POOL_SLAB ? POOL_SLAB / objsz : 1;
+
+	if (!(slab = malloc(SLAB_HDR + n * objsz)))
+		return -1;
+
+	*(void **)slab = slabs;
+	slabs = slab;
+	classes[c].slabs++;
+
+	for (p = slab + SLAB_HDR; n--; p += objsz) {
+		*(void **)p      = classes[c].free;
+		classes[c].free  = p;
+	}
+
+	return 0;
+}
+
+void *pool_alloc(size_t size)
+{
+	int c;
+	void *p;
+
+	if ((c = size_class(size)) < 0) {
+		big_allocs++;
+		return malloc(size);
+	}
+
+	if (!classes[c].free && refill(c))
+		return NULL;
+
+	p = classes[c].free;
+	classes[c].free = *(void **)p;
+	classes[c].allocs++;
+	return p;
+}
+
+size_t pool_size(size_t size)
+{
+	int c;
+	return ((c = size_class(size)) < 0) ? 0 : (size_t)POOL_MIN << c;
+}
+
+void pool_free(void *p, size_t size)
+{
+	int c;
+
+	if (!p) return;
+	if ((c = size_class(size)) < 0) {
+		big_frees++;
+		free(p);
+		return;
+	}
+
+	*(void **)p = classes[c].free;
+	classes[c].free = p;
+	classes[c].frees++;
+}
+
+void pool_print_stats(void)
+{
+	int c;
+
+	for (c = 0; c < POOL_CLASSES; c++) {
+		if (!classes[c].allocs)
+			continue;
+
+		INFO(("pool %5lu: %lu allocs, %lu frees, %lu in use, %lu slabs",
+		     (unsigned long)POOL_MIN << c, classes[c].allocs,
+		     classes[c].frees, classes[c].allocs - classes[c].frees,
+		     classes[c].slabs));
+	}
+
+	INFO(("pool large: %lu allocs, %lu frees", big_allocs, big_frees));
+}
+
+void pool_destroy(void)
+{
+	void *next;
+
+	while (slabs) {
+		next = *(void **)slabs;
+		free(slabs);
+		slabs = next;
+	}
+
+	memset(classes, 0, sizeof classes);
+}
@@ -0,0 +1,65 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/**
+ * Size-class pools for the packet I/O hot path.
+ *
+ * Allocations are rounded up to a power of two between POOL_MIN and
+ * POOL_MAX, and carved out of slabs of at least POOL_SLAB bytes. Freed
+ * objects go back on their class' free list rather than to malloc(),
+ * so once the pools have warmed up, allocating a packet costs a couple
+ * of pointer moves. Slabs are only released by pool_destroy().
+ *
+ * Anything larger than POOL_MAX is passed through to malloc().
+ */
+#define POOL_MIN  64
+#define POOL_MAX  65536
+#define POOL_SLAB 65536
+
+/**
+ * Allocate an object of the given size
+ *
+ * \return a pointer to uninitialized memory, or NULL on out-of-memory
+ */
+void *pool_alloc(size_t size);
+
+/**
+ * Number of bytes pool_alloc() actually allocates for an object of the
+ * given size.
+ *
+ * \return the size of its class, or 0 if it's passed to malloc().
+ */
+size_t pool_size(size_t size);
+
+/**
+ * Return an object to its pool
+ *
+ * \param[in] p    Object to free (may be NULL)
+ * \param[in] size Size it was allocated with
+ */
+void pool_free(void *p, size_t size);
+
+/**
+ * Log the allocation counters for each size class.
+ *
+ * If the slab count for a class stops moving under a steady load, that
+ * class isn't calling malloc() any more.
+ */
+void pool_print_stats(void);
+
+/**
+ * Free all slabs. Anything still allocated from a pool is invalid
+ * after this.
+ */
+void pool_destroy(void);
+
+#endif /* POOL_H */
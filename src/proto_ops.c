@@ -0,0 +1,143 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+
+#include "packet.h"
+#include "protocol.h"
+#include "proto_ops.h"
+#include "encode.h"
+#include "room.h"
+
+#define STR_(X) #X
+#define STR(X)  STR_(X)
+
+/**
+ * Category lists
+ *
+ * 5.1 assumes these don't change once given, and needs list=2. 7+
+ * hardcodes the virtual categories, but we include them for 5.x so
+ * that the theoretical 5.x user can view them also.
+ */
+#define CATEGORIES_SQL "SELECT * FROM categories JOIN (SELECT 2 AS list)"
+
+static const char pt5_categories[] = CATEGORIES_SQL;
+static const char pt7_categories[] = CATEGORIES_SQL
+	" WHERE code NOT IN (" STR(CATEGORY_TOP) "," STR(CATEGORY_FEATURED) ")";
+
+static const char pt82_subcategories[] =
+	"SELECT catg, subcatg, disp, name FROM subcategories ORDER BY name ASC";
+
+/**
+ * Room lists
+ */
+static const char pt5_room_list[] =
+	ROOMS_SELECT "FROM rooms WHERE catg=? ORDER BY '#' DESC, nm ASC";
+
+/* PT 8.2+: Uses the new room list packet (t=S is for subcategories) */
+static const char pt82_room_list[] =
+	"SELECT 'G' AS t,id,nm AS n,r,p,v,l,c,'Y' AS eof,lang,"
+	"room_population(id) AS m "
+	"FROM rooms WHERE catg=? AND subcatg IS NULL ORDER BY m DESC, n ASC";
+
+/**
+ * Room searches
+ */
+static const char pt5_room_search[] =
+	"SELECT r,nm,id,v,l FROM rooms WHERE p=0 AND nm LIKE ?";
+
+/* PT 8 added the category, presumably. */
+static const char pt80_room_search[] =
+	"SELECT r,nm,id,v,l,catg,room_population(id) AS '#' "
+	"FROM rooms WHERE p=0 AND nm LIKE ?";
+
+/**
+ * PT 8.2+ added subcategories after 8.2 beta, so the 8.2 beta
+ * builds will break. PT 9 adds lang, but 8.2 ignores it.
+ *
+ * TODO: WTF is the 6 digit number for?
+ */
+static const char pt82_room_search[] =
+	"SELECT r,nm,id,v,l,catg,room_population(id) AS '#',"
+	"'001000',subcatg,lang "
+	"FROM rooms WHERE p=0 AND nm LIKE ?";
+
+/**
+ * Ops for each version, newest first
+ */
+static const struct pt_proto_ops proto_ops[] = {
+	{
+		PROTOCOL_VERSION_91, "9.1",
+		pt_encode_codebook, pt_decode_codebook,
+		pt7_categories, pt82_subcategories,
+		pt82_room_list, PACKET_NEW_ROOM_LIST, pt82_room_search,
+		0,    /* 9.0 removed nudges from the room */
+		NULL, 1, 5, 1, /* 9.1 puts a byte before the status message */
+		0
+	},
+	{
+		PROTOCOL_VERSION_90, "9.0",
+		pt_encode_codebook, pt_decode_codebook,
+		pt7_categories, pt82_subcategories,
+		pt82_room_list, PACKET_NEW_ROOM_LIST, pt82_room_search,
+		0,
+		NULL, 1, 4, 1,
+		0
+	},
+	{
+		PROTOCOL_VERSION_82, "8.2",
+		pt_encode_codebook, pt_decode_codebook,
+		pt7_categories, pt82_subcategories,
+		pt82_room_list, PACKET_NEW_ROOM_LIST, pt82_room_search,
+		1,
+		NULL, 1, 4, 1,
+		0
+	},
+	{
+		PROTOCOL_VERSION_80, "8.0",
+		pt_encode_classic, pt_decode_classic,
+		pt7_categories, NULL,
+		pt5_room_list, PACKET_ROOM_LIST, pt80_room_search,
+		0,
+		NULL, 0, 0, 0,
+		0
+	},
+	{
+		PROTOCOL_VERSION_70, "7.x",
+		pt_encode_classic, pt_decode_classic,
+		pt7_categories, NULL,
+		pt5_room_list, PACKET_ROOM_LIST, pt5_room_search,
+		0,
+		"6", 0, 0, 0, /* Map paid1=E to 6 for older clients */
+		0
+	},
+	{
+		0, "5.x",
+		pt_encode_classic, pt_decode_classic,
+		pt5_categories, NULL,
+		pt5_room_list, PACKET_ROOM_LIST, pt5_room_search,
+		0,
+		"6", 0, 0, 0,
+		1
+	}
+};
+
+const struct pt_proto_ops *pt_proto_ops(unsigned short version)
+{
+	const struct pt_proto_ops *ops = proto_ops;
+
+	while (version < ops->version)
+		ops++;
+	return ops;
+}
+
+void set_protocol_version(struct pt_context *ctx, unsigned short version)
+{
+	ctx->protocol_version = version;
+	ctx->ops              = pt_proto_ops(version);
+}
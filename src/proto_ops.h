@@ -0,0 +1,56 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef PROTO_OPS_H
+#define PROTO_OPS_H
+
+#include <stddef.h>
+
+struct pt_context;
+
+/**
+ * Everything that differs between client versions, looked up once
+ * when the client's protocol version becomes known.
+ */
+struct pt_proto_ops {
+	unsigned short version; /**< Oldest protocol version these apply to */
+	const char *name;
+
+	/* String encoding (see encode.h) */
+	char *(*encode)(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s);
+	char *(*decode)(struct pt_context *ctx, unsigned variant, unsigned short challenge, const char *s, size_t slen);
+
+	/* Category lists, sent at login */
+	const char *categories_sql;
+	const char *subcategories_sql; /**< NULL if unsupported */
+
+	/* Rooms */
+	const char *room_list_sql;     /**< Rooms in a category, bound to catg */
+	unsigned short room_list_type; /**< Packet the room list is sent in   */
+	const char *room_search_sql;   /**< Rooms matching a name             */
+	int room_nudges;               /**< Shows nudges sent to a room       */
+
+	/* Users */
+	const char *paid1_e;     /**< Sent in place of paid1=E, or NULL */
+	int status_msgs;         /**< Shows buddies' status messages    */
+	unsigned status_msg_off; /**< Offset of the message in CHANGE_STATUS, 0 if none */
+	int im_nudges;           /**< Accepts nudges in IMs             */
+	int user_search_form;    /**< Sends the whole user search form, not one term */
+};
+
+/**
+ * Get the ops for the given protocol version. Versions between the
+ * ones we know about get the ops of the next oldest one.
+ */
+const struct pt_proto_ops *pt_proto_ops(unsigned short version);
+
+/**
+ * Fix the protocol version the client speaks, and select its ops.
+ */
+void set_protocol_version(struct pt_context *ctx, unsigned short version);
+
+#endif /* PROTO_OPS_H */
@@ -9,108 +9,239 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 
+#include "macros.h"
+#include "pool.h"
 #include "protocol.h"
 
 static const char value_sep[2]  = { '=',        '\0' };
 static const char field_sep[2]  = { '\n',       '\0' };
 static const char record_sep[2] = { (char)0xc8, '\0' };
 
-void each_field(char *s, void *ud, void (*cb)(void *ud, unsigned i, const char *line))
+/**
+ * Delimiters are found with memchr(), which libc vectorizes, rather than
+ * a byte at a time.
+ */
+int span_next(struct span *s, int delim, struct span *tok)
+{
+	const char *e;
+
+	if (!s->len) {
+		tok->p   = NULL;
+		tok->len = 0;
+		return 0;
+	}
+
+	tok->p = s->p;
+	if ((e = memchr(s->p, delim, s->len))) {
+		tok->len = (size_t)(e - s->p);
+		s->len  -= tok->len + 1;
+		s->p     = e + 1;
+	} else {
+		tok->len = s->len;
+		s->p    += s->len;
+		s->len   = 0;
+	}
+
+	return 1;
+}
+
+int span_eq(const struct span *s, const char *str)
+{
+	return s->p && s->len == strlen(str) && !memcmp(s->p, str, s->len);
+}
+
+char *span_dup(const struct span *s)
+{
+	char *p;
+
+	if (!s->p)
+		return NULL;
+
+	if (!(p = malloc(s->len + 1)))
+		abort();
+
+	memcpy(p, s->p, s->len);
+	p[s->len] = '\0';
+	return p;
+}
+
+long span_tol(const struct span *s)
+{
+	char buf[24];
+	size_t n = min(s->len, sizeof buf - 1);
+
+	if (!s->p)
+		return 0;
+
+	memcpy(buf, s->p, n);
+	buf[n] = '\0';
+	return strtol(buf, NULL, 10);
+}
+
+void each_field(const char *s, size_t len, void *ud, void (*cb)(void *ud, unsigned i, const struct span *f))
 {
-	char *f;
 	unsigned i = 0;
+	struct span in = { s, len }, f;
 
-	if (!s || !*s || !cb || !(f = strtok(s, field_sep)))
+	if (!s || !cb)
 		return;
 
-	do { cb(ud, ++i, f); } while ((f = strtok(NULL, field_sep)));
+	while (span_next(&in, *field_sep, &f)) {
+		if (f.len)
+			cb(ud, ++i, &f);
+	}
 }
 
-void each_field_kv(char *s, void *ud, void (*cb)(void *ud, const char *k, const char *v))
+void each_field_kv(const char *s, size_t len, void *ud, void (*cb)(void *ud, const struct span *k, const struct span *v))
 {
-	char *f, *k;
+	struct span in = { s, len }, f, k;
 
-	if (!s || !*s || !cb || !(f = strtok(s, field_sep)))
+	if (!s || !cb)
 		return;
 
-	do {
-		s += strlen(f) + 1;
-		k  = strtok(f, value_sep);
-		cb(ud, k, strtok(NULL, value_sep));
-	} while (*s && (f = strtok(s, field_sep)));
+	while (span_next(&in, *field_sep, &f)) {
+		if (!f.len)
+			continue;
+
+		span_next(&f, *value_sep, &k);
+		if (!f.len)
+			f.p = NULL;
+		cb(ud, &k, &f);
+	}
 }
 
-void each_record(char *s, void *ud, int (*cb)(void *userdata, const char *record))
+void each_record(const char *s, size_t len, void *ud, int (*cb)(void *ud, const struct span *r))
 {
-	char *r;
+	struct span in = { s, len }, r;
 
-	if (!s || !*s || !cb || !(r = strtok(s, record_sep)))
+	if (!s || !cb)
 		return;
 
-	do { cb(ud, r); } while ((r = strtok(NULL, record_sep)));
+	while (span_next(&in, *record_sep, &r)) {
+		if (r.len)
+			cb(ud, &r);
+	}
 }
 
-char *append_value(char *s, const char *v)
+/**
+ * Make room for \a len more bytes (and a NUL) at the end of the string
+ */
+static char *sb_grow(struct strbuf *sb, size_t len)
 {
-	size_t slen = s ? strlen(s) : 0;
+	char *p;
+	size_t size = sb->size ? sb->size : 64;
+
+	while (size < sb->off + sb->len + len + 1)
+		size <<= 1;
+
+	if (size != sb->size) {
+		if (sb->pool) {
+			if (!(p = pool_alloc(size)))
+				abort();
+
+			if (sb->s) {
+				memcpy(p, sb->s, sb->size);
+				pool_free(sb->s, sb->size);
+			}
+		} else if (!(p = realloc(sb->s, size))) {
+			abort();
+		}
+
+		if (!sb->s)
+			p[sb->off] = '\0';
+		sb->s    = p;
+		sb->size = size;
+	}
+
+	return sb->s + sb->off + sb->len;
+}
 
-	if (!v || !*v)
-		return s;
+void sb_reserve(struct strbuf *sb, size_t len)
+{
+	if (sb->len)
+		return;
 
-	if (!(s = realloc(s, slen + strlen(v) + 2)))
-		abort();
+	sb->off = len;
+	*sb_grow(sb, 0) = '\0';
+}
 
-	sprintf(s + slen, "%s%c", v, *field_sep);
-	return s;
+void sb_append_valuen(struct strbuf *sb, const char *v, size_t vlen)
+{
+	char *p;
+
+	if (!v || !vlen)
+		return;
+
+	p = sb_grow(sb, vlen + 1);
+	memcpy(p, v, vlen);
+	p[vlen]     = *field_sep;
+	p[vlen + 1] = '\0';
+	sb->len    += vlen + 1;
 }
 
-char *append_field(char *s, const char *k, const char *v)
+void sb_append_value(struct strbuf *sb, const char *v)
 {
-	size_t slen = s ? strlen(s) : 0;
+	sb_append_valuen(sb, v, v ? strlen(v) : 0);
+}
 
-	if (!k || !v || !*k || !*v)
-		return s;
+void sb_append_fieldn(struct strbuf *sb, const char *k, size_t klen, const char *v, size_t vlen)
+{
+	char *p;
 
-	if (!(s = realloc(s, slen + strlen(k) + strlen(v) + 3)))
-		abort();
+	if (!k || !v || !klen || !vlen)
+		return;
 
-	sprintf(s + slen, "%s%c%s%c", k, *value_sep, v, *field_sep);
-	return s;
+	p = sb_grow(sb, klen + vlen + 2);
+	memcpy(p, k, klen);
+	p[klen] = *value_sep;
+	memcpy(p + klen + 1, v, vlen);
+	p[klen + vlen + 1] = *field_sep;
+	p[klen + vlen + 2] = '\0';
+	sb->len += klen + vlen + 2;
 }
 
-char *append_record(char *s, const char *r)
+void sb_append_field(struct strbuf *sb, const char *k, const char *v)
 {
-	size_t slen = s ? strlen(s) : 0;
-	size_t rlen = r ? strlen(r) : 0;
+	if (k && v)
+		sb_append_fieldn(sb, k, strlen(k), v, strlen(v));
+}
 
-	if (!rlen)
-		return s;
+void sb_end_record(struct strbuf *sb)
+{
+	char *p;
 
-	if (!(s = realloc(s, slen + rlen + 2)))
-		abort();
+	if (sb->len == sb->rec)
+		return;
 
-	memcpy(s + slen, r, rlen);
-	s[slen + rlen] = *record_sep;
-	s[slen + rlen + 1] = '\0';
-	return s;
+	p    = sb_grow(sb, 1);
+	p[0] = *record_sep;
+	p[1] = '\0';
+	sb->rec = ++sb->len;
 }
 
-char *prepend_record(char *r, const char *s)
+char *sb_detach(struct strbuf *sb)
 {
-	size_t slen = s ? strlen(s) : 0;
-	size_t rlen = r ? strlen(r) : 0;
+	char *s = sb->s;
 
-	if (!slen)
-		return r;
+	assert(!sb->pool);
+	if (!sb->len) {
+		sb_free(sb);
+		return NULL;
+	}
 
-	if (!(r = realloc(r, slen + rlen + 2)))
-		abort();
+	if (sb->off)
+		memmove(s, s + sb->off, sb->len + 1);
 
-	memmove(r + slen + 1, r, rlen);
-	memcpy(r, s, slen);
-	r[slen] = *record_sep;
-	r[slen + rlen + 1] = '\0';
-	return r;
+	memset(sb, 0, sizeof *sb);
+	return s;
 }
 
+void sb_free(struct strbuf *sb)
+{
+	if (sb->pool)
+		pool_free(sb->s, sb->size);
+	else free(sb->s);
+	memset(sb, 0, sizeof *sb);
+}
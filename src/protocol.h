@@ -8,6 +8,8 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stddef.h>
+
 /**
  * UID Constants
  *
@@ -407,12 +409,103 @@
 #define PACKET_PT5_EMAIL_CONFIRM        0x0898 /* Display email confirmation code dialog */
 #define PACKET_PT5_SEND_LOGIN           0xffb1 /* PT 5: Causes PACKET_LOGIN to be sent (same payload as PACKET_CHALLENGE) */
 
-void each_field(char *s, void *ud, void (*cb)(void *ud, unsigned i, const char *line));
-void each_field_kv(char *s, void *ud, void (*cb)(void *ud, const char *k, const char *v));
-void each_record(char *s, void *ud, int (*cb)(void *userdata, const char *record));
-char *append_value(char *s, const char *v);
-char *append_field(char *s, const char *k, const char *v);
-char *append_record(char *s, const char *r);
-char *prepend_record(char *r, const char *s);
+/**
+ * A run of \a len bytes at \a p, usually within a packet. It isn't
+ * NUL-terminated, so tokenizing doesn't need to write to the packet.
+ */
+struct span {
+	const char *p;
+	size_t len;
+};
+
+/**
+ * Take the next token, up to \a delim, off the front of \a s. Empty
+ * tokens between delimiters are kept, but a trailing delimiter doesn't
+ * start another one.
+ *
+ * \return non-zero if a token was taken, or 0 (with an empty \a tok)
+ *         if \a s is exhausted.
+ */
+int span_next(struct span *s, int delim, struct span *tok);
+
+/**
+ * \return non-zero if \a s is the same as the string \a str
+ */
+int span_eq(const struct span *s, const char *str);
+
+/**
+ * \return a NUL-terminated copy of \a s (to be free()'d), or NULL if
+ *         \a s has no pointer.
+ */
+char *span_dup(const struct span *s);
+
+/**
+ * Parse \a s as a decimal number, as atol() would
+ */
+long span_tol(const struct span *s);
+
+/**
+ * Call \a cb for each non-empty field, or record, in the \a len bytes
+ * at \a s. For each_field_kv(), \a v has a NULL pointer if the field
+ * has no value.
+ */
+void each_field(const char *s, size_t len, void *ud, void (*cb)(void *ud, unsigned i, const struct span *f));
+void each_field_kv(const char *s, size_t len, void *ud, void (*cb)(void *ud, const struct span *k, const struct span *v));
+void each_record(const char *s, size_t len, void *ud, int (*cb)(void *ud, const struct span *r));
+
+/**
+ * String builder for records
+ *
+ * The string starts \a off bytes into \a s, and is NUL-terminated.
+ * Space can be reserved in front of it with sb_reserve(), such as for
+ * the packet it will become.
+ *
+ * With \a pool set, the buffer comes from pool_alloc() rather than
+ * malloc() (see packet_sb_init().)
+ */
+struct strbuf {
+	char *s;     /**< Buffer, or NULL                     */
+	size_t off;  /**< Offset of the string                */
+	size_t len;  /**< Length of the string                */
+	size_t size; /**< Allocated size                      */
+	size_t rec;  /**< Offset of the record being appended */
+	int pool;    /**< Buffer is from the pool             */
+};
+
+#define STRBUF_INIT { NULL, 0, 0, 0, 0, 0 }
+
+/**
+ * Reserve \a len bytes in front of the string, such as room for a
+ * packet header. This must be done before anything is appended.
+ */
+void sb_reserve(struct strbuf *sb, size_t len);
+
+/**
+ * Append a value, or a key=value field, to the current record. Empty
+ * values are skipped.
+ */
+void sb_append_value(struct strbuf *sb, const char *v);
+void sb_append_field(struct strbuf *sb, const char *k, const char *v);
+
+/**
+ * As above, for values (and keys) of a known length
+ */
+void sb_append_valuen(struct strbuf *sb, const char *v, size_t vlen);
+void sb_append_fieldn(struct strbuf *sb, const char *k, size_t klen, const char *v, size_t vlen);
+
+/**
+ * End the current record, if anything was appended to it
+ */
+void sb_end_record(struct strbuf *sb);
+
+/**
+ * Take the string, leaving the builder empty. This isn't for builders
+ * using the pool.
+ *
+ * \return the string (to be free()'d), or NULL if it's empty.
+ */
+char *sb_detach(struct strbuf *sb);
+
+void sb_free(struct strbuf *sb);
 
 #endif /* PROTOCOL_H */
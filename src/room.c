@@ -13,53 +13,68 @@
 #include "logging.h"
 #include "database.h"
 #include "protocol.h"
+#include "proto_ops.h"
 #include "packet.h"
 #include "hash.h"
 #include "user.h"
 #include "room.h"
+#include "uidmap.h"
 
 /* from server.c */
-extern struct ht *uid_to_context;
-
-/* Prepared queries on db_w */
-static void *in_room;
-static void *is_invis;
-static void *is_admin;
-static void *search_room_queries[4];
-static void *set_mic;
-static void *set_hand;
-static void *all_hands;
-static void *set_topic;
-static void *do_ban;
-static void *do_unban;
-static void *do_bounce;
-static void *do_unbounce;
-static void *do_mic;
-static void *do_text;
-static void *do_video;
+extern struct uidmap *uid_to_context;
 
-static const char * const empty_str = "";
-
-static const char * const rooms_fmt[5] = {
-	"FROM rooms WHERE catg=%ld ORDER BY '#' DESC, nm ASC",
-	"FROM rooms ORDER BY '#' DESC, nm ASC LIMIT 5",
-	"FROM rooms ORDER BY created DESC, nm ASC LIMIT 5",
+/**
+ * Initial size of a room's member array
+ */
+#define ROOM_MEMBERS_MIN 8
 
-	"SELECT id,r,p,v,l,c,nm,"
-	"(SELECT COUNT(uid) FROM room_users WHERE id=rooms.id) AS '#' ",
+/**
+ * Room user lists are split into packets of at most ROOM_USERLIST_MAX
+ * bytes, each of which holds as many member records (of at most
+ * ROOM_RECORD_MAX bytes) as will fit.
+ */
+#define ROOM_USERLIST_MAX 0xf000
+#define ROOM_RECORD_MAX   192
 
-	/* PT 8.2+: Uses the new room list packet (t=S is for subcategories) */
-	"SELECT 'G' AS t,id,nm AS n,r,p,v,l,c,'Y' AS eof,lang,"
-	"(SELECT COUNT(uid) FROM room_users WHERE id=rooms.id) AS m "
-	"FROM rooms WHERE catg=%ld AND subcatg IS NULL ORDER BY m DESC, n ASC",
+/**
+ * Details of a room needed to join it
+ */
+struct room_info {
+	int found;
+	int voice;
+	int priv;
+	int mike;
+	unsigned long code;
+	unsigned long topic_setter;
+	int banned;
+	int bounced;
+	char *name;
+	char *topic;
+	char *password;
 };
 
+/**
+ * Occupied rooms, keyed by id
+ */
+static struct uidmap *rooms;
+static unsigned long room_count; /**< Number of occupied rooms    */
+static unsigned long user_count; /**< Number of users in any room */
+
+static const char * const empty_str = "";
+
+/* The virtual categories look the same to every version */
+static const char top_rooms_sql[] =
+	ROOMS_SELECT "FROM rooms ORDER BY '#' DESC, nm ASC LIMIT 5";
+static const char featured_rooms_sql[] =
+	ROOMS_SELECT "FROM rooms ORDER BY created DESC, nm ASC LIMIT 5";
+
 /**
  * Get the room counts by category
  */
 char *room_counts_by_category(void *db_r)
 {
-	char buf[512], *s = NULL;
+	char buf[512];
+	struct strbuf sb = STRBUF_INIT;
 
 	sprintf(buf, /* The two virtual categories will have up to 5 entries */
 			"SELECT %d AS id, (SELECT MIN(5, COUNT(DISTINCT id)) FROM rooms) AS '#' UNION "
@@ -67,230 +82,539 @@ char *room_counts_by_category(void *db_r)
 			"SELECT catg AS id, COUNT(*) AS '#' FROM rooms WHERE catg NOT IN (%d,%d) GROUP BY catg",
 			CATEGORY_TOP, CATEGORY_FEATURED, CATEGORY_TOP, CATEGORY_FEATURED);
 
-	if (!db_exec(db_r, &s, buf, db_row_to_record) && s)
-		return s;
+	if (!db_exec(db_r, &sb, buf, db_row_to_record))
+		return sb_detach(&sb);
 
-	free(s);
+	sb_free(&sb);
 	return NULL;
 }
 
 /**
  * Get the list of rooms for the given category
  */
-char *rooms_for_category(void *db_r, unsigned long protocol_version, unsigned long catid)
+int rooms_for_category(void *db_r, struct strbuf *sb, const struct pt_proto_ops *ops, unsigned long catid)
 {
-	char buf[256], *s = NULL;
-	unsigned idx = ((catid == CATEGORY_FEATURED) << 1) | (catid == CATEGORY_TOP);
+	char buf[32];
+	void *stmt;
+	const char *sql = ops->room_list_sql;
 
-	if (protocol_version >= PROTOCOL_VERSION_82 && !idx) {
-		sprintf(buf, rooms_fmt[4], catid);
-		if (db_exec(db_r, &s, buf, db_row_to_record)) {
-			free(s);
-			return NULL;
-		}
-	} else {
-		memcpy(buf, rooms_fmt[3], strlen(rooms_fmt[3]) + 1);
-		sprintf(buf + strlen(buf), rooms_fmt[idx], catid);
-		if (db_exec(db_r, &s, buf, db_row_to_record)) {
-			free(s);
-			return NULL;
-		}
-	}
+	if (catid == CATEGORY_TOP)
+		sql = top_rooms_sql;
+	else if (catid == CATEGORY_FEATURED)
+		sql = featured_rooms_sql;
+
+	if (!(stmt = db_cached(db_r, sql)))
+		return -1;
 
-	sprintf(buf, "catg=%ld\n", catid);
-	s = prepend_record(s, buf);
-	return s;
+	sprintf(buf, "%d", (int)catid);
+	sb_append_field(sb, "catg", buf);
+	sb_end_record(sb);
+
+	if (sql == ops->room_list_sql)
+		db_bind(stmt, "l", catid);
+	return db_get_records(stmt, sb, 0);
 }
 
 /**
  * Get the list of rooms for the given category + subcategory
  */
-char *rooms_for_subcategory(void *db_r, unsigned long catid, unsigned long scid)
+int rooms_for_subcategory(void *db_r, struct strbuf *sb, unsigned long catid, unsigned long scid)
 {
-	char buf[512], *s = NULL;
+	char buf[32];
+	void *stmt;
 
-	sprintf(
-		buf,
+	if (!(stmt = db_cached(db_r,
 		"SELECT 'G' AS t, subcatg AS sc,id,nm AS n,r,p,v,l,c,"
-		"(SELECT COUNT(uid) FROM room_users WHERE id=rooms.id) AS m,"
-		"'Y' AS eof, lang FROM rooms WHERE catg=%ld AND subcatg=%ld ORDER BY nm DESC, n ASC",
-		catid, scid);
+		"room_population(id) AS m,'Y' AS eof, lang FROM rooms WHERE catg=? AND subcatg=? ORDER BY nm DESC, n ASC")))
+		return -1;
 
-	if (db_exec(db_r, &s, buf, db_row_to_record)) {
-		free(s);
-		return NULL;
-	}
+	sprintf(buf, "%d", (int)catid);
+	sb_append_field(sb, "catg", buf);
+	sprintf(buf, "%d", (int)scid);
+	sb_append_field(sb, "subcatg", buf);
+	sb_end_record(sb);
 
-	sprintf(buf, "catg=%ld\nsubcatg=%ld\n", catid, scid);
-	s = prepend_record(s, buf);
-	return s;
+	db_bind(stmt, "ll", catid, scid);
+	return db_get_records(stmt, sb, 0);
 }
 
-static int broadcast_to_room_cb(void *userdata, int cols, char *val[], char *col[])
+static struct room_ref *find_ref(struct pt_context *ctx, unsigned long rid)
 {
-	struct pt_context *ctx;
-	struct pt_packet *pkt = userdata;
-	(void)col;
+	unsigned i;
 
-	if (!userdata || cols != 1)
-		return 0;
+	for (i = 0; i < ctx->nrooms; i++) {
+		if (ctx->rooms[i].room->id == rid)
+			return &ctx->rooms[i];
+	}
 
-	if (!(ctx = ht_get_ptr_nc(uid_to_context, val[0])))
-		return 0;
+	return NULL;
+}
 
-	/* Added in 8.x, 9.0 removed this option from the room */
-	if (pkt->type == PACKET_NUDGE_IN && ctx->protocol_version != PROTOCOL_VERSION_82)
-		return 0;
+/**
+ * Get the room with the given id, if anyone is in it
+ */
+struct room *room_get(unsigned long rid)
+{
+	return uidmap_get(rooms, rid);
+}
 
-	send_packet(ctx, pkt);
-	return 0;
+/**
+ * Get the user's membership in the given room
+ *
+ * Users are only ever in a handful of rooms, so this is a short walk
+ * over the context's own list.
+ */
+struct room_member *room_member(struct pt_context *ctx, unsigned long rid)
+{
+	struct room_ref *ref;
+
+	if (!ctx || !(ref = find_ref(ctx, rid)))
+		return NULL;
+
+	return &ref->room->members[ref->idx];
 }
 
 /**
- * Non-zero if the given user is in the given room
+ * Add the user to a room, creating it if it's empty
  */
-int user_in_room(void *db_w, unsigned long rid, unsigned long uid)
+struct room_member *room_add_member(struct pt_context *ctx, unsigned long rid, unsigned flags)
 {
-	if (!in_room) {
-		in_room = db_prepare(
-			db_w,
-			"SELECT COUNT(*) FROM room_users WHERE id=? AND uid=?"
-		);
+	struct room *room;
+	struct room_member *m;
+
+	if ((m = room_member(ctx, rid)))
+		return m;
+
+	if (!rooms)
+		rooms = uidmap_alloc();
+
+	if (!(room = room_get(rid))) {
+		if (!(room = calloc(1, sizeof *room)))
+			abort();
+
+		room->id = rid;
+		if (uidmap_set(rooms, rid, room)) {
+			free(room);
+			return NULL;
+		}
+		++room_count;
 	}
 
-	if (!in_room)
-		return 0;
+	if (room->nmembers == room->size) {
+		room->size = room->size ? room->size << 1 : ROOM_MEMBERS_MIN;
+		if (!(room->members = realloc(room->members, room->size * sizeof *room->members)))
+			abort();
+	}
+
+	if (ctx->nrooms == ctx->rooms_size) {
+		ctx->rooms_size = ctx->rooms_size ? ctx->rooms_size << 1 : 4;
+		if (!(ctx->rooms = realloc(ctx->rooms, ctx->rooms_size * sizeof *ctx->rooms)))
+			abort();
+	}
 
-	db_reset_prepared(in_room);
-	db_bind(in_room, "ii", rid, uid);
-	return 1 || !!db_get_count(in_room);
+	if (!ctx->nrooms)
+		++user_count;
+
+	ctx->rooms[ctx->nrooms].room  = room;
+	ctx->rooms[ctx->nrooms++].idx = room->nmembers;
+
+	m = &room->members[room->nmembers++];
+	m->ctx   = ctx;
+	m->flags = flags;
+	return m;
 }
 
 /**
- * Non-zero if the given user is invisble in the given room
+ * Remove the user from a room, freeing it once it's empty
  */
-int user_is_invisible(void *db_w, unsigned long rid, unsigned long uid)
+void room_remove_member(struct pt_context *ctx, unsigned long rid)
 {
-	if (!is_invis) {
-		is_invis = db_prepare(
-			db_w,
-			"SELECT COUNT(*) FROM room_users WHERE id=? AND uid=? AND invis=1"
-		);
+	struct room *room;
+	struct room_ref *ref;
+
+	if (!ctx || !(ref = find_ref(ctx, rid)))
+		return;
+
+	/* Move the last member into the vacated spot */
+	room = ref->room;
+	if (ref->idx != --room->nmembers) {
+		room->members[ref->idx] = room->members[room->nmembers];
+		find_ref(room->members[ref->idx].ctx, rid)->idx = ref->idx;
 	}
 
-	if (!is_invis)
-		return 0;
+	*ref = ctx->rooms[--ctx->nrooms];
+	if (!ctx->nrooms)
+		--user_count;
 
-	db_reset_prepared(is_invis);
-	db_bind(is_invis, "ii", rid, uid);
-	return !!db_get_count(is_invis);
+	if (!room->nmembers) {
+		uidmap_rm(rooms, rid, room);
+		free(room->members);
+		free(room);
+		--room_count;
+	}
 }
 
 /**
- * Non-zero if the given user is a room admin and present in the room
+ * Remove the user from a room, and let everyone else in it know
  */
-int user_is_room_admin(void *db_w, unsigned long rid, unsigned long uid)
+void leave_room(struct pt_context *ctx, unsigned long rid)
 {
-	if (!is_admin) {
-		is_admin = db_prepare(
-			db_w,
-			"SELECT COUNT(*) FROM room_users WHERE id=? AND uid=? AND admin=1"
-		);
+	char buf[8];
+	struct room_member *m;
+
+	if (!(m = room_member(ctx, rid)))
+		return;
+
+	/* Invisible joins aren't announced, so neither are their leaves */
+	if (m->flags & ROOM_F_INVIS) {
+		room_remove_member(ctx, rid);
+		return;
 	}
 
-	if (!is_admin)
-		return 0;
+	buf[0] = (rid >> 24) & 0xff;
+	buf[1] = (rid >> 16) & 0xff;
+	buf[2] = (rid >>  8) & 0xff;
+	buf[3] = rid & 0xff;
+	buf[4] = (ctx->uid >> 24) & 0xff;
+	buf[5] = (ctx->uid >> 16) & 0xff;
+	buf[6] = (ctx->uid >> 8)  & 0xff;
+	buf[7] = ctx->uid & 0xff;
 
-	db_reset_prepared(is_admin);
-	db_bind(is_admin, "ii", rid, uid);
-	return !!db_get_count(is_admin);
+	broadcast_to_room(ctx, rid, new_packet(PACKET_ROOM_USER_LEFT, 8, buf, PACKET_F_COPY));
+	room_remove_member(ctx, rid);
 }
 
 /**
- * Broadcast a packet (i.e. PACKET_ROOM_MESSAGE_IN) to an entire room
+ * Remove the user from all of the rooms they're in (i.e. on disconnect)
  */
-void broadcast_to_room(struct pt_context *ctx, unsigned long rid, struct pt_packet *pkt)
+void leave_all_rooms(struct pt_context *ctx)
 {
-	char buf[128];
+	while (ctx->nrooms)
+		leave_room(ctx, ctx->rooms[ctx->nrooms - 1].room->id);
+}
 
-	if (!user_in_room(ctx->db_w, rid, ctx->uid))
-		return;
+static int room_info_from_row(void *userdata, int cols, char *val[], char *col[])
+{
+	struct room_info *info = userdata;
+	(void)col;
 
-	sprintf(buf, "SELECT uid FROM room_users WHERE id=%ld AND uid<>%ld", rid, ctx->uid);
-	db_exec(ctx->db_w, pkt, buf, broadcast_to_room_cb);
+	if (!info || cols != 10)
+		return 0;
+
+	info->found        = 1;
+	info->voice        = val[1] && atoi(val[1]);
+	info->priv         = val[2] && atoi(val[2]);
+	info->mike         = val[3] && atoi(val[3]);
+	info->code         = val[4] ? strtoul(val[4], NULL, 10) : 0;
+	info->topic_setter = val[6] ? strtoul(val[6], NULL, 10) : 0;
+	info->banned       = val[7] && atoi(val[7]);
+	info->bounced      = val[8] && atoi(val[8]);
+	info->name         = strdup(val[0] ? val[0] : empty_str);
+	info->topic        = val[5] ? strdup(val[5]) : NULL;
+	info->password     = val[9] ? strdup(val[9]) : NULL;
+	return 0;
 }
 
 /**
- * Broadcast a packet (i.e. PACKET_ROOM_MESSAGE_IN) to non-admins in a room
+ * Write a member's user list record to \a buf
+ *
+ * \return the length of the record
  */
-void broadcast_to_non_admins(struct pt_context *ctx, unsigned long rid, struct pt_packet *pkt)
+static size_t member_record(char *buf, unsigned long rid, const struct room_member *m)
 {
-	char buf[128];
+	return (size_t)sprintf(
+		buf,
+		"group_id=%lu\nuid=%lu\nnickname=%.*s\nadmin=%d\ncolor=000000000\n"
+		"mic=%d\npub=N\naway=0\nreq=%d\nred=%d\n\xc8",
+		rid, m->ctx->uid, NICKNAME_MAX,
+		m->ctx->user.nickname ? m->ctx->user.nickname : empty_str,
+		!!(m->flags & ROOM_F_ADMIN), !!(m->flags & ROOM_F_MIC),
+		!!(m->flags & ROOM_F_HAND), !!(m->flags & ROOM_F_REDDOT)
+	);
+}
 
-	if (!user_in_room(ctx->db_w, rid, ctx->uid))
-		return;
+/**
+ * Send a room's user list to a new member
+ *
+ * The list is built straight from the member array, in as few packets
+ * as it takes to fit under the maximum packet length. Each packet is
+ * queued by reference, so it goes out without being copied again.
+ * Invisible members are only listed to themselves.
+ */
+static void send_user_list(struct pt_context *ctx, struct room *room)
+{
+	unsigned i;
+	size_t len = 0;
+	char *buf = NULL;
+	struct room_member *m;
+
+	for (i = 0; i < room->nmembers; i++) {
+		m = &room->members[i];
+		if ((m->flags & ROOM_F_INVIS) && m->ctx != ctx)
+			continue;
+
+		if (!buf && !(buf = malloc(ROOM_USERLIST_MAX)))
+			abort();
+
+		len += member_record(buf + len, room->id, m);
+		if (len > ROOM_USERLIST_MAX - ROOM_RECORD_MAX) {
+			send_packet(ctx, new_packet(PACKET_ROOM_USERLIST, len, buf, 0));
+			buf = NULL;
+			len = 0;
+		}
+	}
 
-	sprintf(buf, "SELECT uid FROM room_users WHERE id=%ld AND uid<>%ld AND admin=0", rid, ctx->uid);
-	db_exec(ctx->db_w, pkt, buf, broadcast_to_room_cb);
+	if (buf)
+		send_packet(ctx, new_packet(PACKET_ROOM_USERLIST, len, buf, 0));
 }
 
 /**
- * Search for a room by partial match on the room name
+ * Join a room
  */
-char *search_rooms(void *db_w, unsigned protocol_version, const char *partial)
+int join_room(struct pt_context *ctx, unsigned long rid, int as_admin,
+              unsigned long code, int invisible, const char *password)
 {
-	char *sql = NULL, *s = NULL;
-	void *sr;
+	void *stmt;
+	int ret = 0;
+	char buf[512];
+	unsigned flags = 0;
+	struct room_info info;
+	struct room_member *m;
 
-	if (!db_w || !partial)
-		return NULL;
+	if (room_member(ctx, rid))
+		return 0;
 
-	if (!search_room_queries[0]) {
-		search_room_queries[0] = db_prepare(
-			db_w,
-			"SELECT r,nm,id,v,l FROM rooms WHERE p=0 AND nm LIKE ?"
-		);
+	memset(&info, 0, sizeof info);
+	if (!(stmt = db_cached(ctx->db_r,
+		"SELECT nm,v,p,mike,code,topic,topic_setter,"
+		"(SELECT COUNT(*) FROM room_bans WHERE id=rooms.id AND uid=?1),"
+		"(SELECT COUNT(*) FROM room_bounces WHERE id=rooms.id AND uid=?1),"
+		"password FROM rooms WHERE id=?2"))) {
+		ret = ROOM_ERR_NXROOM;
+		goto ret;
 	}
 
-	/**
-	 * PT 8 added the category, presumably.
-	 */
-	if (!search_room_queries[1]) {
-		search_room_queries[1] = db_prepare(
-			db_w,
-			"SELECT r,nm,id,v,l,catg,"
-			"(SELECT COUNT(uid) FROM room_users WHERE id=rooms.id) AS '#' "
-			"FROM rooms WHERE p=0 AND nm LIKE ?"
-		);
+	db_bind(stmt, "ll", ctx->uid, rid);
+	if (db_get_row(stmt, &info, room_info_from_row) || !info.found) {
+		ret = ROOM_ERR_NXROOM;
+		goto ret;
+	}
+
+	/* Staff aren't subject to bans, bounces, or admin codes */
+	if (ctx->user.admin || ctx->user.sup) {
+		if (as_admin) flags |= ROOM_F_ADMIN;
+		if (invisible) flags |= ROOM_F_INVIS;
+	} else if (info.banned) {
+		ret = ROOM_ERR_BANNED;
+		goto ret;
+	} else if (info.bounced) {
+		ret = ROOM_ERR_BOUNCED;
+		goto ret;
+	} else if (as_admin) {
+		if (!info.code || code != info.code) {
+			ret = ROOM_ERR_CODE;
+			goto ret;
+		}
+
+		flags |= ROOM_F_ADMIN;
+	} else if (info.priv && info.password && *info.password &&
+	           (!password || strcmp(password, info.password))) {
+		/* Room admins use their code instead of the password */
+		ret = ROOM_ERR_PASSWORD;
+		goto ret;
+	}
+
+	if (info.mike || (flags & ROOM_F_ADMIN))
+		flags |= ROOM_F_MIC;
+
+	if (!room_add_member(ctx, rid, flags)) {
+		ret = ROOM_ERR_NXROOM;
+		goto ret;
 	}
 
 	/**
-	 * PT 8.2+ added subcategories after 8.2 beta, so the 8.2 beta
-	 * builds will break. PT 9 adds lang, but 8.2 ignores it.
+	 * Room joined
 	 *
-	 * TODO: WTF is the 6 digit number for?
+	 * Data:
+	 *   0 - 3: room id
+	 *   4 - 5: room type (ROOM_TYPE_*)
+	 *   6 - 7: 00 01 if joined as an admin, 00 00 otherwise
+	 *   8 - 11: udp voice port (0000082a)
+	 *   12 - *: room name
 	 */
-	if (!search_room_queries[2]) {
-		search_room_queries[2] = db_prepare(
-			db_w,
-			"SELECT r,nm,id,v,l,catg,"
-			"(SELECT COUNT(uid) FROM room_users WHERE id=rooms.id) AS '#',"
-			"'001000',subcatg,lang "
-			"FROM rooms WHERE p=0 AND nm LIKE ?"
-		);
+	buf[0]  = (rid >> 24) & 0xff;
+	buf[1]  = (rid >> 16) & 0xff;
+	buf[2]  = (rid >>  8) & 0xff;
+	buf[3]  = rid & 0xff;
+	buf[4]  = '\0';
+	buf[5]  = info.voice ? (info.priv ? ROOM_TYPE_PRIVATE_VOICE : ROOM_TYPE_VOICE)
+	                     : (info.priv ? ROOM_TYPE_PRIVATE_TEXT : ROOM_TYPE_TEXT);
+	buf[6]  = '\0';
+	buf[7]  = !!(flags & ROOM_F_ADMIN);
+	buf[8]  = '\0';
+	buf[9]  = '\0';
+	buf[10] = 0x08;
+	buf[11] = 0x2a;
+	snprintf(buf + 12, sizeof buf - 12, "%s", info.name);
+	send_packet(ctx, new_packet(PACKET_ROOM_JOINED, 12 + strlen(buf + 12), buf, PACKET_F_COPY));
+	send_user_list(ctx, room_get(rid));
+
+	if (info.topic && *info.topic) {
+		buf[4] = (info.topic_setter >> 24) & 0xff;
+		buf[5] = (info.topic_setter >> 16) & 0xff;
+		buf[6] = (info.topic_setter >>  8) & 0xff;
+		buf[7] = info.topic_setter & 0xff;
+		snprintf(buf + 8, sizeof buf - 8, "%s", info.topic);
+		send_packet(ctx, new_packet(PACKET_ROOM_TOPIC, 8 + strlen(buf + 8), buf, PACKET_F_COPY));
+	}
+
+	/* Let everyone else know */
+	if (!(flags & ROOM_F_INVIS) && (m = room_member(ctx, rid))) {
+		broadcast_to_room(ctx, rid, new_packet(
+			PACKET_ROOM_USER_JOINED, member_record(buf, rid, m), buf, PACKET_F_COPY
+		));
+	}
+
+ret:
+	free(info.name);
+	free(info.topic);
+	free(info.password);
+	return ret;
+}
+
+/**
+ * Number of users in the given room
+ */
+unsigned long room_population(unsigned long rid)
+{
+	struct room *room;
+	return (room = room_get(rid)) ? room->nmembers : 0;
+}
+
+/**
+ * Number of users in rooms, and the number of occupied rooms
+ */
+void room_totals(unsigned long *users, unsigned long *rooms)
+{
+	*users = user_count;
+	*rooms = room_count;
+}
+
+void rooms_print_stats(void)
+{
+	struct ht_stats st;
+
+	if (rooms) {
+		uidmap_stats(rooms, &st);
+		ht_log_stats("rooms", &st);
 	}
+}
+
+/**
+ * Free all rooms (on shutdown)
+ *
+ * Everyone should've left by now, via leave_all_rooms().
+ */
+void rooms_free(void)
+{
+	uidmap_free(rooms);
+	rooms = NULL;
+}
+
+/**
+ * Non-zero if the given user is in the given room
+ */
+int user_in_room(struct pt_context *ctx, unsigned long rid)
+{
+	return !!room_member(ctx, rid);
+}
+
+/**
+ * Non-zero if the given user is invisble in the given room
+ */
+int user_is_invisible(struct pt_context *ctx, unsigned long rid)
+{
+	struct room_member *m;
+	return (m = room_member(ctx, rid)) && (m->flags & ROOM_F_INVIS);
+}
+
+/**
+ * Non-zero if the given user is a room admin and present in the room
+ */
+int user_is_room_admin(struct pt_context *ctx, unsigned long rid)
+{
+	struct room_member *m;
+	return (m = room_member(ctx, rid)) && (m->flags & ROOM_F_ADMIN);
+}
+
+/**
+ * Send a packet to everyone in a room but the sender, and those
+ * members having any of the flags in \a skip.
+ */
+static void fan_out(struct pt_context *ctx, unsigned long rid, struct pt_packet *pkt, unsigned skip)
+{
+	unsigned i;
+	struct room *room;
+	struct room_ref *ref;
+	struct room_member *m;
+
+	packet_ref(pkt);
+	if (!(ref = find_ref(ctx, rid)))
+		goto ret;
+
+	room = ref->room;
+	for (i = 0; i < room->nmembers; i++) {
+		m = &room->members[i];
+		if (m->ctx == ctx || (m->flags & skip))
+			continue;
+
+		/* Added in 8.x, 9.0 removed this option from the room */
+		if (pkt->type == PACKET_NUDGE_IN && !m->ctx->ops->room_nudges)
+			continue;
+
+		send_packet(m->ctx, pkt);
+	}
+
+ret:
+	packet_unref(pkt);
+}
+
+/**
+ * Broadcast a packet (i.e. PACKET_ROOM_MESSAGE_IN) to an entire room
+ */
+void broadcast_to_room(struct pt_context *ctx, unsigned long rid, struct pt_packet *pkt)
+{
+	fan_out(ctx, rid, pkt, 0);
+}
+
+/**
+ * Broadcast a packet (i.e. PACKET_ROOM_MESSAGE_IN) to non-admins in a room
+ */
+void broadcast_to_non_admins(struct pt_context *ctx, unsigned long rid, struct pt_packet *pkt)
+{
+	fan_out(ctx, rid, pkt, ROOM_F_ADMIN);
+}
+
+/**
+ * Search for a room by partial match on the room name
+ */
+char *search_rooms(void *db_r, const struct pt_proto_ops *ops, const char *partial)
+{
+	char *sql = NULL;
+	void *sr;
+	struct strbuf sb = STRBUF_INIT;
 
+	if (!partial)
+		return NULL;
 
-	if (!search_room_queries[0] || !search_room_queries[1] || !search_room_queries[2])
+	if (!(sr = db_cached(db_r, ops->room_search_sql)))
 		return NULL;
 
-	sr = search_room_queries[((protocol_version >= PROTOCOL_VERSION_82) << 1) | (protocol_version == PROTOCOL_VERSION_80)];
-	db_reset_prepared(sr);
 	db_bind(sr, "t", partial);
 	sql = db_get_prepared_sql(sr);
-	db_exec(db_w, &s, sql, db_values_to_record);
+	db_exec(db_r, &sb, sql, db_values_to_record);
 	db_free(sql);
-	return s;
+	return sb_detach(&sb);
 }
 
 /**
@@ -300,10 +624,18 @@ void reddot_user(struct pt_context *ctx, unsigned long rid, unsigned long uid, i
 {
 	char buf[8];
 	struct pt_packet *pkt;
+	struct pt_context *target;
+	struct room_member *m;
 
-	if (!user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
+	if ((target = uidmap_get(uid_to_context, uid)) &&
+	    (m = room_member(target, rid))) {
+		if (on) m->flags |= ROOM_F_REDDOT;
+		else    m->flags &= ~ROOM_F_REDDOT;
+	}
+
 	buf[0] = (rid >> 24) & 0xff;
 	buf[1] = (rid >> 16) & 0xff;
 	buf[2] = (rid >>  8) & 0xff;
@@ -318,8 +650,10 @@ void reddot_user(struct pt_context *ctx, unsigned long rid, unsigned long uid, i
 		8, buf, PACKET_F_COPY
 	);
 
+	packet_ref(pkt);
 	broadcast_to_room(ctx, rid, pkt);
 	send_packet(ctx, pkt);
+	packet_unref(pkt);
 }
 
 /**
@@ -328,16 +662,11 @@ void reddot_user(struct pt_context *ctx, unsigned long rid, unsigned long uid, i
 void set_all_mics(struct pt_context *ctx, unsigned long rid, int on)
 {
 	char buf[10];
+	unsigned i;
+	struct room *room;
 	struct pt_packet *pkt;
 
-	if (!set_mic) {
-		set_mic = db_prepare(
-			ctx->db_w,
-			"UPDATE room_users SET mic=? WHERE id=?"
-		);
-	}
-
-	if (!set_mic || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
 	buf[0] = (rid >> 24) & 0xff;
@@ -351,13 +680,17 @@ void set_all_mics(struct pt_context *ctx, unsigned long rid, int on)
 	buf[8] = (ctx->uid >> 8)  & 0xff;
 	buf[9] = ctx->uid & 0xff;
 
-	db_reset_prepared(set_mic);
-	db_bind(set_mic, "ii", !!on, rid);
-	db_do_prepared(set_mic);
+	room = room_get(rid);
+	for (i = 0; i < room->nmembers; i++) {
+		if (on) room->members[i].flags |= ROOM_F_MIC;
+		else    room->members[i].flags &= ~ROOM_F_MIC;
+	}
 
 	pkt = new_packet(PACKET_ROOM_SET_MIC, 10, buf, PACKET_F_COPY);
+	packet_ref(pkt);
 	broadcast_to_room(ctx, rid, pkt);
 	send_packet(ctx, pkt);
+	packet_unref(pkt);
 }
 
 /**
@@ -367,15 +700,9 @@ void raise_hand(struct pt_context *ctx, unsigned long rid, int on)
 {
 	char buf[8];
 	struct pt_packet *pkt;
+	struct room_member *m;
 
-	if (!set_hand) {
-		set_hand = db_prepare(
-			ctx->db_w,
-			"UPDATE room_users SET req=? WHERE id=? AND uid=?"
-		);
-	}
-
-	if (!set_hand || !user_in_room(ctx->db_w, rid, ctx->uid))
+	if (!(m = room_member(ctx, rid)))
 		return;
 
 	buf[0] = (rid >> 24) & 0xff;
@@ -387,17 +714,18 @@ void raise_hand(struct pt_context *ctx, unsigned long rid, int on)
 	buf[6] = (ctx->uid >> 8)  & 0xff;
 	buf[7] = ctx->uid & 0xff;
 
-	db_reset_prepared(set_hand);
-	db_bind(set_hand, "iii", !!on, rid, ctx->uid);
-	db_do_prepared(set_hand);
+	if (on) m->flags |= ROOM_F_HAND;
+	else    m->flags &= ~ROOM_F_HAND;
 
 	pkt = new_packet(
 		on ? PACKET_ROOM_USER_HAND_UP : PACKET_ROOM_USER_HAND_DOWN,
 		8, buf, PACKET_F_COPY
 	);
 
+	packet_ref(pkt);
 	broadcast_to_room(ctx, rid, pkt);
 	send_packet(ctx, pkt);
+	packet_unref(pkt);
 }
 
 /**
@@ -406,15 +734,10 @@ void raise_hand(struct pt_context *ctx, unsigned long rid, int on)
 void lower_all_hands(struct pt_context *ctx, unsigned long rid)
 {
 	char buf[8];
+	unsigned i;
+	struct room *room;
 
-	if (!all_hands) {
-		all_hands = db_prepare(
-			ctx->db_w,
-			"UPDATE room_users SET req=? WHERE id=?"
-		);
-	}
-
-	if (!all_hands || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
 	buf[0] = (rid >> 24) & 0xff;
@@ -426,9 +749,9 @@ void lower_all_hands(struct pt_context *ctx, unsigned long rid)
 	buf[6] = (char)((UID_ALL >> 8)  & 0xff);
 	buf[7] = UID_ALL & 0xff;
 
-	db_reset_prepared(all_hands);
-	db_bind(all_hands, "ii", 0, rid);
-	db_do_prepared(all_hands);
+	room = room_get(rid);
+	for (i = 0; i < room->nmembers; i++)
+		room->members[i].flags &= ~ROOM_F_HAND;
 
 	broadcast_to_room(ctx, rid,
 		new_packet(PACKET_ROOM_USER_HAND_DOWN, 8, buf, PACKET_F_COPY)
@@ -441,7 +764,7 @@ void lower_all_hands(struct pt_context *ctx, unsigned long rid)
 char *get_admin_info(struct pt_context *ctx, unsigned long rid)
 {
 	char buf[256];
-	char *s = NULL;
+	struct strbuf sb = STRBUF_INIT;
 
 	sprintf(
 		buf,
@@ -450,8 +773,8 @@ char *get_admin_info(struct pt_context *ctx, unsigned long rid)
 		"WHERE id=%ld), char(10)) AS bounce FROM rooms WHERE id=%ld",
 		 rid, rid
 	);
-	if (db_exec(ctx->db_w, &s, buf, db_row_to_record) || !s)
-		return s;
+	if (db_exec(ctx->db_r, &sb, buf, db_row_to_record) || !sb.len)
+		return sb_detach(&sb);
 
 	sprintf(
 		buf,
@@ -459,8 +782,8 @@ char *get_admin_info(struct pt_context *ctx, unsigned long rid)
 		"WHERE id=%ld), char(10)) AS ban",
 		 rid
 	);
-	db_exec(ctx->db_w, &s, buf, db_row_to_record);
-	return s;
+	db_exec(ctx->db_r, &sb, buf, db_row_to_record);
+	return sb_detach(&sb);
 }
 
 /**
@@ -470,18 +793,11 @@ void room_topic(struct pt_context *ctx, unsigned long rid, const char *topic)
 {
 	char *buf;
 
-	if (!set_topic) {
-		set_topic = db_prepare(
-			ctx->db_w,
-			"UPDATE rooms SET topic=?,topic_setter=? WHERE id=?"
-		);
-	}
-
-	if (!set_topic || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
 	if (!topic) topic = empty_str;
-	if (!(buf = malloc(8 + strlen(topic))))
+	if (!(buf = malloc(9 + strlen(topic))))
 		abort();
 
 	buf[0] = (rid >> 24) & 0xff;
@@ -493,9 +809,9 @@ void room_topic(struct pt_context *ctx, unsigned long rid, const char *topic)
 	buf[6] = (ctx->uid >> 8)  & 0xff;
 	buf[7] = ctx->uid & 0xff;
 
-	db_reset_prepared(set_topic);
-	db_bind(set_topic, "tii", topic, ctx->uid, rid);
-	db_do_prepared(set_topic);
+	db_write(ctx->db_w, NULL, NULL,
+	         "UPDATE rooms SET topic=?,topic_setter=? WHERE id=?",
+	         "tll", topic, ctx->uid, rid);
 
 	memcpy(buf + 8, topic, strlen(topic) + 1);
 	broadcast_to_room(ctx, rid,
@@ -511,26 +827,16 @@ void ban_user(struct pt_context *ctx, unsigned long rid, unsigned long uid)
 	char buf[64];
 	struct pt_context *target;
 
-	if (!do_ban) {
-		do_ban = db_prepare(
-			ctx->db_w,
-			"INSERT INTO room_bans(id,uid,banner,ts) VALUES("
-			"?,?,?,datetime('now','subsec')) ON CONFLICT DO NOTHING"
-		);
-	}
-
-	if (!do_ban || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
-	db_reset_prepared(do_ban);
-	db_bind(do_ban, "iii", rid, uid, ctx->uid);
-	db_do_prepared(do_ban);
+	db_write(ctx->db_w, NULL, NULL,
+	         "INSERT INTO room_bans(id,uid,banner,ts) VALUES("
+	         "?,?,?,datetime('now','subsec')) ON CONFLICT DO NOTHING",
+	         "lll", rid, uid, ctx->uid);
 
-	if (!user_in_room(ctx->db_w, rid, ctx->uid))
-		return;
-
-	sprintf(buf, "%ld", uid);
-	if (!(target = ht_get_ptr_nc(uid_to_context, buf)))
+	if (!(target = uidmap_get(uid_to_context, uid)) ||
+	    !user_in_room(target, rid))
 		return;
 
 	buf[0] = (rid >> 24) & 0xff;
@@ -543,6 +849,7 @@ void ban_user(struct pt_context *ctx, unsigned long rid, unsigned long uid)
 	buf[7] = ctx->uid & 0xff;
 	memcpy(buf + 8, "You have been banned from this room.", 35);
 	send_packet(target, new_packet(PACKET_ROOM_CLOSED, 43, buf, PACKET_F_COPY));
+	leave_room(target, rid);
 }
 
 /**
@@ -550,19 +857,12 @@ void ban_user(struct pt_context *ctx, unsigned long rid, unsigned long uid)
  */
 void unban_user(struct pt_context *ctx, unsigned long rid, unsigned long uid)
 {
-	if (!do_unban) {
-		do_unban = db_prepare(
-			ctx->db_w,
-			"DELETE FROM room_bans WHERE id=? AND uid=?"
-		);
-	}
-
-	if (!do_unban || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
-	db_reset_prepared(do_unban);
-	db_bind(do_unban, "ii", rid, uid);
-	db_do_prepared(do_unban);
+	db_write(ctx->db_w, NULL, NULL,
+	         "DELETE FROM room_bans WHERE id=? AND uid=?",
+	         "ll", rid, uid);
 }
 
 /**
@@ -573,26 +873,16 @@ void bounce_user(struct pt_context *ctx, unsigned long rid, unsigned long uid, c
 	char buf[64];
 	struct pt_context *target;
 
-	if (!do_bounce) {
-		do_bounce = db_prepare(
-			ctx->db_w,
-			"INSERT INTO room_bounces(id,uid,bouncer,reason,ts) VALUES("
-			"?,?,?,?,datetime('now','subsec')) ON CONFLICT DO NOTHING"
-		);
-	}
-
-	if (!do_bounce || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
-	db_reset_prepared(do_bounce);
-	db_bind(do_bounce, "iiit", 0, rid, uid, ctx->uid, reason ? reason : empty_str);
-	db_do_prepared(do_bounce);
-
-	if (!user_in_room(ctx->db_w, rid, ctx->uid))
-		return;
+	db_write(ctx->db_w, NULL, NULL,
+	         "INSERT INTO room_bounces(id,uid,bouncer,reason,ts) VALUES("
+	         "?,?,?,?,datetime('now','subsec')) ON CONFLICT DO NOTHING",
+	         "lllt", rid, uid, ctx->uid, reason ? reason : empty_str);
 
-	sprintf(buf, "%ld", uid);
-	if (!(target = ht_get_ptr_nc(uid_to_context, buf)))
+	if (!(target = uidmap_get(uid_to_context, uid)) ||
+	    !user_in_room(target, rid))
 		return;
 
 	buf[0] = (rid >> 24) & 0xff;
@@ -605,6 +895,7 @@ void bounce_user(struct pt_context *ctx, unsigned long rid, unsigned long uid, c
 	buf[7] = ctx->uid & 0xff;
 	memcpy(buf + 8, "You have been bounced from this room.", 36);
 	send_packet(target, new_packet(PACKET_ROOM_CLOSED, 44, buf, PACKET_F_COPY));
+	leave_room(target, rid);
 }
 
 /**
@@ -612,19 +903,12 @@ void bounce_user(struct pt_context *ctx, unsigned long rid, unsigned long uid, c
  */
 void unbounce_user(struct pt_context *ctx, unsigned long rid, unsigned long uid)
 {
-	if (!do_unbounce) {
-		do_unbounce = db_prepare(
-			ctx->db_w,
-			"DELETE FROM room_bounces WHERE id=? AND uid=?"
-		);
-	}
-
-	if (!do_unbounce || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
-	db_reset_prepared(do_unbounce);
-	db_bind(do_unbounce, "ii", rid, uid);
-	db_do_prepared(do_unbounce);
+	db_write(ctx->db_w, NULL, NULL,
+	         "DELETE FROM room_bounces WHERE id=? AND uid=?",
+	         "ll", rid, uid);
 }
 
 /**
@@ -632,19 +916,12 @@ void unbounce_user(struct pt_context *ctx, unsigned long rid, unsigned long uid)
  */
 void new_user_mic(struct pt_context *ctx, unsigned long rid, int on)
 {
-	if (!do_mic) {
-		do_mic = db_prepare(
-			ctx->db_w,
-			"UPDATE rooms SET mike=? WHERE id=?"
-		);
-	}
-
-	if (!do_mic || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
-	db_reset_prepared(do_mic);
-	db_bind(do_mic, "ii", !!on, rid);
-	db_do_prepared(do_mic);
+	db_write(ctx->db_w, NULL, NULL,
+	         "UPDATE rooms SET mike=? WHERE id=?",
+	         "il", !!on, rid);
 }
 
 /**
@@ -652,19 +929,12 @@ void new_user_mic(struct pt_context *ctx, unsigned long rid, int on)
  */
 void reddot_text(struct pt_context *ctx, unsigned long rid, int on)
 {
-	if (!do_text) {
-		do_text = db_prepare(
-			ctx->db_w,
-			"UPDATE rooms SET text=? WHERE id=?"
-		);
-	}
-
-	if (!do_text || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
-	db_reset_prepared(do_text);
-	db_bind(do_text, "ii", !!on, rid);
-	db_do_prepared(do_text);
+	db_write(ctx->db_w, NULL, NULL,
+	         "UPDATE rooms SET text=? WHERE id=?",
+	         "il", !!on, rid);
 }
 
 /**
@@ -672,19 +942,12 @@ void reddot_text(struct pt_context *ctx, unsigned long rid, int on)
  */
 void reddot_video(struct pt_context *ctx, unsigned long rid, int on)
 {
-	if (!do_video) {
-		do_video = db_prepare(
-			ctx->db_w,
-			"UPDATE rooms SET video=? WHERE id=?"
-		);
-	}
-
-	if (!do_video || !user_is_room_admin(ctx->db_w, rid, ctx->uid))
+	if (!user_is_room_admin(ctx, rid))
 		return;
 
-	db_reset_prepared(do_video);
-	db_bind(do_video, "ii", !!on, rid);
-	db_do_prepared(do_video);
+	db_write(ctx->db_w, NULL, NULL,
+	         "UPDATE rooms SET video=? WHERE id=?",
+	         "il", !!on, rid);
 }
 
 /**
@@ -700,24 +963,18 @@ void whisper(struct pt_context *ctx, unsigned long rid, const char *target, cons
 		return;
 
 	target_uid = lookup_uid(ctx->db_r, target);
-	if (UID_IS_ERROR(target_uid) || !user_in_room(ctx->db_w, rid, target_uid))
+	if (UID_IS_ERROR(target_uid))
 		return;
 
-	/* TODO: Check for anonymous room and bail */
-	if (user_is_invisible(ctx->db_w, rid, target_uid) ||
-	    user_is_invisible(ctx->db_w, rid, ctx->uid))
+	if (!(tctx = uidmap_get(uid_to_context, target_uid)) || tctx == ctx ||
+	    !user_in_room(tctx, rid))
 		return;
 
-	if (!(buf = malloc(32)))
-		abort();
-
-	sprintf(buf, "%ld", target_uid);
-	if (!(tctx = ht_get_ptr_nc(uid_to_context, buf)) || tctx == ctx) {
-		free(buf);
+	/* TODO: Check for anonymous room and bail */
+	if (user_is_invisible(tctx, rid) || user_is_invisible(ctx, rid))
 		return;
-	}
 
-	if (!(buf = realloc(buf, 128 + strlen(msg))))
+	if (!(buf = malloc(128 + strlen(msg))))
 		abort();
 
 	buf[0] = (rid >> 24) & 0xff;
@@ -757,7 +1014,7 @@ static const char *skip_phtml(const char *buf)
 	while (*buf && *buf == '<') {
 		while (*buf && *buf != '>')
 			++buf;
-		++buf;
+		if (*buf) ++buf;
 	}
 
 	return buf;
@@ -771,7 +1028,8 @@ static const char *skip_phtml(const char *buf)
 int room_command(struct pt_context *ctx, unsigned long rid, const char *buf)
 {
 	int ret = 0;
-	char *s = NULL, *cmd, *args;
+	char *s = NULL, *t, *m;
+	struct span in, cmd, args;
 
 	if (!ctx || !rid || !buf)
 		goto ret;
@@ -781,21 +1039,25 @@ int room_command(struct pt_context *ctx, unsigned long rid, const char *buf)
 		goto ret;
 
 	/* We should have one command, and one argument string */
-	if (!(s = strdup(buf + 1)))
-		abort();
-	cmd  = strtok(s, " ");
-	args = strtok(NULL, "<");
-	if (!cmd || !args)
+	in.p   = buf + 1 + strspn(buf + 1, " ");
+	in.len = strlen(in.p);
+	span_next(&in, ' ', &cmd);
+	span_next(&in, '<', &args);
+	if (!cmd.len || !args.len)
 		goto ret;
 
-	switch (*cmd) {
+	/* The arguments end up in C strings anyway */
+	s = span_dup(&args);
+	switch (*cmd.p) {
 	case 't': /* [t]opic str */
-		room_topic(ctx, rid, args);
+		room_topic(ctx, rid, s);
 		++ret;
 		break;
 	case 'w': /* [w]hisper target: msg */
-		cmd = strtok(args, ": ");
-		whisper(ctx, rid, cmd, strtok(NULL, "<"));
+		t = s + strspn(s, ": ");
+		m = t + strcspn(t, ": ");
+		if (*m) *m++ = '\0';
+		whisper(ctx, rid, t, *m ? m : NULL);
 		++ret;
 		break;
 	}
@@ -10,35 +10,163 @@
 
 #include "packet.h"
 
+/**
+ * Room member flags
+ */
+#define ROOM_F_MIC    0x01 /**< Has mic privileges     */
+#define ROOM_F_HAND   0x02 /**< Has their hand raised  */
+#define ROOM_F_INVIS  0x04 /**< Joined invisibly       */
+#define ROOM_F_ADMIN  0x08 /**< Joined as a room admin */
+#define ROOM_F_REDDOT 0x10 /**< Reddotted by an admin  */
+
+/**
+ * A member of a room
+ */
+struct room_member {
+	struct pt_context *ctx;
+	unsigned flags;
+};
+
+/**
+ * A room with at least one user in it
+ *
+ * Rooms only exist in memory while they're occupied, and are owned by
+ * the event loop. \a members is unordered, and may be reallocated
+ * whenever a user joins, so don't hold onto a member across a join.
+ */
+struct room {
+	unsigned long id;
+	struct room_member *members;
+	unsigned nmembers;
+	unsigned size;
+};
+
+/**
+ * A room the user is in, and their index in its member array
+ */
+struct room_ref {
+	struct room *room;
+	unsigned idx;
+};
+
+/**
+ * Get the room with the given id, if anyone is in it
+ */
+struct room *room_get(unsigned long rid);
+
+/**
+ * Get the user's membership in the given room
+ *
+ * \return the member, or NULL if the user isn't in the room
+ */
+struct room_member *room_member(struct pt_context *ctx, unsigned long rid);
+
+/**
+ * Add the user to a room, creating it if it's empty
+ *
+ * \return the new (or existing) member, or NULL if \a rid isn't a
+ *         valid room id.
+ */
+struct room_member *room_add_member(struct pt_context *ctx, unsigned long rid, unsigned flags);
+
+/**
+ * Remove the user from a room, freeing it once it's empty
+ */
+void room_remove_member(struct pt_context *ctx, unsigned long rid);
+
+/**
+ * Join a room
+ *
+ * Sends the room details, user list and topic to the user, and lets
+ * everyone else in the room know they've joined (unless they're
+ * invisible.)
+ *
+ * \param as_admin  Non-zero to join as a room admin, using \a code
+ * \param code      The room's admin code
+ * \param invisible Non-zero to join invisibly (staff only)
+ * \param password  The password, if the room is private (may be NULL)
+ * \return 0 on success, or one of the ROOM_ERR_* constants
+ */
+int join_room(struct pt_context *ctx, unsigned long rid, int as_admin,
+              unsigned long code, int invisible, const char *password);
+
+/**
+ * Remove the user from a room, and let everyone else in it know
+ */
+void leave_room(struct pt_context *ctx, unsigned long rid);
+
+/**
+ * Remove the user from all of the rooms they're in (i.e. on disconnect)
+ */
+void leave_all_rooms(struct pt_context *ctx);
+
+/**
+ * Number of users in the given room
+ */
+unsigned long room_population(unsigned long rid);
+
+/**
+ * Number of users in rooms, and the number of occupied rooms
+ */
+void room_totals(unsigned long *users, unsigned long *rooms);
+
+/**
+ * Log the room index's statistics
+ */
+void rooms_print_stats(void);
+
+/**
+ * Free all rooms (on shutdown)
+ */
+void rooms_free(void);
+
+/**
+ * Errors returned by join_room()
+ */
+#define ROOM_ERR_NXROOM   1 /**< No such room          */
+#define ROOM_ERR_BANNED   2 /**< Banned from the room  */
+#define ROOM_ERR_BOUNCED  3 /**< Bounced from the room */
+#define ROOM_ERR_CODE     4 /**< Bad admin code        */
+#define ROOM_ERR_PASSWORD 5 /**< Bad room password     */
+
+/**
+ * Columns of a (pre-8.2) room list
+ */
+#define ROOMS_SELECT "SELECT id,r,p,v,l,c,nm,room_population(id) AS '#' "
+
 /**
  * Get the room counts by category
  */
 char *room_counts_by_category(void *db_r);
 
 /**
- * Get the list of rooms for the given category
+ * Append the list of rooms for the given category to \a sb
+ *
+ * \return 0 on success, or -1 on error.
  */
-char *rooms_for_category(void *db_r, unsigned long protocol_version, unsigned long catid);
+int rooms_for_category(void *db_r, struct strbuf *sb, const struct pt_proto_ops *ops, unsigned long catid);
 
 /**
- * Get the list of rooms for the given category + subcategory
+ * Append the list of rooms for the given category + subcategory to \a sb
+ *
+ * \return 0 on success, or -1 on error.
  */
-char *rooms_for_subcategory(void *db_r, unsigned long catid, unsigned long scid);
+int rooms_for_subcategory(void *db_r, struct strbuf *sb, unsigned long catid, unsigned long scid);
 
 /**
  * Non-zero if the given user is in the given room
  */
-int user_in_room(void *db_w, unsigned long rid, unsigned long uid);
+int user_in_room(struct pt_context *ctx, unsigned long rid);
 
 /**
  * Non-zero if the given user is invisble in the given room
  */
-int user_is_invisible(void *db_w, unsigned long rid, unsigned long uid);
+int user_is_invisible(struct pt_context *ctx, unsigned long rid);
 
 /**
  * Non-zero if the given user is a room admin and present in the room
  */
-int user_is_room_admin(void *db_w, unsigned long rid, unsigned long uid);
+int user_is_room_admin(struct pt_context *ctx, unsigned long rid);
 
 /**
  * Broadcast a packet (i.e. PACKET_ROOM_MESSAGE_IN) to an entire room
@@ -53,7 +181,7 @@ void broadcast_to_non_admins(struct pt_context *ctx, unsigned long rid, struct p
 /**
  * Search for a room by partial match on the room name
  */
-char *search_rooms(void *db_w, unsigned protocol_version, const char *partial);
+char *search_rooms(void *db_r, const struct pt_proto_ops *ops, const char *partial);
 
 /**
  * Reddot/Unreddot a user in a room
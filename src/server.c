@@ -1,36 +1,185 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4() */
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
 #include <time.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "logging.h"
 #include "database.h"
 #include "packet.h"
 #include "hash.h"
+#include "pool.h"
+#include "room.h"
+#include "uidmap.h"
+#include "timer.h"
 #include "server_handler.h"
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #define POLL_ERRS (POLLIN | POLLHUP | POLLERR | POLLNVAL)
 
-static nfds_t nfds;
-static struct pt_context *ctx[MAX_CONNECTIONS + 1];
-static struct pollfd fds[MAX_CONNECTIONS + 1];
+/**
+ * Maximum number of events to take from epoll_wait() at once
+ */
+#define EPOLL_EVENTS 256
+
+/**
+ * Connection slot. Slot 0 is the listener.
+ */
+struct slot {
+	struct pt_context *ctx;
+	unsigned gen;      /**< Bumped each time the slot is freed */
+	unsigned next;     /**< Next free slot, or 0               */
+};
+
+static nfds_t nfds;           /**< One past the highest used slot */
+static unsigned free_slots;   /**< Head of the free list, or 0    */
+static struct slot slots[MAX_CONNECTIONS + 1];
+static struct pollfd fds[MAX_CONNECTIONS + 2]; /* + the writer's fd */
 static unsigned max_conn = MAX_CONNECTIONS;
 static volatile int force_exit;
+static volatile int dump_stats;
 static void *db_w;
-static void *rm_room_user;
-struct ht *uid_to_context; /**< uid -> context for logged in users */
+struct uidmap *uid_to_context; /**< uid -> context for logged in users */
+
+#ifdef USE_EPOLL
+static int epfd = -1;
+static struct pt_context *close_list;
+static struct pt_context *ready_head, *ready_tail;
+static void check_disconnect(struct pt_context *c);
+static void unready(struct pt_context *c);
+#else
+static int more_input; /**< Some connection has input left over */
+#endif
 
 static void sighandler(int sig)
 {
-	(void)sig;
-	force_exit = 1;
+	if (sig == SIGUSR1)
+		dump_stats = 1;
+	else force_exit = 1;
+}
+
+/**
+ * Log our allocation and hash table statistics (on SIGUSR1)
+ */
+static void print_stats(void)
+{
+	struct ht_stats st;
+
+	dump_stats = 0;
+	pool_print_stats();
+	packet_print_stats();
+	db_writer_print_stats(db_w);
+	db_pool_print_stats();
+
+	uidmap_stats(uid_to_context, &st);
+	ht_log_stats("uid_to_context", &st);
+	rooms_print_stats();
+	general_print_stats();
+}
+
+/**
+ * Link all client slots into the free list, lowest first, so that
+ * poll(2) only has to look at as many slots as are in use.
+ */
+static void init_slots(void)
+{
+	unsigned i;
+
+	for (i = max_conn; i > 0; i--) {
+		fds[i].fd     = -1;
+		slots[i].gen  = 1;
+		slots[i].next = free_slots;
+		free_slots    = i;
+	}
+}
+
+/**
+ * Take a slot from the free list for a new connection
+ *
+ * \return the slot index, or 0 if there are none left.
+ */
+static unsigned alloc_slot(struct pt_context *c, int fd)
+{
+	unsigned i;
+
+	if (!(i = free_slots))
+		return 0;
+
+	free_slots     = slots[i].next;
+	slots[i].next  = 0;
+	slots[i].ctx   = c;
+	fds[i].fd      = fd;
+	fds[i].events  = POLLIN | POLLOUT;
+	fds[i].revents = 0;
+	c->handle      = (slots[i].gen << CONN_SLOT_BITS) | i;
+	if (i >= nfds) nfds = i + 1;
+	return i;
+}
+
+/**
+ * Return a connection's slot to the free list, invalidating its handle
+ */
+static void free_slot(struct pt_context *c)
+{
+	unsigned i = c->handle & CONN_SLOT_MASK;
+
+	fds[i].fd      = -1;
+	fds[i].events  = 0;
+	fds[i].revents = 0;
+	slots[i].ctx   = NULL;
+	slots[i].next  = free_slots;
+	free_slots     = i;
+
+	/* Generation 0 is never used, so that no valid handle is 0 */
+	if (!(++slots[i].gen & (CONN_GEN_MASK >> CONN_SLOT_BITS)))
+		slots[i].gen = 1;
+
+	/* Trim any unused slots from the end of the poll set */
+	while (nfds > 1 && !slots[nfds - 1].ctx)
+		nfds--;
+}
+
+/**
+ * Look up a connection by its handle
+ */
+struct pt_context *conn_get(unsigned handle)
+{
+	unsigned i = handle & CONN_SLOT_MASK;
+
+	if (!i || i > max_conn || !slots[i].ctx ||
+	    slots[i].ctx->handle != handle)
+		return NULL;
+	return slots[i].ctx;
+}
+
+#ifdef USE_EPOLL
+/**
+ * Register a socket with epoll
+ */
+static int epoll_add(int fd, unsigned events, void *ptr)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events   = events;
+	ev.data.ptr = ptr;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
+#endif
 
 /**
  * Create a listening IPv4 socket
@@ -66,6 +215,15 @@ static int listen_v4(unsigned short port)
 		goto err;
 	}
 
+#ifdef USE_EPOLL
+	/* The listener is level-triggered, and has no context */
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+	    epoll_add(fd, EPOLLIN, NULL)) {
+		ERROR(("failed to set up epoll"));
+		goto err;
+	}
+#endif
+
 	INFO(("Listening on %s port %d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port)));
 	fds[0].fd     = fd;
 	fds[0].events = POLLIN;
@@ -76,117 +234,404 @@ err:
 	return -1;
 }
 
+/**
+ * Disconnect a client whose time is up
+ */
+static void expire(struct pt_context *c, const char *why)
+{
+	INFO(("Client %s:%u timed out (%s)",
+	     inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), why));
+
+	c->disconnect++;
+#ifdef USE_EPOLL
+	check_disconnect(c);
+#endif
+}
+
+static void deadline_timeout(void *arg)
+{
+	struct pt_context *c = arg;
+
+	if (!c->on_packet)                  expire(c, "kicked");
+	else if (c->on_packet == general_flow) expire(c, "no ping");
+	else                                expire(c, "login");
+}
+
+/**
+ * Enable TCP keepalive on a client socket (see server.h)
+ */
+static int set_keepalive(int fd)
+{
+	int v = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &v, sizeof(v)))
+		return -1;
+
+#ifdef TCP_KEEPIDLE
+	v = CONN_KEEPALIVE_IDLE;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &v, sizeof(v)))
+		return -1;
+
+	v = CONN_KEEPALIVE_INTVL;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &v, sizeof(v)))
+		return -1;
+
+	v = CONN_KEEPALIVE_CNT;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &v, sizeof(v)))
+		return -1;
+#endif
+
+	return 0;
+}
+
 /**
  * Accept new connections
  */
 static void do_accept(void)
 {
-	int fd;
-	void *p;
+	int fd, n;
+	struct pt_context *c;
 	struct linger l;
 	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof addr;
+	socklen_t addrlen;
+
+	for (n = 0; n < ACCEPT_BATCH; n++) {
+		addrlen = sizeof addr;
+#ifdef __linux__
+		if ((fd = accept4(fds[0].fd, (struct sockaddr *)&addr, &addrlen,
+		                  SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+			goto ret;
+#else
+		if ((fd = accept(fds[0].fd, (struct sockaddr *)&addr, &addrlen)) < 0)
+			goto ret;
+
+		/* Set the socket to non-blocking mode */
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK))
+			goto err;
+#endif
+
+		if (!free_slots) {
+			ERROR(("Refusing connection, max was reached"));
+			goto err;
+		}
 
-	if ((fd = accept(fds[0].fd, (struct sockaddr *)&addr, &addrlen)) < 0)
-		goto ret;
+		/* Shorten the time spent lingering for FIN to 2 seconds */
+		l.l_onoff = 1;
+		l.l_linger = 2;
+		if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l)))
+			goto err;
+
+		/* Find half-open connections from clients that don't ping */
+		if (set_keepalive(fd))
+			goto err;
+
+		INFO(("Connection received from %s:%u", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port)));
+		if (!(c = malloc(sizeof *c)))
+			abort();
+
+#ifdef USE_EPOLL
+		/**
+		 * Edge-triggered, so we only ever need to register once. Input
+		 * is drained until EAGAIN, and output is written as soon as it's
+		 * queued; EPOLLOUT only matters once the socket buffer fills up.
+		 */
+		if (epoll_add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, c)) {
+			ERROR(("Failed to add client socket to epoll"));
+			free(c);
+			goto err;
+		}
+#endif
+
+		/**
+		 * The read buffer and database connection are left until the
+		 * client sends something, so all this costs is the context,
+		 * and queueing the HELLO.
+		 */
+		pt_context_init(c, fd);
+		alloc_slot(c, fd);
+		c->db_w = db_w;
+		c->fd   = fd;
+		memcpy(&c->addr, &addr, addrlen);
+
+		/* The deadline runs until the client reaches general_flow */
+		timer_init(&c->deadline, deadline_timeout, c);
+		timer_add(&c->deadline, CONN_LOGIN_TIMEOUT);
+
+		/* Start in the login flow */
+		transition_to(c, login_flow);
+		continue;
 
-	if (nfds + 1 >= max_conn) {
-		ERROR(("Refusing connection, max was reached"));
-		goto err;
+err:
+		close(fd);
 	}
 
-	/* Set the socket to non-blocking mode */
-	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK))
-		goto err;
+ret:
+	return;
+}
 
-	/* Shorten the time spent lingering for FIN to 2 seconds */
-	l.l_onoff = 1;
-	l.l_linger = 2;
-	if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l)))
-		goto err;
+/**
+ * Give a client a read connection from the pool, once it has sent us
+ * something to handle.
+ */
+static void attach_db(struct pt_context *c)
+{
+	if (!c->db_r)
+		c->db_r = db_pool_get();
+}
+
+/**
+ * Tear down a client connection
+ */
+static void close_context(struct pt_context *c)
+{
+	INFO(("Client %s:%u %s",
+	     inet_ntoa(c->addr.sin_addr),
+	     ntohs(c->addr.sin_port),
+	     c->on_packet ? "disconnected" : "kicked"));
+
+	if (*c->uid_str)
+		uidmap_rm(uid_to_context, c->uid, c);
+	leave_all_rooms(c);
+	shutdown(c->fd, SHUT_RDWR);
+	close(c->fd);
+
+	timer_del(&c->deadline);
+#ifdef USE_EPOLL
+	if (c->in_ready)
+		unready(c);
+#endif
+	free_slot(c);
+	pt_context_destroy(c);
+	free(c);
+}
+
+#ifdef USE_EPOLL
+/**
+ * Queue a context to have its input serviced on this pass (or the next
+ * one, if this pass's input has already been serviced.) Contexts are
+ * serviced in the order they became ready, once per pass.
+ */
+static void mark_ready(struct pt_context *c)
+{
+	if (c->in_ready)
+		return;
+
+	c->in_ready   = 1;
+	c->next_ready = NULL;
+	if (ready_tail)
+		ready_tail->next_ready = c;
+	else ready_head = c;
+	ready_tail = c;
+}
 
-	INFO(("Connection received from %s:%u", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port)));
-	if (!(p = malloc(sizeof **ctx)))
-		abort();
-	ctx[nfds] = p;
+/**
+ * Take a context that's being closed off the ready queue
+ */
+static void unready(struct pt_context *c)
+{
+	struct pt_context **p, *prev = NULL;
 
-	pt_context_init(ctx[nfds], fd);
-	ctx[nfds]->db_r     = db_open("ptserver.db", 'r');
-	ctx[nfds]->db_w     = db_w;
-	ctx[nfds]->fd       = fd;
-	fds[nfds].fd        = fd;
-	fds[nfds++].events  = POLLIN | POLLOUT;
-	memcpy(&ctx[nfds - 1]->addr, &addr, addrlen);
+	for (p = &ready_head; *p && *p != c; p = &(*p)->next_ready)
+		prev = *p;
 
-	/* Start in the login flow */
-	transition_to(ctx[nfds - 1], login_flow);
+	if (!*p)
+		return;
 
-ret:
-	return;
+	*p = c->next_ready;
+	if (ready_tail == c)
+		ready_tail = prev;
+	c->in_ready = 0;
+}
 
-err:
-	if (fd > 0) close(fd);
+/**
+ * Queue a context to be closed at the end of this iteration, if it's
+ * due to be disconnected.
+ */
+static void check_disconnect(struct pt_context *c)
+{
+	if (c->close_pending)
+		return;
+
+	if (c->disconnect || (!c->on_packet && !c->nsegs_out)) {
+		c->close_pending = 1;
+		c->next_close    = close_list;
+		close_list       = c;
+	}
 }
 
+/**
+ * Wait for events, and service only the connections that are ready
+ */
+static int poll_sockets(void)
+{
+	int i, active;
+	struct pt_context *c, *next;
+	static struct epoll_event ev[EPOLL_EVENTS];
+
+	/* Don't wait if there's input left over from the last pass */
+	active = epoll_wait(epfd, ev, EPOLL_EVENTS, ready_head ? 0 : timers_next());
+	if (active < 0)
+		return -(errno != EINTR);
+
+	timers_run();
+
+	for (i = 0; i < active; i++) {
+		/* Writes have been committed */
+		if (ev[i].data.ptr == &db_w) {
+			db_writer_complete(db_w);
+			continue;
+		}
+
+		/* Accept new connections */
+		if (!(c = ev[i].data.ptr)) {
+			do_accept();
+			continue;
+		}
+
+		if (ev[i].events & (EPOLLERR | EPOLLHUP)) {
+			c->disconnect++;
+			check_disconnect(c);
+			continue;
+		}
+
+		/* Anything newly queued is written out below */
+		if (ev[i].events & EPOLLOUT && c->nsegs_out && !c->out_pending)
+			packet_out(c);
+
+		if (ev[i].events & (EPOLLIN | EPOLLRDHUP) && c->on_packet)
+			mark_ready(c);
+
+		check_disconnect(c);
+	}
+
+	/**
+	 * Give each connection with input one budget's worth of it. Those
+	 * with more left go to the back of the queue for the next pass,
+	 * since we won't get another edge for data that's already there.
+	 */
+	c = ready_head;
+	ready_head = ready_tail = NULL;
+	for (; c; c = next) {
+		next          = c->next_ready;
+		c->next_ready = NULL;
+		c->in_ready   = 0;
+
+		if (!c->disconnect && c->on_packet) {
+			attach_db(c);
+			if (packet_in(c))
+				mark_ready(c);
+		}
+
+		check_disconnect(c);
+	}
+
+	for (;;) {
+		/* Write out anything queued while servicing the above */
+		for (c = packet_take_pending(); c; c = next) {
+			next = c->next_out;
+			c->out_pending = 0;
+			c->next_out    = NULL;
+			packet_out(c);
+			check_disconnect(c);
+		}
+
+		if (!close_list)
+			break;
+
+		/**
+		 * Close the connections we're done with. This may queue more
+		 * output for others (i.e. ROOM_USER_LEFT), so go around again.
+		 */
+		c = close_list;
+		close_list = NULL;
+		for (; c; c = next) {
+			next = c->next_close;
+			close_context(c);
+		}
+	}
+
+	return 0;
+}
+#else
 /**
  * Poll and service our sockets
  */
 static int poll_sockets(void)
 {
-	nfds_t i;
-	int active;
+	nfds_t i, n = nfds;
+	int active, expired;
+	short ev;
+	struct pt_context *c, *next;
+
+	/* The writer's fd goes just past the last slot in use */
+	fds[0].events  = POLLIN;
+	fds[n].fd      = db_writer_fd(db_w);
+	fds[n].events  = POLLIN;
+	fds[n].revents = 0;
+	active = poll(fds, n + 1, more_input ? 0 : timers_next());
+	fds[n].fd      = -1;
+	fds[n].events  = 0;
+
+	if (active < 0)
+		return -(errno != EINTR);
+
+	if (fds[n].revents & POLLIN) {
+		db_writer_complete(db_w);
+		fds[n].revents = 0;
+	}
 
-	fds[0].events = POLLIN;
-	if ((active = poll(fds, nfds, -1)) < 0 ||
-	    fds[0].revents & (POLL_ERRS & ~POLLIN))
+	if (fds[0].revents & (POLL_ERRS & ~POLLIN))
 		return -1;
 
-	if (!active)
+	/* Anyone who's timed out gets closed below */
+	expired = timers_run();
+	if (!active && !expired && !more_input)
 		goto ret;
 
 	/* Accept new connections */
 	if (fds[0].revents & POLLIN)
 		do_accept();
 
-	/* Service existing connections */
+	/**
+	 * Service existing connections, in both directions. Input is
+	 * budgeted (see packet_in()), and any that's left over is picked
+	 * up on the next pass.
+	 */
+	more_input = 0;
 	for (i = 1; i < nfds; i++) {
-		if ((fds[i].revents & fds[i].events) & POLLOUT && ctx[i]->npkts_out)
-			packet_out(ctx[i]);
-		else if (!ctx[i]->disconnect && (fds[i].revents & fds[i].events) & POLLIN) {
-			db_begin(db_w);
-			packet_in(ctx[i]);
-			db_end(db_w);
-		} else if (ctx[i]->disconnect || !fds[i].events || fds[i].revents & POLL_ERRS) {
-			INFO(("Client %s:%u %s",
-			     inet_ntoa(ctx[i]->addr.sin_addr),
-			     ntohs(ctx[i]->addr.sin_port),
-			     ctx[i]->on_packet ? "disconnected" : "kicked"));
-
-			if (*ctx[i]->uid_str)
-				ht_rm(uid_to_context, ctx[i]->uid_str);
-			shutdown(fds[i].fd, SHUT_RDWR);
-			close(fds[i].fd);
-
-			db_close(ctx[i]->db_r);
-			pt_context_destroy(ctx[i]);
-			free(ctx[i]);
-			ctx[i] = NULL;
-
-			if (i < nfds - 1) {
-				memmove(fds + i, fds + i + 1, (nfds - i) * sizeof *fds);
-				memmove(ctx + i, ctx + i + 1, (nfds - i) * sizeof *ctx);
-			}
-
-			nfds--;
-			i--;
+		if (!(c = slots[i].ctx))
+			continue;
+
+		ev = fds[i].revents & fds[i].events;
+		if (ev & POLLOUT && c->nsegs_out)
+			packet_out(c);
+
+		if (!c->disconnect && c->on_packet && (ev & POLLIN || c->in_ready)) {
+			attach_db(c);
+			more_input |= (c->in_ready = packet_in(c));
 		}
 
-		fds[i].events = ctx[i] ? (ctx[i]->on_packet ? POLLIN : 0) | (ctx[i]->npkts_out ? POLLOUT : 0) : POLLIN;
+		if (c->disconnect || !fds[i].events ||
+		    (fds[i].revents & (POLL_ERRS & ~POLLIN) && !(ev & POLLIN)))
+			close_context(c);
+	}
+
+	/* We only need the pending list with epoll */
+	for (c = packet_take_pending(); c; c = next) {
+		next = c->next_out;
+		c->out_pending = 0;
+		c->next_out    = NULL;
+	}
+
+	for (i = 1; i < nfds; i++) {
+		if ((c = slots[i].ctx))
+			fds[i].events = (c->on_packet ? POLLIN : 0) | (c->nsegs_out ? POLLOUT : 0);
 	}
 
 ret:
 	return 0;
 }
+#endif
 
 /**
  * Broadcast a packet to all connected users
@@ -195,10 +640,12 @@ void broadcast(struct pt_packet *pkt)
 {
 	nfds_t i;
 
+	packet_ref(pkt);
 	for (i = 1; i < nfds; i++) {
-		if (ctx[i]->on_packet)
-			send_packet(ctx[i], pkt);
+		if (slots[i].ctx && slots[i].ctx->on_packet)
+			send_packet(slots[i].ctx, pkt);
 	}
+	packet_unref(pkt);
 }
 
 int main(int argc, char *argv[])
@@ -212,41 +659,58 @@ int main(int argc, char *argv[])
 	nfds = 1;
 	force_exit = 0;
 	memset(fds, 0, sizeof fds);
-	memset(ctx, 0, sizeof ctx);
+	memset(slots, 0, sizeof slots);
+	init_slots();
 
 	/* TODO: popt (port, max_conn, db_path) */
 
 	signal(SIGINT, sighandler);
+	signal(SIGUSR1, sighandler);
 	signal(SIGPIPE, SIG_IGN);
 	srand(time(NULL));
 	listen_v4(port);
 
-	db_w = db_open("ptserver.db", 'w');
-	uid_to_context = ht_alloc(HT_VALUE_DEFAULT, HT_STATIC_KEYS);
+	if (!(db_w = db_writer_open("ptserver.db")))
+		return 1;
+
+#ifdef USE_EPOLL
+	if (epoll_add(db_writer_fd(db_w), EPOLLIN, &db_w)) {
+		ERROR(("failed to add the writer to epoll"));
+		return 1;
+	}
+#endif
+
+	db_pool_init("ptserver.db");
+	uid_to_context = uidmap_alloc();
+	timers_init();
 
 	while (!force_exit) {
 		if (poll_sockets())
 			force_exit++;
+		if (dump_stats)
+			print_stats();
 	}
 
 	for (i = 0; i < nfds; i++) {
+		if (fds[i].fd < 0)
+			continue;
+
 		shutdown(fds[i].fd, SHUT_RDWR);
 		close(fds[i].fd);
-		if (ctx[i]) {
-			db_close(ctx[i]->db_r);
-
-			if (!rm_room_user)
-				rm_room_user = db_prepare(db_w, "DELETE FROM room_users WHERE uid=?");
-			db_reset_prepared(rm_room_user);
-			db_bind(rm_room_user, "i", ctx[i]->uid);
-			db_do_prepared(rm_room_user);
-			pt_context_destroy(ctx[i]);
+		if (slots[i].ctx) {
+			leave_all_rooms(slots[i].ctx);
+			pt_context_destroy(slots[i].ctx);
 		}
 	}
 
-	db_free_prepared(rm_room_user);
-	db_close(db_w);
-	ht_free(uid_to_context);
+	rooms_free();
+	db_pool_close();
+	db_writer_close(db_w);
+	uidmap_free(uid_to_context);
+#ifdef USE_EPOLL
+	close(epfd);
+#endif
+	pool_destroy();
 	return !force_exit;
 }
 
@@ -15,6 +15,68 @@
  */
 #define MAX_CONNECTIONS 10240
 
+/**
+ * Connection timeouts (in milliseconds)
+ *
+ * CONN_LOGIN_TIMEOUT - The client hasn't logged in this long after
+ *                      connecting, including any time spent registering
+ *                      or resetting a password
+ * CONN_PING_TIMEOUT  - A client that pings (PT 9.1 pings every 5 seconds)
+ *                      hasn't done so for this long
+ * CONN_KICK_LINGER   - A kicked client's output still hasn't drained
+ *                      after this long
+ */
+#define CONN_LOGIN_TIMEOUT 60000
+#define CONN_PING_TIMEOUT  60000
+#define CONN_KICK_LINGER   5000
+
+/**
+ * TCP keepalive settings (in seconds), for logged in clients that don't
+ * ping. These may legitimately send nothing for hours, so rather than
+ * an idle timeout, the kernel probes the connection after it's been
+ * quiet for CONN_KEEPALIVE_IDLE, and drops it if CONN_KEEPALIVE_CNT
+ * probes CONN_KEEPALIVE_INTVL apart go unanswered.
+ */
+#define CONN_KEEPALIVE_IDLE  600
+#define CONN_KEEPALIVE_INTVL 60
+#define CONN_KEEPALIVE_CNT   5
+
+/**
+ * Maximum number of connections to accept per pass of the event loop.
+ * The listener is level-triggered, so anything left in the backlog is
+ * picked up on the next pass, after the existing connections have
+ * been serviced.
+ */
+#define ACCEPT_BATCH 64
+
+/**
+ * Use epoll(7) for the event loop on Linux, unless told otherwise
+ * (i.e. make CFLAGS=-DUSE_POLL) in which case we fall back to poll(2).
+ */
+#if defined(__linux__) && !defined(USE_POLL)
+#define USE_EPOLL
+#endif
+
+/**
+ * Connection handles are a slot index in the low bits, tagged with a
+ * generation in the high bits, so that a handle to a closed connection
+ * won't resolve to whichever connection reuses its slot.
+ */
+#define CONN_SLOT_BITS 16
+#define CONN_SLOT_MASK ((1U << CONN_SLOT_BITS) - 1)
+#define CONN_GEN_MASK  (~CONN_SLOT_MASK)
+
+#if MAX_CONNECTIONS > CONN_SLOT_MASK
+#error "MAX_CONNECTIONS is too large for CONN_SLOT_BITS"
+#endif
+
+/**
+ * Look up a connection by its handle
+ *
+ * \return the context, or NULL if the connection has since been closed.
+ */
+struct pt_context *conn_get(unsigned handle);
+
 /**
  * Send a packet to all connected users
  */
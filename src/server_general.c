@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "macros.h"
@@ -8,16 +9,15 @@
 #include "hash.h"
 #include "packet.h"
 #include "protocol.h"
+#include "proto_ops.h"
 #include "database.h"
 #include "room.h"
 #include "buddylist.h"
 #include "server_handler.h"
+#include "uidmap.h"
 
 /* from server.c */
-extern struct ht *uid_to_context;
-
-/* Prepared queries on db_w */
-static void *offline_msg;
+extern struct uidmap *uid_to_context;
 
 #define SUCCESS_LEN            7
 #define NXUSER_LEN            12
@@ -26,6 +26,17 @@ static const char * const success           = "Success";
 static const char * const nxuser            = "No such user";
 static const char * const cant_block_admins = "You can't block staff or administrators";
 
+#define NXROOM_LEN   12
+#define BANNED_LEN   36
+#define BOUNCED_LEN  37
+#define BAD_CODE_LEN 26
+#define BAD_PW_LEN   24
+static const char * const nxroom   = "No such room";
+static const char * const banned   = "You have been banned from this room.";
+static const char * const bounced  = "You have been bounced from this room.";
+static const char * const bad_code = "Incorrect room admin code.";
+static const char * const bad_pw   = "Incorrect room password.";
+
 /**
  * Non-zero if the given user exists, and isn't blocking us, or blocked by us
  */
@@ -41,27 +52,32 @@ static int can_send_to_user(struct pt_context *ctx, unsigned long uid)
 
 static void store_offline_message(struct pt_context *ctx, unsigned long uid, const char *msg)
 {
-	if (!offline_msg) {
-		offline_msg = db_prepare(
-			ctx->db_w,
-			"INSERT INTO offline_messages(from_uid, to_uid, "
-			"tstamp, msg) VALUES(?, ?, datetime('now','subsec'), "
-			"?) ON CONFLICT DO NOTHING"
-		);
+	db_write(ctx->db_w, NULL, NULL,
+	         "INSERT INTO offline_messages(from_uid, to_uid, "
+	         "tstamp, msg) VALUES(?, ?, datetime('now','subsec'), "
+	         "?) ON CONFLICT DO NOTHING",
+	         "llt", ctx->uid, uid, msg);
+}
 
-		if (!offline_msg) {
-			ERROR(("store_offline_message: Failed to prepare query"));
-			return;
-		}
-	}
+/**
+ * Send the buddy list once a change to it has been committed
+ */
+static void buddy_list_committed(void *userdata, int ok, long long rowid)
+{
+	struct pt_context *ctx;
+	(void)ok;
+	(void)rowid;
 
-	db_reset_prepared(offline_msg);
-	db_bind(offline_msg, "iit", ctx->uid, uid, msg);
-	db_do_prepared(offline_msg);
+	if ((ctx = conn_get((unsigned)(uintptr_t)userdata)))
+		send_buddy_list(ctx, 0);
 }
 
 /**
- * Send offline messages to the connected user
+ * Send offline messages to the connected user, and delete them.
+ *
+ * Each message is deleted by its key, rather than all of the user's
+ * messages at once, as a message stored after we looked may not have
+ * been committed yet.
  */
 static int relay_offline_message(void *userdata, int cols, char *val[], char *col[])
 {
@@ -74,15 +90,19 @@ static int relay_offline_message(void *userdata, int cols, char *val[], char *co
 	if (!userdata || cols != 3 || !val[0] || !val[1] || !val[2])
 		return 0;
 
+	from_uid = atol(val[0]);
+	db_write(ctx->db_w, NULL, NULL,
+	         "DELETE FROM offline_messages WHERE from_uid=? AND to_uid=? AND tstamp=?",
+	         "llt", from_uid, ctx->uid, val[1]);
+
 	/* If we've blocked them, ignore offline messages */
-	if (i_blocked_user(ctx, atol(val[0])))
+	if (i_blocked_user(ctx, from_uid))
 		return 0;
 
 	slen = 14 + strlen(val[1]) + strlen(val[2]);
 	if (!(s = calloc(slen + 1, 1)))
 		return 0;
 
-	from_uid = atol(val[0]);
 	s[0] = (from_uid >> 24) & 0xff;
 	s[1] = (from_uid >> 16) & 0xff;
 	s[2] = (from_uid >> 8)  & 0xff;
@@ -95,18 +115,12 @@ static int relay_offline_message(void *userdata, int cols, char *val[], char *co
 /**
  * PT 7+: Send globals statistics about the number of users/rooms
  */
-static int send_global_numbers(void *userdata, int cols, char *val[], char *col[])
+static void send_global_numbers(struct pt_context *ctx)
 {
 	char buf[8];
-	long users = 0, rooms = 0;
-	struct pt_context *ctx = userdata;
-	(void)col;
+	unsigned long users, rooms;
 
-	if (!ctx || cols != 2)
-		return 0;
-
-	users = atol(val[0]);
-	rooms = atol(val[1]);
+	room_totals(&users, &rooms);
 	buf[0] = (users >> 24) & 0xff;
 	buf[1] = (users >> 16) & 0xff;
 	buf[2] = (users >> 8)  & 0xff;
@@ -116,7 +130,6 @@ static int send_global_numbers(void *userdata, int cols, char *val[], char *col[
 	buf[6] = (rooms >> 8)  & 0xff;
 	buf[7] = rooms & 0xff;
 	send_packet(ctx, new_packet(PACKET_GLOBAL_NUMBERS, 8, buf, PACKET_F_COPY));
-	return 0;
 }
 
 /**
@@ -124,7 +137,10 @@ static int send_global_numbers(void *userdata, int cols, char *val[], char *col[
  */
 void general_transition(struct pt_context *ctx)
 {
-	char buf[1024]/*256] */, *s, *s2;
+	char buf[1024]/*256] */, *s;
+	void *stmt;
+	struct strbuf sb;
+	struct pt_packet *pkt;
 
 	/****
 	 * Send USER_DATA
@@ -135,15 +151,17 @@ void general_transition(struct pt_context *ctx)
 	s = pt_encode(ctx, 1, buf);
 
 	/* Add ei= */
-	s2 = append_field(user_to_record(&ctx->user, ctx->pkt_in.version), "ei", s);
+	packet_sb_init(&sb);
+	user_to_record(&sb, &ctx->user, ctx->ops);
+	sb_append_field(&sb, "ei", s);
 	free(s);
 
 	/* Add smtp= */
 	/* TODO: smtp support */
 	s = pt_encode_with_challenge(ctx, 2, 0x19, "127.0.0.1:25:user:pass");
-	s2 = append_field(s2, "smtp", s);
+	sb_append_field(&sb, "smtp", s);
 	free(s);
-	send_packet(ctx, new_packet(PACKET_USER_DATA, strlen(s2), s2, 0));
+	send_packet(ctx, packet_from_sb(PACKET_USER_DATA, &sb));
 
 	/* Max out the banner refresh interval */
 	buf[0] = (char)0x7f;
@@ -156,32 +174,23 @@ void general_transition(struct pt_context *ctx)
 	/**
 	 * Category list
 	 */
-	/* 5.1 assumes these don't change once given, and needs list=2  */
-	s = NULL;
-	buf[0] = '\0';
-	strcpy(buf, "SELECT * FROM categories JOIN (SELECT 2 AS list)");
-
-	/**
-	 * We include these so that the theoretical 5.x user can view them
-	 * also.
-	 */
-	if (ctx->protocol_version >= PROTOCOL_VERSION_70) {
-		sprintf(buf + strlen(buf),
-	        " WHERE code NOT IN (%d,%d)", CATEGORY_TOP, CATEGORY_FEATURED);
-	}
-
-	if (!db_exec(ctx->db_r, &s, buf, db_row_to_record) && s)
-		send_packet(ctx, new_packet(PACKET_CATEGORY_LIST, strlen(s), s, 0));
-	else free(s);
+	packet_sb_init(&sb);
+	if ((stmt = db_cached(ctx->db_r, ctx->ops->categories_sql)) &&
+	    !db_get_records(stmt, &sb, 0) &&
+	    (pkt = packet_from_sb(PACKET_CATEGORY_LIST, &sb)))
+		send_packet(ctx, pkt);
+	else sb_free(&sb);
 
 	/**
 	 * Subcategory list
 	 */
-	if (ctx->protocol_version >= PROTOCOL_VERSION_82) {
-		strcpy(buf, "SELECT catg, subcatg, disp, name FROM subcategories "
-		            "ORDER BY name ASC");
-		if (!db_exec(ctx->db_r, &s, buf, db_row_to_record) && s)
-			send_packet(ctx, new_packet(PACKET_SUBCATEGORY_LIST, strlen(s), s, 0));
+	if (ctx->ops->subcategories_sql) {
+		packet_sb_init(&sb);
+		stmt = db_cached(ctx->db_r, ctx->ops->subcategories_sql);
+		if (stmt && !db_get_records(stmt, &sb, 0) &&
+		    (pkt = packet_from_sb(PACKET_SUBCATEGORY_LIST, &sb)))
+			send_packet(ctx, pkt);
+		else sb_free(&sb);
 	}
 
 	/**
@@ -194,672 +203,899 @@ void general_transition(struct pt_context *ctx)
 	 * Relay offline messages
 	 */
 	sprintf(buf, "SELECT from_uid, tstamp, msg FROM offline_messages WHERE to_uid=%ld", ctx->uid);
-	if (!db_exec(ctx->db_r, ctx, buf, relay_offline_message)) {
-		sprintf(buf, "DELETE FROM offline_messages WHERE to_uid=%ld", ctx->uid);
-		db_exec(ctx->db_w, NULL, buf, NULL);
-	}
+	db_exec(ctx->db_r, ctx, buf, relay_offline_message);
 }
 
-void general_flow(struct pt_context *ctx)
+/**
+ * The fields most general flow packets start with, decoded before the
+ * handler is called. Fields past the end of the payload are 0.
+ */
+struct pt_args {
+	unsigned long dw[3]; /**< Big-endian dwords at 0, 4 and 8 */
+	unsigned short w2;   /**< Big-endian word at 4 (on/off flags) */
+};
+
+static void handle_ping(struct pt_context *ctx, const struct pt_args *a)
 {
-	char buf[256], *s, *s2;
-	size_t len;
-	unsigned long uid = 0, rid;
-	struct pt_context *target;
-	struct pt_packet *pkt;
+	/**
+	 * [PT 9.1] Data contains a 32-bit timestamp [from time(NULL)]
+	 *
+	 * The client uses this to detect whether or not it can still
+	 * send on the socket. Older clients don't ping, so once one
+	 * starts, hold it to that.
+	 */
+	ctx->time = a->dw[0];
+	timer_add(&ctx->deadline, CONN_PING_TIMEOUT);
+}
+
+static void handle_get_privacy(struct pt_context *ctx, const struct pt_args *a)
+{
+	char c = *ctx->user.privacy;
+	(void)a;
+
+	send_packet(ctx, new_packet(PACKET_VERIFY_PRIVACY, 1, &c, PACKET_F_COPY));
+}
+
+static void handle_set_privacy(struct pt_context *ctx, const struct pt_args *a)
+{
+	char buf[2];
+
+	/**
+	 * Set the user's privacy setting
+	 *
+	 * 'A' - All users can contact me
+	 * 'T' - Only buddies can send me file transfers
+	 * 'P' - Only buddies can contact me
+	 */
+	buf[1] = '\0';
+	buf[0] = ctx->pkt_in.data[0];
+	if (buf[0] != 'A' && buf[0] != 'T' && buf[0] != 'P')
+		return;
+
+	free(ctx->user.privacy);
+	ctx->user.privacy = strdup(buf);
+	user_set_privacy(ctx->db_w, ctx->uid, buf[0]);
+	handle_get_privacy(ctx, a);
+}
+
+static void handle_list_category(struct pt_context *ctx, const struct pt_args *a)
+{
+	char *s;
+	unsigned long rid;
+	struct strbuf sb;
 
-	if (ctx->pkt_in.length >= 4) {
-		uid = ((ctx->pkt_in.data[0] & 0xff) << 24) |
-			  ((ctx->pkt_in.data[1] & 0xff) << 16) |
-			  ((ctx->pkt_in.data[2] & 0xff) <<  8) |
-			   (ctx->pkt_in.data[3] & 0xff);
+	/**
+	 * LIST_CATEGORY Data:
+	 *   0 - 3: PT5: 00 00 00 01, PT7: value from a stackframe or two ago.
+	 *   4 - 7: PT5: 00 00 00 00 [1 if a category id is given], PT 7/8: 00 00 00 01
+	 *   8 - 11: category id (or 00000000 / ffffffff)
+	 *
+	 * NEW_LIST_CATEGORY: PT8+: Simplification of LIST_CATEGORY
+	 *
+	 * Data:
+	 *   0 - 4: category_id (or ffffffff)
+	 */
+	rid = a->dw[ctx->pkt_in.type == PACKET_LIST_CATEGORY ? 2 : 0];
+	if (!rid || rid == ALL_CATEGORIES) {
+		if ((s = room_counts_by_category(ctx->db_r)))
+			send_packet(ctx, new_packet(PACKET_CATEGORY_COUNTS, strlen(s), s, 0));
+		return;
 	}
 
-	switch (ctx->pkt_in.type) {
-	case PACKET_PING:
-		/**
-		 * [PT 9.1] Data contains a 32-bit timestamp [from time(NULL)]
-		 *
-		 * The client uses this to detect whether or not it can still
-		 * send on the socket.
-		 */
-		ctx->time = uid;
-		break;
-	case PACKET_SET_PRIVACY:
-		/**
-		 * Set the user's privacy setting
-		 *
-		 * 'A' - All users can contact me
-		 * 'T' - Only buddies can send me file transfers
-		 * 'P' - Only buddies can contact me
-		 */
-		buf[1] = '\0';
-		buf[0] = ctx->pkt_in.data[0];
-		if (buf[0] != 'A' && buf[0] != 'T' && buf[0] != 'P')
-			break;
-		free(ctx->user.privacy);
-		ctx->user.privacy = strdup(buf);
-		user_set_privacy(ctx->db_w, ctx->uid, buf[0]);
-		/* FALLTHRU */
-	case PACKET_GET_PRIVACY:
-		buf[0] = *ctx->user.privacy;
-		send_packet(ctx, new_packet(PACKET_VERIFY_PRIVACY, 1, buf, PACKET_F_COPY));
-		break;
-	case PACKET_LIST_CATEGORY:
-		/**
-		 * Data:
-		 *   0 - 3: PT5: 00 00 00 01, PT7: value from a stackframe or two ago.
-		 *   4 - 7: PT5: 00 00 00 00 [1 if a category id is given], PT 7/8: 00 00 00 01
-		 *   8 - 11: category id (or 00000000 / ffffffff)
-		 */
-	case PACKET_NEW_LIST_CATEGORY:
-		/**
-		 * PT8+: Simplification of LIST_CATEGORY
-		 *
-		 * Data:
-		 *   0 - 4: category_id (or ffffffff)
-		 */
-		s = NULL;
-		*buf = '\0';
-		if (ctx->pkt_in.type == PACKET_LIST_CATEGORY) {
-			rid = ((ctx->pkt_in.data[8]  & 0xff) << 24) |
-			      ((ctx->pkt_in.data[9]  & 0xff) << 16) |
-			      ((ctx->pkt_in.data[10] & 0xff) <<  8) |
-			       (ctx->pkt_in.data[11] & 0xff);
-		} else rid = uid;
-
-		if (!rid || rid == ALL_CATEGORIES) {
-			if ((s = room_counts_by_category(ctx->db_r))) {
-				pkt = new_packet(PACKET_CATEGORY_COUNTS, strlen(s), s, 0);
-				send_packet(ctx, pkt);
-			}
-
-			break;
-		}
+	packet_sb_init(&sb);
+	if (rooms_for_category(ctx->db_r, &sb, ctx->ops, rid)) {
+		sb_free(&sb);
+		return;
+	}
 
-		if ((s = rooms_for_category(ctx->db_r, ctx->protocol_version, rid))) {
-			send_packet(ctx, new_packet(
-				(ctx->protocol_version >= PROTOCOL_VERSION_82 &&
-				 rid != CATEGORY_FEATURED && rid != CATEGORY_TOP) ?
-				PACKET_NEW_ROOM_LIST : PACKET_ROOM_LIST,
-				strlen(s), s, 0
-			));
-		}
-		break;
-	case PACKET_LIST_SUBCATEGORY:
-		/**
-		 * PT 8.2+: List rooms for a subcategory
-		 *
-		 * Data:
-		 *   0 - 3: Category id
-		 *   4 - 7: Subcategory id
-		 */
-		rid = ((ctx->pkt_in.data[4] & 0xff) << 24) |
-			  ((ctx->pkt_in.data[5] & 0xff) << 16) |
-			  ((ctx->pkt_in.data[6] & 0xff) <<  8) |
-			   (ctx->pkt_in.data[7] & 0xff);
-		if ((s = rooms_for_subcategory(ctx->db_r, uid, rid)))
-			send_packet(ctx, new_packet(PACKET_SUBCATEGORY_ROOM_LIST, strlen(s), s, 0));
-		break;
-	case PACKET_SEND_GLOBAL_NUMBERS:
-		/**
-	 	 * PT7+ Global stats: "x users are now in y groups!"
-	 	 */
-		db_exec(
-			ctx->db_w, ctx,
-			"SELECT COUNT(DISTINCT uid), COUNT(DISTINCT id) FROM room_users",
-			send_global_numbers
-		);
-		break;
-	case PACKET_CHANGE_STATUS:
-		/**
-		 * Data: status (32 bits)
-		 *
-		 * PT 8.2 has an optional status message following the status.
-		 * PT 9.1 always includes the status message, with a preceeding byte.
-		 *        TODO: figure out what that preceeding byte is.
-		 */
-		ctx->status = uid;
-		if (ctx->pkt_in.version >= PROTOCOL_VERSION_82) {
-			if (ctx->status_msg) {
-				free(ctx->status_msg);
-				ctx->status_msg = NULL;
-			}
-
-			rid = 4 + (ctx->pkt_in.version >= PROTOCOL_VERSION_91);
-			if (ctx->pkt_in.length > rid) {
-				len = min(STATUSMSG_MAX, ctx->pkt_in.length - rid);
-				if (!(ctx->status_msg = calloc(len + 1, 1)))
-					abort();
-				memcpy(ctx->status_msg, ctx->pkt_in.data + rid, len);
-			}
-		}
+	send_packet(ctx, packet_from_sb(
+		(rid != CATEGORY_FEATURED && rid != CATEGORY_TOP) ?
+		ctx->ops->room_list_type : PACKET_ROOM_LIST, &sb
+	));
+}
 
-		broadcast_status(ctx);
-		break;
-	case PACKET_SET_DISPLAYNAME:
-		/**
-		 * Data:
-		 *   0 - 3: uid (32 bits)
-		 *   4 - *: Display name
-		 *
-		 * I'm surprised the length isn't limited client-side.
-		 */
-		ctx->pkt_in.data[4 + min(NICKNAME_MAX, ctx->pkt_in.length - 4)] = '\0';
-		set_buddy_display(ctx, uid, ctx->pkt_in.data + 4);
-		break;
-	case PACKET_ADD_BUDDY:
-		/**
-		 * Data: uid (32 bits)
-		 *
-		 * Response:
-		 *   (entire buddy list)
-		 */
-		if (!can_send_to_user(ctx, uid))
-			break;
-		add_buddy(ctx, uid);
-		send_buddy_list(ctx, 0);
-		break;
-	case PACKET_REMOVE_BUDDY:
-		/**
-		 * Data: uid (32 bits)
-		 *
-		 * Response:
-		 *   0 - 4: UID of removed buddy
-		 */
-		remove_buddy(ctx, uid);
-		uid = htonl(uid);
-		pkt = new_packet(PACKET_BUDDY_REMOVED, 4, (void *)&uid, PACKET_F_COPY);
-		send_packet(ctx, pkt);
-		break;
-	case PACKET_BLOCK_BUDDY:
-		/**
-		 * Data: uid (32 bits)
-		 *
-		 * Response:
-		 *   0 - 4: UID of blocked user
-		 *   5 - 6: Disposition (0 = unblocked, 1 = blocked)
-		 *   7 - *: Message ("Success" or error message)
-		 */
-		memset(buf, 0, 14);
-		memcpy(buf, ctx->pkt_in.data, 4);
-		buf[5] = 1;
-
-		if (!user_exists(ctx->db_r, uid)) {
-			memcpy(buf + 6, nxuser, NXUSER_LEN);
-			pkt = new_packet(PACKET_BLOCK_RESPONSE, 6 + NXUSER_LEN,
-			                 buf, PACKET_F_COPY);
-			send_packet(ctx, pkt);
-			break;
+static void handle_list_subcategory(struct pt_context *ctx, const struct pt_args *a)
+{
+	struct strbuf sb;
+
+	/**
+	 * PT 8.2+: List rooms for a subcategory
+	 *
+	 * Data:
+	 *   0 - 3: Category id
+	 *   4 - 7: Subcategory id
+	 */
+	packet_sb_init(&sb);
+	if (rooms_for_subcategory(ctx->db_r, &sb, a->dw[0], a->dw[1]))
+		sb_free(&sb);
+	else send_packet(ctx, packet_from_sb(PACKET_SUBCATEGORY_ROOM_LIST, &sb));
+}
+
+static void handle_global_numbers(struct pt_context *ctx, const struct pt_args *a)
+{
+	(void)a;
+
+	/**
+ 	 * PT7+ Global stats: "x users are now in y groups!"
+ 	 */
+	send_global_numbers(ctx);
+}
+
+static void handle_change_status(struct pt_context *ctx, const struct pt_args *a)
+{
+	size_t len, off;
+
+	/**
+	 * Data: status (32 bits)
+	 *
+	 * PT 8.2 has an optional status message following the status.
+	 * PT 9.1 always includes the status message, with a preceeding byte.
+	 *        TODO: figure out what that preceeding byte is.
+	 */
+	ctx->status = a->dw[0];
+	if ((off = ctx->ops->status_msg_off)) {
+		if (ctx->status_msg) {
+			free(ctx->status_msg);
+			ctx->status_msg = NULL;
 		}
 
-		if (user_is_staff(ctx->db_r, uid)) {
-			memcpy(buf + 6, cant_block_admins, CANT_BLOCK_ADMINS_LEN);
-			pkt = new_packet(PACKET_BLOCK_RESPONSE,
-			                 6 + CANT_BLOCK_ADMINS_LEN, buf, PACKET_F_COPY);
-			send_packet(ctx, pkt);
-			break;
+		if (ctx->pkt_in.length > off) {
+			len = min(STATUSMSG_MAX, ctx->pkt_in.length - off);
+			if (!(ctx->status_msg = calloc(len + 1, 1)))
+				abort();
+			memcpy(ctx->status_msg, ctx->pkt_in.data + off, len);
 		}
+	}
 
-		block_buddy(ctx, uid);
-		memcpy(buf + 6, success, SUCCESS_LEN);
-		pkt = new_packet(PACKET_BLOCK_RESPONSE,
-		                 6 + SUCCESS_LEN, buf, PACKET_F_COPY);
-		send_packet(ctx, pkt);
+	broadcast_status(ctx);
+}
 
-		/* In case they're still in the buddylist */
-		buf[0] = (uid >> 24) & 0xff;
-		buf[1] = (uid >> 16) & 0xff;
-		buf[2] = (uid >> 8)  & 0xff;
-		buf[3] = uid & 0xff;
-		buf[4] = (char)((STATUS_BLOCKED >> 24) & 0xff);
-		buf[5] = (char)((STATUS_BLOCKED >> 16) & 0xff);
-		buf[6] = (char)((STATUS_BLOCKED >> 8) & 0xff);
-		buf[7] = (char)(STATUS_BLOCKED & 0xff);
-
-		pkt = new_packet(PACKET_BUDDY_STATUSCHANGE, 8, buf, PACKET_F_COPY);
-		send_packet(ctx, pkt);
-		break;
-	case PACKET_UNBLOCK_BUDDY:
-		/**
-		 * Data: uid (32 bits)
-		 *
-		 * Response:
-		 *   0 - 4: UID of unblocked user
-		 *   5 - 6: Disposition (0 = unblocked, 1 = blocked)
-		 *   7 - *: Message ("Success" or error message)
-		 */
-		unblock_buddy(ctx, uid);
-		memset(buf, 0, 14);
-		memcpy(buf, ctx->pkt_in.data, 4);
-		memcpy(buf + 6, success, SUCCESS_LEN);
-		send_packet(ctx, new_packet(PACKET_BLOCK_RESPONSE, 6 + SUCCESS_LEN, buf, PACKET_F_COPY));
-		send_buddy_list(ctx, 0);
-		break;
-	case PACKET_SEARCH_USER:
-		/**
-		 * Data:
-		 *   PT5: Only nickname/exnick is used by the form.
-		 *     uid=(my uid)
-		 *     first=
-		 *     last=
-		 *     nickname=
-		 *     exnick=
-		 *     email=
-		 *
-		 *   PT7: search term (i.e. nickname=... or email=...)
-		 */
-		if (ctx->protocol_version < PROTOCOL_VERSION_70) {
-			if ((s = strstr(ctx->pkt_in.data, "exnick="))) /* nickname (exact) */
-				s = search_users(ctx->db_r, "xnickname", strtok(s + 7, "\n"));
-			else if ((s = strstr(ctx->pkt_in.data, "nickname="))) /* nickname starts with */
-				s = search_users(ctx->db_r, "pnickname", strtok(s + 9, "\n"));
-		} else {
-			if (!(s = strtok(ctx->pkt_in.data, "=")))
-				break;
+static void handle_set_displayname(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data:
+	 *   0 - 3: uid (32 bits)
+	 *   4 - *: Display name
+	 *
+	 * I'm surprised the length isn't limited client-side.
+	 */
+	ctx->pkt_in.data[4 + min(NICKNAME_MAX, ctx->pkt_in.length - 4)] = '\0';
+	set_buddy_display(ctx, a->dw[0], ctx->pkt_in.data + 4);
+}
 
-			if (strcmp(s, "nickname") && strcmp(s, "email")) {
-				WARN(("Unknown user search term: %s", s));
-				break;
-			}
+static void handle_add_buddy(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: uid (32 bits)
+	 *
+	 * Response:
+	 *   (entire buddy list)
+	 */
+	if (!can_send_to_user(ctx, a->dw[0]))
+		return;
 
-			sprintf(buf, "p%s", s);
-			s = search_users(ctx->db_r, buf, strtok(NULL, "\n"));
-		}
+	add_buddy(ctx, a->dw[0]);
+	db_sync(ctx->db_w, buddy_list_committed, (void *)(uintptr_t)ctx->handle);
+}
+
+static void handle_remove_buddy(struct pt_context *ctx, const struct pt_args *a)
+{
+	unsigned long uid;
+
+	/**
+	 * Data: uid (32 bits)
+	 *
+	 * Response:
+	 *   0 - 4: UID of removed buddy
+	 */
+	remove_buddy(ctx, a->dw[0]);
+	uid = htonl(a->dw[0]);
+	send_packet(ctx, new_packet(PACKET_BUDDY_REMOVED, 4, (void *)&uid, PACKET_F_COPY));
+}
+
+static void handle_block_buddy(struct pt_context *ctx, const struct pt_args *a)
+{
+	char buf[64];
+	unsigned long uid = a->dw[0];
+
+	/**
+	 * Data: uid (32 bits)
+	 *
+	 * Response:
+	 *   0 - 4: UID of blocked user
+	 *   5 - 6: Disposition (0 = unblocked, 1 = blocked)
+	 *   7 - *: Message ("Success" or error message)
+	 */
+	memset(buf, 0, 14);
+	memcpy(buf, ctx->pkt_in.data, 4);
+	buf[5] = 1;
+
+	if (!user_exists(ctx->db_r, uid)) {
+		memcpy(buf + 6, nxuser, NXUSER_LEN);
+		send_packet(ctx, new_packet(PACKET_BLOCK_RESPONSE, 6 + NXUSER_LEN,
+		                            buf, PACKET_F_COPY));
+		return;
+	}
+
+	if (user_is_staff(ctx->db_r, uid)) {
+		memcpy(buf + 6, cant_block_admins, CANT_BLOCK_ADMINS_LEN);
+		send_packet(ctx, new_packet(PACKET_BLOCK_RESPONSE,
+		                            6 + CANT_BLOCK_ADMINS_LEN, buf, PACKET_F_COPY));
+		return;
+	}
+
+	block_buddy(ctx, uid);
+	memcpy(buf + 6, success, SUCCESS_LEN);
+	send_packet(ctx, new_packet(PACKET_BLOCK_RESPONSE,
+	                            6 + SUCCESS_LEN, buf, PACKET_F_COPY));
+
+	/* In case they're still in the buddylist */
+	buf[0] = (uid >> 24) & 0xff;
+	buf[1] = (uid >> 16) & 0xff;
+	buf[2] = (uid >> 8)  & 0xff;
+	buf[3] = uid & 0xff;
+	buf[4] = (char)((STATUS_BLOCKED >> 24) & 0xff);
+	buf[5] = (char)((STATUS_BLOCKED >> 16) & 0xff);
+	buf[6] = (char)((STATUS_BLOCKED >> 8) & 0xff);
+	buf[7] = (char)(STATUS_BLOCKED & 0xff);
+	send_packet(ctx, new_packet(PACKET_BUDDY_STATUSCHANGE, 8, buf, PACKET_F_COPY));
+}
+
+static void handle_unblock_buddy(struct pt_context *ctx, const struct pt_args *a)
+{
+	char buf[16];
+
+	/**
+	 * Data: uid (32 bits)
+	 *
+	 * Response:
+	 *   0 - 4: UID of unblocked user
+	 *   5 - 6: Disposition (0 = unblocked, 1 = blocked)
+	 *   7 - *: Message ("Success" or error message)
+	 */
+	unblock_buddy(ctx, a->dw[0]);
+	memset(buf, 0, 14);
+	memcpy(buf, ctx->pkt_in.data, 4);
+	memcpy(buf + 6, success, SUCCESS_LEN);
+	send_packet(ctx, new_packet(PACKET_BLOCK_RESPONSE, 6 + SUCCESS_LEN, buf, PACKET_F_COPY));
+	db_sync(ctx->db_w, buddy_list_committed, (void *)(uintptr_t)ctx->handle);
+}
+
+static void handle_search_user(struct pt_context *ctx, const struct pt_args *a)
+{
+	char buf[16], *s;
+	struct strbuf sb;
+	struct span in, k, v;
+	struct pt_packet *pkt;
+	(void)a;
+
+	/**
+	 * Data:
+	 *   PT5: Only nickname/exnick is used by the form.
+	 *     uid=(my uid)
+	 *     first=
+	 *     last=
+	 *     nickname=
+	 *     exnick=
+	 *     email=
+	 *
+	 *   PT7: search term (i.e. nickname=... or email=...)
+	 */
+	packet_sb_init(&sb);
+	in.p   = ctx->pkt_in.data;
+	in.len = ctx->pkt_in.length;
+	if (ctx->ops->user_search_form) {
+		if ((s = strstr(ctx->pkt_in.data, "exnick="))) /* nickname (exact) */
+			strcpy(buf, "xnickname");
+		else if ((s = strstr(ctx->pkt_in.data, "nickname="))) /* nickname starts with */
+			strcpy(buf, "pnickname");
 
 		if (s) {
-			send_packet(ctx, new_packet(
-				PACKET_SEARCH_RESULTS, strlen(s), s, 0
-			));
+			s       = strchr(s, '=') + 1;
+			in.len -= (size_t)(s - in.p);
+			in.p    = s;
+			span_next(&in, '\n', &v);
+			search_users(ctx->db_r, &sb, buf, &v);
 		}
+	} else if (span_next(&in, '=', &k)) {
+		if (!span_eq(&k, "nickname") && !span_eq(&k, "email")) {
+			WARN(("Unknown user search term: %.*s", (int)k.len, k.p));
+		} else {
+			sprintf(buf, "p%.*s", (int)k.len, k.p);
+			span_next(&in, '\n', &v);
+			search_users(ctx->db_r, &sb, buf, &v);
+		}
+	}
 
-		break;
-	case PACKET_SEARCH_ROOM:
-		/**
-		 * PT 7+: Search for partial matches in room names
-		 *
-		 * Data:
-		 *   Search term (text)
-		 *
-		 * Response:
-		 *   0 - 1: Count of records + 1
-		 *   2 - *: Records of: rating, nm, id, v, l
-		 */
-		if (!(s = calloc(ctx->pkt_in.length + 3, 1)))
-			abort();
+	if ((pkt = packet_from_sb(PACKET_SEARCH_RESULTS, &sb)))
+		send_packet(ctx, pkt);
+}
 
-		s[0] = '%';
-		memcpy(s + 1, ctx->pkt_in.data, ctx->pkt_in.length);
-		s[ctx->pkt_in.length + 1] = '%';
-		if (!(s2 = search_rooms(ctx->db_w, ctx->protocol_version, s))) {
-			free(s);
-			if (!(s = calloc(2, 1)))
-				abort();
-			send_packet(ctx, new_packet(PACKET_ROOM_SEARCH_RESULTS, 2, s, 0));
-			break;
-		}
+static void handle_search_room(struct pt_context *ctx, const struct pt_args *a)
+{
+	char *s, *s2;
+	size_t len;
+	(void)a;
 
+	/**
+	 * PT 7+: Search for partial matches in room names
+	 *
+	 * Data:
+	 *   Search term (text)
+	 *
+	 * Response:
+	 *   0 - 1: Count of records + 1
+	 *   2 - *: Records of: rating, nm, id, v, l
+	 */
+	if (!(s = calloc(ctx->pkt_in.length + 3, 1)))
+		abort();
+
+	s[0] = '%';
+	memcpy(s + 1, ctx->pkt_in.data, ctx->pkt_in.length);
+	s[ctx->pkt_in.length + 1] = '%';
+	if (!(s2 = search_rooms(ctx->db_r, ctx->ops, s))) {
 		free(s);
-		for (len = 0, s = s2; *s; s++)
-			len += *(unsigned char *)s == 0xc8;
-
-		s = malloc(3 + strlen(s2));
-		memcpy(s + 2, s2, strlen(s2));
-		s[0] = (len >> 8) & 0xff;
-		s[1] = len & 0xff;
-		send_packet(ctx, new_packet(PACKET_ROOM_SEARCH_RESULTS, strlen(s2) + 2, s, 0));
-		free(s2);
-		break;
-	case PACKET_IM_OUT:
-		/**
-		 * Data:
-		 *   0 - 3: Recipient UID (32 bits)
-		 *   4 - *: Message
-		 */
+		if (!(s = calloc(2, 1)))
+			abort();
+		send_packet(ctx, new_packet(PACKET_ROOM_SEARCH_RESULTS, 2, s, 0));
+		return;
+	}
+
+	free(s);
+	for (len = 0, s = s2; *s; s++)
+		len += *(unsigned char *)s == 0xc8;
+
+	s = malloc(3 + strlen(s2));
+	memcpy(s + 2, s2, strlen(s2));
+	s[0] = (len >> 8) & 0xff;
+	s[1] = len & 0xff;
+	send_packet(ctx, new_packet(PACKET_ROOM_SEARCH_RESULTS, strlen(s2) + 2, s, 0));
+	free(s2);
+}
 
+static void handle_im_out(struct pt_context *ctx, const struct pt_args *a)
+{
+	unsigned long uid = a->dw[0];
+	struct pt_context *target;
+
+	/**
+	 * Data:
+	 *   0 - 3: Recipient UID (32 bits)
+	 *   4 - *: Message
+	 */
+	if (!can_send_to_user(ctx, uid))
+		return;
+
+	if (!(target = uidmap_get(uid_to_context, uid))) {
+		store_offline_message(ctx, uid, ctx->pkt_in.data + 4);
+		return;
+	}
+
+	ctx->pkt_in.data[0] = (ctx->uid >> 24) & 0xff;
+	ctx->pkt_in.data[1] = (ctx->uid >> 16) & 0xff;
+	ctx->pkt_in.data[2] = (ctx->uid >> 8)  & 0xff;
+	ctx->pkt_in.data[3] = ctx->uid & 0xff;
+	send_packet(target, new_packet(
+		PACKET_IM_IN, ctx->pkt_in.length, ctx->pkt_in.data, PACKET_F_COPY
+	));
+}
+
+static void handle_room_message(struct pt_context *ctx, const struct pt_args *a)
+{
+	char *s;
+	unsigned long rid = a->dw[0];
+	struct room_member *member;
+
+	/**
+	 * Data:
+	 *   0 - 3: Room id (32 bits)
+	 *   4 - *: Message
+	 *
+	 * Response:
+	 *   0 - 3: Room id (32 bits)
+	 *   4 - 7: Sender uid (32 bits)
+	 *   8 - *: Message
+	 */
+	if (room_command(ctx, rid, ctx->pkt_in.data + 4)) return;
+	if (!(member = room_member(ctx, rid)))            return;
+	if (member->flags & (ROOM_F_INVIS | ROOM_F_REDDOT)) return;
+
+	/**
+	 * TODO: if text is reddotted at the room level, ignore any
+	 * messages from non-admins
+	 */
+
+	if (!(s = malloc(ctx->pkt_in.length + 4)))
+		abort();
+
+	memcpy(s, ctx->pkt_in.data, 4);
+	s[4] = (ctx->uid >> 24) & 0xff;
+	s[5] = (ctx->uid >> 16) & 0xff;
+	s[6] = (ctx->uid >> 8)  & 0xff;
+	s[7] = ctx->uid & 0xff;
+
+	memcpy(s + 8, ctx->pkt_in.data + 4, ctx->pkt_in.length - 4);
+	broadcast_to_room(ctx, rid, new_packet(
+		PACKET_ROOM_MESSAGE_IN, ctx->pkt_in.length + 4, s, PACKET_F_DROP
+	));
+}
+
+static void handle_nudge(struct pt_context *ctx, const struct pt_args *a)
+{
+	char buf[16];
+	unsigned long uid = a->dw[0], rid = a->dw[1];
+	struct pt_context *target;
+
+	/**
+	 * [PT 8] Seems like a terribly annoying feature...
+	 * [PT 9] Room nudges were removed from the UI, understandably.
+	 *
+	 * Data:
+	 *   0 - 3: uid (32 bits) [IM] or 00 00 00 00 [Room]
+	 *   4 - 7: room id (32 bits) [Room] or 00 00 00 00 [IM]
+	 *   8 - 11: Nudge type (1=car horn, 2=fog horn, 3=monkey)
+	 */
+
+	/* The first three dwords mirror the input packet */
+	memcpy(buf, ctx->pkt_in.data, 12);
+	memset(buf + 4, 0, 4);
+
+	/* 4th dword: Sender uid */
+	buf[12] = (ctx->uid >> 24) & 0xff;
+	buf[13] = (ctx->uid >> 16) & 0xff;
+	buf[14] = (ctx->uid >> 8)  & 0xff;
+	buf[15] = ctx->uid & 0xff;
+
+	if (uid) {
 		if (!can_send_to_user(ctx, uid))
-			break;
+			return;
 
-		if (!(target = ht_get_ptr_nc(uid_to_context, buf))) {
-			store_offline_message(ctx, uid, ctx->pkt_in.data + 4);
-			break;
-		}
+		if (!(target = uidmap_get(uid_to_context, uid)))
+			return;
 
-		ctx->pkt_in.data[0] = (ctx->uid >> 24) & 0xff;
-		ctx->pkt_in.data[1] = (ctx->uid >> 16) & 0xff;
-		ctx->pkt_in.data[2] = (ctx->uid >> 8)  & 0xff;
-		ctx->pkt_in.data[3] = ctx->uid & 0xff;
-		send_packet(target, new_packet(
-			PACKET_IM_IN, ctx->pkt_in.length, ctx->pkt_in.data, 0
-		));
-		ctx->pkt_in.length = 0;
-		break;
-	case PACKET_ROOM_MESSAGE_OUT:
-		/**
-		 * Data:
-		 *   0 - 3: Room id (32 bits)
-		 *   4 - *: Message
-		 *
-		 * Response:
-		 *   0 - 3: Room id (32 bits)
-		 *   4 - 7: Sender uid (32 bits)
-		 *   8 - *: Message
-		 */
-		if (room_command(ctx, uid, ctx->pkt_in.data + 4)) break;
-		if (user_is_invisible(ctx, uid, ctx->uid))        break;
-
-		/**
-		 * TODO: if text is reddotted at the room level, ignore any
-		 * messages from non-admins
-		 */
-
-		if (!(s = malloc(ctx->pkt_in.length + 4)))
-			abort();
+		if (target == ctx || !target->ops->im_nudges)
+			return;
 
-		memcpy(s, ctx->pkt_in.data, 4);
-		s[4] = (ctx->uid >> 24) & 0xff;
-		s[5] = (ctx->uid >> 16) & 0xff;
-		s[6] = (ctx->uid >> 8)  & 0xff;
-		s[7] = ctx->uid & 0xff;
+		send_packet(target, new_packet(PACKET_NUDGE_IN, 16, buf, PACKET_F_COPY | PACKET_F_DROP));
+	} else if (rid) {
+		/* TODO: Make sure the target room user isn't ignoring the sender */
+		broadcast_to_room(ctx, rid, new_packet(PACKET_NUDGE_IN, 16, buf, PACKET_F_COPY | PACKET_F_DROP));
+	}
+}
 
-		memcpy(s + 8, ctx->pkt_in.data + 4, ctx->pkt_in.length - 4);
-		broadcast_to_room(ctx, uid, new_packet(
-			PACKET_ROOM_MESSAGE_IN, ctx->pkt_in.length + 4, s, 0
-		));
-		break;
-	case PACKET_NUDGE_OUT:
-		/**
-		 * [PT 8] Seems like a terribly annoying feature...
-		 * [PT 9] Room nudges were removed from the UI, understandably.
-		 *
-		 * Data:
-		 *   0 - 3: uid (32 bits) [IM] or 00 00 00 00 [Room]
-		 *   4 - 7: room id (32 bits) [Room] or 00 00 00 00 [IM]
-		 *   8 - 11: Nudge type (1=car horn, 2=fog horn, 3=monkey)
-		 */
-		rid = ((ctx->pkt_in.data[4] & 0xff) << 24) |
-			  ((ctx->pkt_in.data[5] & 0xff) << 16) |
-			  ((ctx->pkt_in.data[6] & 0xff) <<  8) |
-			   (ctx->pkt_in.data[7] & 0xff);
-
-		/* The first three dwords mirror the input packet */
-		memcpy(buf, ctx->pkt_in.data, 12);
-		memset(buf + 4, 0, 4);
-
-		/* 4th dword: Sender uid */
-		buf[12] = (ctx->uid >> 24) & 0xff;
-		buf[13] = (ctx->uid >> 16) & 0xff;
-		buf[14] = (ctx->uid >> 8)  & 0xff;
-		buf[15] = ctx->uid & 0xff;
-
-		if (uid) {
-			if (!can_send_to_user(ctx, uid))
-				break;
-
-			sprintf(buf, "%ld", uid);
-			if (!(target = ht_get_ptr_nc(uid_to_context, buf)))
-				break;
-
-			if (target == ctx || target->protocol_version < PROTOCOL_VERSION_82)
-				break;
-
-			send_packet(target, new_packet(PACKET_NUDGE_IN, 16, buf, PACKET_F_COPY));
-		} else if (rid) {
-			/* TODO: Make sure the target room user isn't ignoring the sender */
-			broadcast_to_room(ctx, rid, new_packet(PACKET_NUDGE_IN, 16, buf, PACKET_F_COPY));
-		}
-		break;
-	case PACKET_ROOM_CREATE:
-		break;
-	case PACKET_ROOM_CLOSE:
-		break;
-	case PACKET_ROOM_JOIN:
-	case PACKET_ROOM_JOIN_AS_ADMIN:
-		/**
-		 * Data:
-		 *   0 - 3: room id
-		 *   4 - 7: admin code (0 if none)
-		 *   8 - 9: 0x082a (default incoming udp voice port)
-		 */
-		break;
-	case PACKET_ROOM_LEAVE:
-		/**
-		 * Data: room id
-		 *
-		 * Response:
-		 *   0 - 3: room id
-		 *   4 - 7: user id
-		 */
-		memcpy(buf, ctx->pkt_in.data, 4);
-		buf[4] = (ctx->uid >> 24) & 0xff;
-		buf[5] = (ctx->uid >> 16) & 0xff;
-		buf[6] = (ctx->uid >> 8)  & 0xff;
-		buf[7] = ctx->uid & 0xff;
-		broadcast_to_room(ctx, uid, new_packet(PACKET_ROOM_USER_LEFT, 8, buf, PACKET_F_COPY));
-		sprintf(buf, "DELETE FROM room_users WHERE id=%ld AND uid=%ld", uid, ctx->uid);
-		db_exec(ctx->db_w, NULL, buf, NULL);
-		break;
-	case PACKET_ROOM_GET_ADMIN_INFO:
-		/**
-		 * Data: room id
-		 *
-		 * Response:
-		 *   group=int\n
-		 *   mike=int\n   -- 1 if new users get mic privs, 0 otherwise
-		 *   text=int\n   -- 1 if text is reddotted, 0 otherwise
-		 *   video=int\n  -- 1 if video is reddotted, 0 otherwise
-		 *   bounce=\n \n \n \n \xc8 -- list of user ids, \n delimited
-		 *   ban=\n \n \n \n \n \xc8 -- list of user ids, \n delimited
-		 */
-		if ((s = get_admin_info(ctx, uid)))
-			send_packet(ctx, new_packet(PACKET_ROOM_ADMIN_INFO, strlen(s), s, 0));
-		break;
-	case PACKET_ROOM_MUTE:
-		/**
-		 * Data:
-		 *   0 - 3: room id
-		 *   4 - 5: 00 00 - off, 00 01 - on
-		 *
-		 * Response:
-		 *   0 - 3: room id
-		 *   4 - 7: uid
-		 *   8 - 9: 00 00 - off, 00 01 - on
-		 */
-		memcpy(buf, ctx->pkt_in.data, 4);
-		buf[4] = (ctx->uid >> 24) & 0xff;
-		buf[5] = (ctx->uid >> 16) & 0xff;
-		buf[6] = (ctx->uid >> 8)  & 0xff;
-		buf[7] = ctx->uid & 0xff;
-		buf[8] = '\0';
-		buf[9] = !!(ctx->pkt_in.data[4] | ctx->pkt_in.data[5]);
-		pkt = new_packet(PACKET_ROOM_USER_MUTE, 10, buf, PACKET_F_COPY);
-		broadcast_to_room(ctx, uid, pkt);
-		break;
-	case PACKET_ROOM_REDDOT_USER:
-	case PACKET_ROOM_UNREDDOT_USER:
-		/**
-		 * Data:
-		 *   0 - 4: room id
-		 *   5 - 8: target user id
-		 *
-		 * Response: room id, uid
-		 */
-		rid = uid;
-		uid = ((ctx->pkt_in.data[4] & 0xff) << 24) |
-			  ((ctx->pkt_in.data[5] & 0xff) << 16) |
-			  ((ctx->pkt_in.data[6] & 0xff) <<  8) |
-			   (ctx->pkt_in.data[7] & 0xff);
-
-		reddot_user(ctx, rid, uid, ctx->pkt_in.type == PACKET_ROOM_REDDOT_USER);
-		break;
-	case PACKET_ROOM_HAND_UP:
-	case PACKET_ROOM_HAND_DOWN:
-		/**
-		 * Data: room id
-		 *
-		 * Response: room id, uid
-		 */
-		raise_hand(ctx, uid, ctx->pkt_in.type == PACKET_ROOM_HAND_UP);
-		break;
-	case PACKET_ROOM_SET_ALL_MICS:
-		/**
-		 * Data:
-		 *   0 - 3: room id
-		 *   4 - 5: 00 00 - off, 00 01 - on
-		 *
-		 * Response:
-		 *   Appends the sender's uid
-		 */
-		set_all_mics(ctx, uid, ctx->pkt_in.data[4] | ctx->pkt_in.data[5]);
-		break;
-	case PACKET_ROOM_LOWER_ALL_HANDS:
-		/**
-		 * Data: room id
-		 */
-		lower_all_hands(ctx, uid);
-		break;
-	case PACKET_ROOM_SET_TOPIC:
-		/**
-		 * Data: room id, topic
-		 */
-		room_topic(ctx, uid, ctx->pkt_in.data + 4);
-		break;
-	case PACKET_ROOM_BAN_USER:
-		/**
-		 * Data: room id, uid
-		 */
-		rid = uid;
-		uid = ((ctx->pkt_in.data[4] & 0xff) << 24) |
-			  ((ctx->pkt_in.data[5] & 0xff) << 16) |
-			  ((ctx->pkt_in.data[6] & 0xff) <<  8) |
-			   (ctx->pkt_in.data[7] & 0xff);
-
-		ban_user(ctx, rid, uid);
-		break;
-	case PACKET_ROOM_UNBAN_USER:
-		/**
-		 * Data: room id, uid
-		 */
-		rid = uid;
-		uid = ((ctx->pkt_in.data[4] & 0xff) << 24) |
-			  ((ctx->pkt_in.data[5] & 0xff) << 16) |
-			  ((ctx->pkt_in.data[6] & 0xff) <<  8) |
-			   (ctx->pkt_in.data[7] & 0xff);
-
-		unban_user(ctx, rid, uid);
-		break;
-	case PACKET_ROOM_BOUNCE_USER:
-	case PACKET_ROOM_BOUNCE_REASON:
-		/**
-		 * Data: room id, uid, [reason]
-		 */
-		rid = uid;
-		uid = ((ctx->pkt_in.data[4] & 0xff) << 24) |
-			  ((ctx->pkt_in.data[5] & 0xff) << 16) |
-			  ((ctx->pkt_in.data[6] & 0xff) <<  8) |
-			   (ctx->pkt_in.data[7] & 0xff);
-
-		s = ctx->pkt_in.length > 8 ? ctx->pkt_in.data + 8 : NULL;
-		bounce_user(ctx, rid, uid, s);
+static void handle_room_join(struct pt_context *ctx, const struct pt_args *a)
+{
+	int admin = ctx->pkt_in.type == PACKET_ROOM_JOIN_AS_ADMIN;
+	const char *pw = NULL;
+
+	/**
+	 * Data [JOIN]:
+	 *   0 - 3: room id
+	 *   4 - 5: 00 01 to join invisibly, 00 00 otherwise
+	 *   6 - 9: 0000082a (default incoming udp voice port)
+	 *   10 - *: password, for a private room
+	 *
+	 * Data [JOIN_AS_ADMIN]:
+	 *   0 - 3: room id
+	 *   4 - 7: admin code (0 if none)
+	 *   8 - 11: 0000082a (default incoming udp voice port)
+	 */
+	if (!admin && ctx->pkt_in.length > 10)
+		pw = ctx->pkt_in.data + 10;
+
+	switch (join_room(ctx, a->dw[0], admin, admin ? a->dw[1] : 0, !admin && a->w2, pw)) {
+	case ROOM_ERR_NXROOM:
+		send_return_code(ctx, 0x63, nxroom, NXROOM_LEN);
 		break;
-	case PACKET_ROOM_UNBOUNCE_USER:
-		rid = uid;
-		uid = ((ctx->pkt_in.data[4] & 0xff) << 24) |
-			  ((ctx->pkt_in.data[5] & 0xff) << 16) |
-			  ((ctx->pkt_in.data[6] & 0xff) <<  8) |
-			   (ctx->pkt_in.data[7] & 0xff);
-
-		unbounce_user(ctx, rid, uid);
+	case ROOM_ERR_BANNED:
+		send_return_code(ctx, 0x63, banned, BANNED_LEN);
 		break;
-	case PACKET_ROOM_NEW_USER_MIC:
-		/**
-		 * Data:
-		 *   0 - 3: room id
-		 *   4 - 5: 00 00 - off, 00 01 - on
-		 */
-		new_user_mic(ctx, uid, ctx->pkt_in.data[4] | ctx->pkt_in.data[5]);
+	case ROOM_ERR_BOUNCED:
+		send_return_code(ctx, 0x63, bounced, BOUNCED_LEN);
 		break;
-	case PACKET_ROOM_REDDOT_TEXT:
-		/**
-		 * Data:
-		 *   0 - 3: room id
-		 *   4 - 5: 00 00 - off, 00 01 - on
-		 */
-		reddot_text(ctx, uid, ctx->pkt_in.data[4] | ctx->pkt_in.data[5]);
+	case ROOM_ERR_CODE:
+		send_return_code(ctx, 0x63, bad_code, BAD_CODE_LEN);
 		break;
-	case PACKET_ROOM_REDDOT_VIDEO:
-		/**
-		 * Data:
-		 *   0 - 3: room id
-		 *   4 - 5: 00 00 - off, 00 01 - on
-		 */
-		reddot_video(ctx, uid, ctx->pkt_in.data[4] | ctx->pkt_in.data[5]);
+	case ROOM_ERR_PASSWORD:
+		send_return_code(ctx, 0x63, bad_pw, BAD_PW_LEN);
 		break;
+	}
+}
+
+static void handle_room_leave(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: room id
+	 *
+	 * Response:
+	 *   0 - 3: room id
+	 *   4 - 7: user id
+	 */
+	leave_room(ctx, a->dw[0]);
+}
+
+static void handle_admin_info(struct pt_context *ctx, const struct pt_args *a)
+{
+	char *s;
+
+	/**
+	 * Data: room id
+	 *
+	 * Response:
+	 *   group=int\n
+	 *   mike=int\n   -- 1 if new users get mic privs, 0 otherwise
+	 *   text=int\n   -- 1 if text is reddotted, 0 otherwise
+	 *   video=int\n  -- 1 if video is reddotted, 0 otherwise
+	 *   bounce=\n \n \n \n \xc8 -- list of user ids, \n delimited
+	 *   ban=\n \n \n \n \n \xc8 -- list of user ids, \n delimited
+	 */
+	if ((s = get_admin_info(ctx, a->dw[0])))
+		send_packet(ctx, new_packet(PACKET_ROOM_ADMIN_INFO, strlen(s), s, 0));
+}
+
+static void handle_room_mute(struct pt_context *ctx, const struct pt_args *a)
+{
+	char buf[10];
+
+	/**
+	 * Data:
+	 *   0 - 3: room id
+	 *   4 - 5: 00 00 - off, 00 01 - on
+	 *
+	 * Response:
+	 *   0 - 3: room id
+	 *   4 - 7: uid
+	 *   8 - 9: 00 00 - off, 00 01 - on
+	 */
+	memcpy(buf, ctx->pkt_in.data, 4);
+	buf[4] = (ctx->uid >> 24) & 0xff;
+	buf[5] = (ctx->uid >> 16) & 0xff;
+	buf[6] = (ctx->uid >> 8)  & 0xff;
+	buf[7] = ctx->uid & 0xff;
+	buf[8] = '\0';
+	buf[9] = !!a->w2;
+	broadcast_to_room(ctx, a->dw[0], new_packet(PACKET_ROOM_USER_MUTE, 10, buf, PACKET_F_COPY));
+}
+
+static void handle_reddot_user(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data:
+	 *   0 - 4: room id
+	 *   5 - 8: target user id
+	 *
+	 * Response: room id, uid
+	 */
+	reddot_user(ctx, a->dw[0], a->dw[1], ctx->pkt_in.type == PACKET_ROOM_REDDOT_USER);
+}
+
+static void handle_hand(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: room id
+	 *
+	 * Response: room id, uid
+	 */
+	raise_hand(ctx, a->dw[0], ctx->pkt_in.type == PACKET_ROOM_HAND_UP);
+}
+
+static void handle_set_all_mics(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data:
+	 *   0 - 3: room id
+	 *   4 - 5: 00 00 - off, 00 01 - on
+	 *
+	 * Response:
+	 *   Appends the sender's uid
+	 */
+	set_all_mics(ctx, a->dw[0], a->w2);
+}
+
+static void handle_lower_all_hands(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: room id
+	 */
+	lower_all_hands(ctx, a->dw[0]);
+}
 
+static void handle_set_topic(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: room id, topic
+	 */
+	room_topic(ctx, a->dw[0], ctx->pkt_in.data + 4);
+}
+
+static void handle_ban(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: room id, uid
+	 */
+	ban_user(ctx, a->dw[0], a->dw[1]);
+}
+
+static void handle_unban(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: room id, uid
+	 */
+	unban_user(ctx, a->dw[0], a->dw[1]);
+}
+
+static void handle_bounce(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: room id, uid, [reason]
+	 */
+	bounce_user(ctx, a->dw[0], a->dw[1],
+	            ctx->pkt_in.length > 8 ? ctx->pkt_in.data + 8 : NULL);
+}
+
+static void handle_unbounce(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data: room id, uid
+	 */
+	unbounce_user(ctx, a->dw[0], a->dw[1]);
+}
+
+static void handle_new_user_mic(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data:
+	 *   0 - 3: room id
+	 *   4 - 5: 00 00 - off, 00 01 - on
+	 */
+	new_user_mic(ctx, a->dw[0], a->w2);
+}
+
+static void handle_reddot_text(struct pt_context *ctx, const struct pt_args *a)
+{
+	/**
+	 * Data:
+	 *   0 - 3: room id
+	 *   4 - 5: 00 00 - off, 00 01 - on
+	 */
+	reddot_text(ctx, a->dw[0], a->w2);
+}
+
+static void handle_reddot_video(struct pt_context *ctx, const struct pt_args *a)
+{
 	/**
-	 * Ignored packets - placed here in this manner to document their
-	 * contents.
-	 */
-	case PACKET_COMMENCING_AUTOJOIN:
-		/**
-		 * [PT 7/8] 0-length, sent in response to LOGIN_SUCCESS, after
-		 * UID_FONTDEPTH_ETC and immediately before doing the initial
-		 * room autojoin.
-		 */
-	case PACKET_NEW_CHECKSUMS:
-	case PACKET_CHECKSUMS:
-		/**
-		 * Sent in response to PACKET_USER_DATA
-		 *
-		 * Data:
-		 *   \n delimited list of checksums for certain core PT files.
-		 *   PT 5 and 7 send 6 of these, PT 8 sends 14.
-		 *   PT 5 encodes these with variant 1 with a challenge key of 42,
-		 *   PT 7 and 8 use variant 1.
-		 */
-	case PACKET_VERSION_INFO:
-		/**
-		 * PT 8: Sent in response to PACKET_USER_DATA
-		 *
-		 * Data:
-		 *   A single COM-style number, hardcoded.
-		 */
-	case PACKET_PT5_BANNER_COUNTERS:
-		/**
-		 * Data:
-		 *   0  -  3: 00 00 00 01 (constant)
-		 *   4  -  7: counter 1
-		 *   8  - 11: counter 2
-		 *   12 - 15: counter 3
-		 */
-	case PACKET_INCOMPATIBLE_3P_APP:
-		/**
-		 * Data:
-		 *   Pattern matched (from bep/bwp in USER_DATA)
-		 */
-	case PACKET_USER_FUCKER_STATUS:
-		/**
-		 * Data:
-		 *   Status code (16 bits)
-		 *
-		 * After getting PREPARE_USER_FUCKER, the client must receive
-		 * FUCK_USER within 60 seconds in order for the client to
-		 * carry on with its malicious designs.
-		 *
-		 * 0 - Mission complete
-		 * 1 - [Forced Shutdown mode] Haven't received PEPARE_USER_FUCKER
-		 * 2 - [Forced Shutdown mode] More than 60 seconds elapsed
-		 * 3 - [Forced Shutdown mode] Target uid doesn't match ours
-		 * 4 - [Heap Exhaustion mode] Haven't received PREPARE_USER_FUCKER
-		 * 5 - [Heap Exhaustion mode] More than 60 seconds elapsed
-		 * 6 - [Heap Exhaustion mode] Target uid doesn't match ours
-		 */
-	case PACKET_CLIENT_HELLO:
+	 * Data:
+	 *   0 - 3: room id
+	 *   4 - 5: 00 00 - off, 00 01 - on
+	 */
+	reddot_video(ctx, a->dw[0], a->w2);
+}
+
+/**
+ * How a general flow packet is handled
+ *
+ * Packets shorter than \a min_len or longer than \a max_len, or from a
+ * client older than \a min_version, are dropped before the handler is
+ * called. A NULL handler means the packet is accepted and ignored.
+ */
+struct pt_handler {
+	unsigned short type;
+	unsigned short min_len;
+	unsigned short max_len;
+	unsigned short min_version;
+	void (*fn)(struct pt_context *ctx, const struct pt_args *a);
+	const char *name;
+};
+
+#define ANY_LEN 0xffff
+
+/**
+ * The packets accepted in the general flow:
+ *
+ *   H(type, min_len, max_len, min_version, handler)
+ *
+ * This list generates handlers[], and the index used to find a type's
+ * entry in it. A type that's listed twice fails to build (see
+ * check_packet_types().)
+ *
+ * Those with a NULL handler are ignored, and are listed here to
+ * document their contents:
+ *
+ * COMMENCING_AUTOJOIN:
+ *   [PT 7/8] 0-length, sent in response to LOGIN_SUCCESS, after
+ *   UID_FONTDEPTH_ETC and immediately before doing the initial
+ *   room autojoin.
+ *
+ * CHECKSUMS / NEW_CHECKSUMS: Sent in response to PACKET_USER_DATA
+ *   \n delimited list of checksums for certain core PT files.
+ *   PT 5 and 7 send 6 of these, PT 8 sends 14.
+ *   PT 5 encodes these with variant 1 with a challenge key of 42,
+ *   PT 7 and 8 use variant 1.
+ *
+ * VERSION_INFO: PT 8: Sent in response to PACKET_USER_DATA
+ *   A single COM-style number, hardcoded.
+ *
+ * PT5_BANNER_COUNTERS:
+ *   0  -  3: 00 00 00 01 (constant)
+ *   4  -  7: counter 1
+ *   8  - 11: counter 2
+ *   12 - 15: counter 3
+ *
+ * INCOMPATIBLE_3P_APP:
+ *   Pattern matched (from bep/bwp in USER_DATA)
+ *
+ * USER_FUCKER_STATUS: Status code (16 bits)
+ *   After getting PREPARE_USER_FUCKER, the client must receive
+ *   FUCK_USER within 60 seconds in order for the client to
+ *   carry on with its malicious designs.
+ *
+ *   0 - Mission complete
+ *   1 - [Forced Shutdown mode] Haven't received PEPARE_USER_FUCKER
+ *   2 - [Forced Shutdown mode] More than 60 seconds elapsed
+ *   3 - [Forced Shutdown mode] Target uid doesn't match ours
+ *   4 - [Heap Exhaustion mode] Haven't received PREPARE_USER_FUCKER
+ *   5 - [Heap Exhaustion mode] More than 60 seconds elapsed
+ *   6 - [Heap Exhaustion mode] Target uid doesn't match ours
+ */
+#define GENERAL_PACKETS(H) \
+	H(PING,                 4, ANY_LEN, 0,                   handle_ping) \
+	H(SET_PRIVACY,          1, ANY_LEN, 0,                   handle_set_privacy) \
+	H(GET_PRIVACY,          0, ANY_LEN, 0,                   handle_get_privacy) \
+	H(LIST_CATEGORY,       12, 12,      0,                   handle_list_category) \
+	H(NEW_LIST_CATEGORY,    4, 4,       PROTOCOL_VERSION_80, handle_list_category) \
+	H(LIST_SUBCATEGORY,     8, 8,       PROTOCOL_VERSION_82, handle_list_subcategory) \
+	H(SEND_GLOBAL_NUMBERS,  0, ANY_LEN, PROTOCOL_VERSION_70, handle_global_numbers) \
+	H(CHANGE_STATUS,        4, ANY_LEN, 0,                   handle_change_status) \
+	H(SET_DISPLAYNAME,      4, ANY_LEN, 0,                   handle_set_displayname) \
+	H(ADD_BUDDY,            4, 4,       0,                   handle_add_buddy) \
+	H(REMOVE_BUDDY,         4, 4,       0,                   handle_remove_buddy) \
+	H(BLOCK_BUDDY,          4, 4,       0,                   handle_block_buddy) \
+	H(UNBLOCK_BUDDY,        4, 4,       0,                   handle_unblock_buddy) \
+	H(SEARCH_USER,          0, ANY_LEN, 0,                   handle_search_user) \
+	H(SEARCH_ROOM,          0, ANY_LEN, PROTOCOL_VERSION_70, handle_search_room) \
+	H(IM_OUT,               4, ANY_LEN, 0,                   handle_im_out) \
+	H(ROOM_MESSAGE_OUT,     4, ANY_LEN, 0,                   handle_room_message) \
+	H(NUDGE_OUT,           12, 12,      PROTOCOL_VERSION_80, handle_nudge) \
+	H(ROOM_CREATE,          0, ANY_LEN, 0,                   NULL) \
+	H(ROOM_CLOSE,           0, ANY_LEN, 0,                   NULL) \
+	H(ROOM_JOIN,            6, ANY_LEN, 0,                   handle_room_join) \
+	H(ROOM_JOIN_AS_ADMIN,   6, ANY_LEN, 0,                   handle_room_join) \
+	H(ROOM_LEAVE,           4, 4,       0,                   handle_room_leave) \
+	H(ROOM_GET_ADMIN_INFO,  4, 4,       0,                   handle_admin_info) \
+	H(ROOM_MUTE,            6, 6,       0,                   handle_room_mute) \
+	H(ROOM_REDDOT_USER,     8, 8,       0,                   handle_reddot_user) \
+	H(ROOM_UNREDDOT_USER,   8, 8,       0,                   handle_reddot_user) \
+	H(ROOM_HAND_UP,         4, 4,       0,                   handle_hand) \
+	H(ROOM_HAND_DOWN,       4, 4,       0,                   handle_hand) \
+	H(ROOM_SET_ALL_MICS,    6, 6,       0,                   handle_set_all_mics) \
+	H(ROOM_LOWER_ALL_HANDS, 4, 4,       0,                   handle_lower_all_hands) \
+	H(ROOM_SET_TOPIC,       4, ANY_LEN, 0,                   handle_set_topic) \
+	H(ROOM_BAN_USER,        8, 8,       0,                   handle_ban) \
+	H(ROOM_UNBAN_USER,      8, 8,       0,                   handle_unban) \
+	H(ROOM_BOUNCE_USER,     8, ANY_LEN, 0,                   handle_bounce) \
+	H(ROOM_BOUNCE_REASON,   8, ANY_LEN, 0,                   handle_bounce) \
+	H(ROOM_UNBOUNCE_USER,   8, 8,       0,                   handle_unbounce) \
+	H(ROOM_NEW_USER_MIC,    6, 6,       0,                   handle_new_user_mic) \
+	H(ROOM_REDDOT_TEXT,     6, 6,       0,                   handle_reddot_text) \
+	H(ROOM_REDDOT_VIDEO,    6, 6,       0,                   handle_reddot_video) \
+	H(COMMENCING_AUTOJOIN,  0, ANY_LEN, 0,                   NULL) \
+	H(NEW_CHECKSUMS,        0, ANY_LEN, 0,                   NULL) \
+	H(CHECKSUMS,            0, ANY_LEN, 0,                   NULL) \
+	H(VERSION_INFO,         0, ANY_LEN, 0,                   NULL) \
+	H(PT5_BANNER_COUNTERS,  0, ANY_LEN, 0,                   NULL) \
+	H(INCOMPATIBLE_3P_APP,  0, ANY_LEN, 0,                   NULL) \
+	H(USER_FUCKER_STATUS,   0, ANY_LEN, 0,                   NULL) \
+	H(CLIENT_HELLO,         0, ANY_LEN, 0,                   NULL)
+
+/**
+ * Each packet type's slot in handlers[]
+ */
+enum {
+#define H(type, min_len, max_len, min_version, fn) SLOT_##type,
+	GENERAL_PACKETS(H)
+#undef H
+	NHANDLERS
+};
+
+static const struct pt_handler handlers[NHANDLERS] = {
+#define H(type, min_len, max_len, min_version, fn) \
+	{ PACKET_##type, min_len, max_len, min_version, fn, #type },
+	GENERAL_PACKETS(H)
+#undef H
+};
+
+/* Packets handled and dropped, by type */
+static unsigned long handled[NHANDLERS], rejected[NHANDLERS], unexpected;
+
+/**
+ * Each packet type's slot in handlers[] (plus one), so that dispatch is
+ * a single lookup.
+ */
+static const unsigned char handler_index[0x10000] = {
+#define H(type, min_len, max_len, min_version, fn) \
+	[PACKET_##type] = SLOT_##type + 1,
+	GENERAL_PACKETS(H)
+#undef H
+};
+
+/**
+ * Never called. A type listed twice in GENERAL_PACKETS would quietly
+ * override its first entry in handler_index[], but here it's a
+ * duplicate case label, which fails to build.
+ */
+static inline void check_packet_types(unsigned short type)
+{
+	switch (type) {
+#define H(type, min_len, max_len, min_version, fn) \
+	case PACKET_##type:
+	GENERAL_PACKETS(H)
+#undef H
 		break;
-	default:
+	}
+}
+
+/**
+ * Decode the big-endian value of \a n bytes at \a off, or 0 if the
+ * payload ends before then.
+ */
+static unsigned long get_be(const struct pt_packet *pkt, unsigned off, unsigned n)
+{
+	unsigned long v = 0;
+
+	if (pkt->length < off + n)
+		return 0;
+
+	while (n--)
+		v = (v << 8) | (pkt->data[off++] & 0xff);
+	return v;
+}
+
+void general_flow(struct pt_context *ctx)
+{
+	unsigned i;
+	struct pt_args a;
+	const struct pt_handler *h;
+	const struct pt_packet *pkt = &ctx->pkt_in;
+
+	if (!(i = handler_index[pkt->type])) {
+		unexpected++;
 		ERROR(("general: unexpected packet"));
 #ifdef NDEBUG
 		dump_packet(0, &ctx->pkt_in);
 #endif
+		return;
 	}
+
+	h = &handlers[--i];
+	if (pkt->length < h->min_len || pkt->length > h->max_len ||
+	    ctx->protocol_version < h->min_version) {
+		rejected[i]++;
+		WARN(("general: dropping %s (length %u, version %04x)",
+		     h->name, pkt->length, ctx->protocol_version));
+		return;
+	}
+
+	handled[i]++;
+	if (!h->fn)
+		return;
+
+	a.dw[0] = get_be(pkt, 0, 4);
+	a.dw[1] = get_be(pkt, 4, 4);
+	a.dw[2] = get_be(pkt, 8, 4);
+	a.w2    = (unsigned short)get_be(pkt, 4, 2);
+	h->fn(ctx, &a);
+}
+
+void general_print_stats(void)
+{
+	unsigned i;
+
+	for (i = 0; i < NHANDLERS; i++) {
+		if (handled[i] || rejected[i]) {
+			INFO(("general %-20s: %lu handled, %lu dropped",
+			     handlers[i].name, handled[i], rejected[i]));
+		}
+	}
+
+	INFO(("general: %lu unexpected packets", unexpected));
 }
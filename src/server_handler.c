@@ -11,7 +11,7 @@
 #include "server_handler.h"
 
 /* from server.c */
-extern struct ht *uid_to_context;
+extern struct uidmap *uid_to_context;
 
 // https://web.archive.org/web/20050501000000*/http://download.paltalk.com:80/download/0.x/pal_install.exe
 
@@ -51,6 +51,9 @@ void kick(struct pt_context *ctx, const char *msg, size_t len)
 	ctx->on_packet = NULL;
 	shutdown(ctx->fd, SHUT_RD);
 	send_packet(ctx, new_packet(PACKET_SERVER_DISCONNECT, len, msg, PACKET_F_COPY));
+
+	/* Don't wait forever for a client that won't read */
+	timer_add(&ctx->deadline, CONN_KICK_LINGER);
 }
 
 /**
@@ -83,6 +86,15 @@ void transition_to(struct pt_context *ctx, void (*flow)(struct pt_context *))
 	ctx->prev_on_packet = ctx->on_packet;
 	ctx->on_packet      = flow;
 
+	/**
+	 * The login deadline is armed once, at accept, and covers any
+	 * detours through registration or a password reset. Only logging
+	 * in stops it. After that, only pinging clients have a deadline
+	 * (see handle_ping().)
+	 */
+	if (flow == general_flow)
+		timer_del(&ctx->deadline);
+
 	if (flow == login_flow)          login_transition(ctx);
 	if (flow == password_reset_flow) password_reset_transition(ctx);
 	if (flow == registration_flow)   registration_transition(ctx);
@@ -62,4 +62,9 @@ void login_flow(struct pt_context *ctx);
 void password_reset_flow(struct pt_context *ctx);
 void registration_flow(struct pt_context *ctx);
 
+/**
+ * Log per-packet-type counts for the general flow (on SIGUSR1)
+ */
+void general_print_stats(void);
+
 #endif /* SERVER_HANDLER_H */
@@ -7,11 +7,13 @@
 #include "logging.h"
 #include "packet.h"
 #include "protocol.h"
+#include "proto_ops.h"
 #include "encode.h"
 #include "hash.h"
 #include "user.h"
 #include "devicelist.h"
 #include "server_handler.h"
+#include "uidmap.h"
 
 #define HELLO_LEN        18
 #define UNKNOWN_USER_LEN 12
@@ -23,7 +25,7 @@ static const char * const multi_login  = "You've logged in from another client,
 static const char * const bad_password = "The password you entered is incorrect.";
 
 /* from server.c */
-extern struct ht *uid_to_context;
+extern struct uidmap *uid_to_context;
 
 void login_transition(struct pt_context *ctx)
 {
@@ -37,6 +39,7 @@ void login_flow(struct pt_context *ctx)
 	unsigned pass_ok;
 	unsigned long uid = 0;
 	size_t len;
+	struct span in, f;
 
 	if (ctx->pkt_in.length >= 4) {
 		uid = ((ctx->pkt_in.data[0] & 0xff) << 24) |
@@ -52,7 +55,7 @@ void login_flow(struct pt_context *ctx)
 		 * 5.x sends GET_UID anyway and reconnects after UID_RESPONSE.
 		 */
 		ctx->uid = uid;
-		ctx->protocol_version = ctx->pkt_in.version;
+		set_protocol_version(ctx, ctx->pkt_in.version);
 		break;
 	case PACKET_CLIENT_HELLO:
 		send_packet(ctx, new_packet(PACKET_HELLO, HELLO_LEN, hello, PACKET_F_STATIC));
@@ -73,7 +76,7 @@ void login_flow(struct pt_context *ctx)
 		 *   0 - 3: 00 00 00 01
 		 *   4 - *: nickname
 		 */
-		ctx->protocol_version = ctx->pkt_in.version;
+		set_protocol_version(ctx, ctx->pkt_in.version);
 
 		/* Attempts to login as "newuser" trigger the registration flow */
 		if (ctx->pkt_in.length == 11 && !memcmp(ctx->pkt_in.data + 4, "newuser", 7))
@@ -121,7 +124,7 @@ void login_flow(struct pt_context *ctx)
 		if (ctx->pkt_in.type == PACKET_INITIAL_STATUS)
 			ctx->device_id = pt_decode_with_challenge(ctx, 1, ctx->uid % 0x37, ctx->pkt_in.data + 14);
 		ctx->uid = uid;
-		ctx->protocol_version = ctx->pkt_in.version;
+		set_protocol_version(ctx, ctx->pkt_in.version);
 
 		/* An error on INITIAL_STATUS causes 5.1 to exit (intentionally.) */
 		if (lookup_user(ctx->db_r, ctx->uid, &ctx->user)) {
@@ -214,7 +217,10 @@ void login_flow(struct pt_context *ctx)
 
 		/* Check the password */
 		pass_ok = 0;
-		if ((buf = pt_decode(ctx, 1, strtok(ctx->pkt_in.data + 4, "\n")))) {
+		in.p    = ctx->pkt_in.data + 4;
+		in.len  = ctx->pkt_in.length - 4;
+		span_next(&in, '\n', &f);
+		if ((buf = pt_decoden(ctx, 1, f.p, f.len))) {
 			pass_ok += user_check_password(ctx->db_r, ctx->uid, buf);
 			memset(buf, 0, strlen(buf));
 			free(buf);
@@ -232,7 +238,8 @@ void login_flow(struct pt_context *ctx)
 		 * in USER_DATA (since we only have a little endian "official"
 		 * client.)
 		 */
-		if ((buf = pt_decode(ctx, 2, strtok(NULL, "\n")))) {
+		span_next(&in, '\n', &f);
+		if ((buf = pt_decoden(ctx, 2, f.p, f.len))) {
 			ctx->server_ip = inet_addr(buf);
 			ctx->server_ip = ((ctx->server_ip << 24) & 0xff000000) |
 			                 ((ctx->server_ip << 8)  & 0x00ff0000) |
@@ -242,7 +249,8 @@ void login_flow(struct pt_context *ctx)
 		}
 
 		/* Check the question response if we have one */
-		if ((buf = pt_decode(ctx, 1, strtok(NULL, "\n")))) {
+		span_next(&in, '\n', &f);
+		if ((buf = pt_decoden(ctx, 1, f.p, f.len))) {
 			if (!user_check_question_response(ctx->db_r, ctx->uid, buf)) {
 				send_return_code(ctx, 0x63, bad_password, BAD_PASSWORD_LEN);
 				free(buf);
@@ -251,15 +259,15 @@ void login_flow(struct pt_context *ctx)
 
 			/* Add this device to the user's device list */
 			free(buf);
-			if ((buf = strtok(NULL, "\n")) && !strcmp(buf, "add"))
+			if (span_next(&in, '\n', &f) && span_eq(&f, "add"))
 				device_add(ctx);
 		}
 
 		/* Success */
 		device_inc_logins(ctx);
 		sprintf(ctx->uid_str, "%lu", ctx->uid);
-		kick(ht_get_ptr_nc(uid_to_context, ctx->uid_str), multi_login, MULTI_LOGIN_LEN);
-		ht_set(uid_to_context, ctx->uid_str, HT_PTR, ctx);
+		kick(uidmap_get(uid_to_context, ctx->uid), multi_login, MULTI_LOGIN_LEN);
+		uidmap_set(uid_to_context, ctx->uid, ctx);
 		send_packet(ctx, new_packet(PACKET_LOGIN_SUCCESS, 0, NULL, 0));
 		user_logged_in(ctx->db_w, ctx->uid);
 		break;
@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "logging.h"
 #include "packet.h"
 #include "protocol.h"
 #include "encode.h"
+#include "database.h"
 #include "server_handler.h"
 #include "user.h"
 
@@ -22,7 +24,8 @@ void password_reset_transition(struct pt_context *ctx)
 void password_reset_flow(struct pt_context *ctx)
 {
 	unsigned short q;
-	char *old_pw, *new_pw;
+	char *old_pw = NULL, *new_pw = NULL;
+	struct span in, f;
 
 	switch (ctx->pkt_in.type) {
 	case PACKET_NEW_PASSWORD:
@@ -33,8 +36,12 @@ void password_reset_flow(struct pt_context *ctx)
 		 *  * - *: \n
 		 *  * - *: new password (v1 encoded / 0 challenge value)
 		 */
-		old_pw = pt_decode(ctx, 1, strtok(ctx->pkt_in.data + 4, "\n"));
-		new_pw = pt_decode_with_challenge(ctx, 1, 0, strtok(NULL, "\n"));
+		in.p   = ctx->pkt_in.data + 4;
+		in.len = ctx->pkt_in.length > 4 ? ctx->pkt_in.length - 4 : 0;
+		span_next(&in, '\n', &f);
+		old_pw = pt_decoden(ctx, 1, f.p, f.len);
+		span_next(&in, '\n', &f);
+		new_pw = pt_decoden_with_challenge(ctx, 1, 0, f.p, f.len);
 		if (!old_pw || !new_pw) {
 			ERROR(("new_password: Failed to decode password"));
 			send_return_code(ctx, -1, incorrect_pw, INCORRECT_PW_LEN);
@@ -47,6 +54,7 @@ void password_reset_flow(struct pt_context *ctx)
 		}
 
 		user_set_password(ctx->db_w, ctx->uid, new_pw);
+		db_sync(ctx->db_w, NULL, NULL);
 		send_return_code(ctx, 0, NULL, 0);
 		break;
 	case PACKET_PASSWORD_HINT:
@@ -60,12 +68,20 @@ void password_reset_flow(struct pt_context *ctx)
 		 *   0 - 3: 00 00 0a
 		 *   4 - *: Password hint text
 		 */
+		if (ctx->pkt_in.length < 2)
+			break;
+
 		q      = ntohs(*(unsigned short *)ctx->pkt_in.data);
-		old_pw = strtok(ctx->pkt_in.data + 2, "\n");
-		new_pw = strtok(NULL, "\n");
+		in.p   = ctx->pkt_in.data + 2;
+		in.len = ctx->pkt_in.length - 2;
+		span_next(&in, '\n', &f);
+		old_pw = span_dup(&f);
+		span_next(&in, '\n', &f);
+		new_pw = span_dup(&f);
 
 		user_set_secret_question(ctx->db_w, ctx->uid, q, old_pw);
 		user_set_password_hint(ctx->db_w, ctx->uid, new_pw);
+		db_sync(ctx->db_w, NULL, NULL);
 		transition_fro(ctx);
 		break;
 	default:
@@ -74,5 +90,8 @@ void password_reset_flow(struct pt_context *ctx)
 		dump_packet(0, &ctx->pkt_in);
 #endif
 	}
+
+	free(old_pw);
+	free(new_pw);
 }
 
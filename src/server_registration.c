@@ -1,13 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "logging.h"
 #include "packet.h"
 #include "protocol.h"
+#include "proto_ops.h"
 #include "encode.h"
+#include "database.h"
 #include "server_handler.h"
 #include "user.h"
 
@@ -28,11 +31,138 @@ static const int field_encoded[] = {
 	2, 2, 2, 0, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
+/**
+ * What we need to finish a registration once the new user has been
+ * committed.
+ */
+struct pending_reg {
+	unsigned handle;   /**< Connection handle       */
+	void *db_w;        /**< Database writer         */
+	int pt5;           /**< PT 5 style registration */
+	unsigned long uid; /**< The new user's uid      */
+	char *pw;          /**< Decoded password        */
+	unsigned id;       /**< Secret question id      */
+	char *q;           /**< Secret question response */
+};
+
+static void free_pending_reg(struct pending_reg *reg)
+{
+	free(reg->pw);
+	free(reg->q);
+	free(reg);
+}
+
+/**
+ * PT 5: The password is set, tell the client its uid
+ */
+static void pt5_registration_done(void *userdata, int ok, long long rowid)
+{
+	char buf[8];
+	struct pt_context *ctx;
+	struct pending_reg *reg = userdata;
+	(void)ok;
+	(void)rowid;
+
+	if (!(ctx = conn_get(reg->handle)))
+		goto ret;
+
+	/* PT 5 will reply with the password hint */
+	ctx->uid         = reg->uid;
+	ctx->on_packet   = password_reset_flow;
+	ctx->pkt_in.type = PACKET_PT5_REGISTRATION;
+	buf[0] = (ctx->uid >> 24) & 0xff;
+	buf[1] = (ctx->uid >> 16) & 0xff;
+	buf[2] = (ctx->uid >> 8)  & 0xff;
+	buf[3] = ctx->uid & 0xff;
+	send_return_code(ctx, 0, buf, 4);
+
+	/* Prompt to send LOGIN just like PT 7/8 */
+	buf[0] = '0' + rand() % 10;
+	buf[1] = '0' + rand() % 10;
+	buf[2] = '0' + rand() % 10;
+	buf[3] = '0' + rand() % 10;
+	ctx->challenge = 1 + (rand() % CHALLENGE_MAX);
+	ustoa((unsigned char *)(buf + 4), ctx->challenge + 0x01fd, 3);
+	send_packet(ctx, new_packet(PACKET_PT5_SEND_LOGIN, 7, buf, PACKET_F_COPY));
+
+ret:
+	free_pending_reg(reg);
+}
+
+/**
+ * PT 7+: The password and secret question are set, tell the client
+ * its uid
+ */
+static void registration_done(void *userdata, int ok, long long rowid)
+{
+	char buf[4];
+	struct pt_context *ctx;
+	struct pending_reg *reg = userdata;
+	(void)ok;
+	(void)rowid;
+
+	if (!(ctx = conn_get(reg->handle)))
+		goto ret;
+
+	ctx->user.uid = reg->uid;
+	buf[0] = (reg->uid >> 24) & 0xff;
+	buf[1] = (reg->uid >> 16) & 0xff;
+	buf[2] = (reg->uid >> 8)  & 0xff;
+	buf[3] = reg->uid & 0xff;
+	send_packet(ctx, new_packet(PACKET_REGISTRATION_SUCCESS, 4, buf, PACKET_F_COPY));
+
+	if (ctx->protocol_version < PROTOCOL_VERSION_82)
+		transition_fro(ctx);
+
+ret:
+	free_pending_reg(reg);
+}
+
+/**
+ * The new user has been committed (or not.) Set the password, and
+ * reply once that's committed too, so that the client can log in.
+ */
+static void user_registered(void *userdata, int ok, long long rowid)
+{
+	struct pt_context *ctx;
+	struct pending_reg *reg = userdata;
+
+	if (!ok || rowid <= 0) {
+		if (!(ctx = conn_get(reg->handle)))
+			goto err;
+
+		if (reg->pt5) {
+			ctx->pkt_in.type = PACKET_PT5_REGISTRATION;
+			send_return_code(ctx, 2, registration_failed, REGISTRATION_FAILED_LEN);
+		} else send_packet(ctx, new_packet(PACKET_REGISTRATION_FAILED, 0, NULL, 0));
+		goto err;
+	}
+
+	/**
+	 * The user row is committed, so finish the account even if the
+	 * client has gone away. Otherwise the nickname's taken, but can
+	 * never log in. The *_done() callbacks skip the reply if so.
+	 */
+	reg->uid = (unsigned long)rowid;
+	user_set_password(reg->db_w, reg->uid, reg->pw);
+	if (reg->pt5) {
+		if (!db_sync(reg->db_w, pt5_registration_done, reg))
+			return;
+	} else {
+		user_set_secret_question(reg->db_w, reg->uid, reg->id, reg->q);
+		if (!db_sync(reg->db_w, registration_done, reg))
+			return;
+	}
+
+err:
+	free_pending_reg(reg);
+}
+
 void registration_transition(struct pt_context *ctx)
 {
 	char buf[32];
 
-	ctx->protocol_version = ctx->pkt_in.version;
+	set_protocol_version(ctx, ctx->pkt_in.version);
 	if (ctx->pkt_in.version < PROTOCOL_VERSION_70) {
 		if (ctx->pkt_in.version != PROTOCOL_VERSION_51) {
 			WARN(("Registration hasn't been tested with version 0x%04x",
@@ -76,7 +206,9 @@ void registration_flow(struct pt_context *ctx)
 {
 	int i;
 	unsigned id = 0;
-	char buf[8], *s, *dec, *q = NULL;
+	char *s, *dec, *q = NULL;
+	struct span in, f, k;
+	struct pending_reg *reg;
 
 	switch (ctx->pkt_in.type) {
 	case PACKET_PT5_REGISTRATION:
@@ -111,7 +243,7 @@ void registration_flow(struct pt_context *ctx)
 		 *   FAILED      is acheived with send_return_code(ctx, non-zero, "Message")
 		 *   SUCCESS     is acheived with send_return_code(ctx, 0, uid);
 		 */
-		each_field_kv(ctx->pkt_in.data, &ctx->user, user_from_named_field);
+		each_field_kv(ctx->pkt_in.data, ctx->pkt_in.length, &ctx->user, user_from_field);
 		ctx->user.banners = 0;
 		ctx->user.random  = 1;
 
@@ -138,7 +270,7 @@ void registration_flow(struct pt_context *ctx)
 			break;
 		}
 
-		if (!ctx->user.nickname || register_user(ctx->db_w, &ctx->user)) {
+		if (!ctx->user.nickname) {
 			send_return_code(ctx, 2, registration_failed, REGISTRATION_FAILED_LEN);
 			break;
 		}
@@ -148,26 +280,18 @@ void registration_flow(struct pt_context *ctx)
 			break;
 		}
 
-		ctx->uid = ctx->user.uid;
-		user_set_password(ctx->db_w, ctx->uid, dec);
-		free(dec);
-
-		/* PT 5 will reply with the password hint */
-		ctx->on_packet = password_reset_flow;
-		buf[0] = (ctx->uid >> 24) & 0xff;
-		buf[1] = (ctx->uid >> 16) & 0xff;
-		buf[2] = (ctx->uid >> 8)  & 0xff;
-		buf[3] = ctx->uid & 0xff;
-		send_return_code(ctx, 0, buf, 4);
-
-		/* Prompt to send LOGIN just like PT 7/8 */
-		buf[0] = '0' + rand() % 10;
-		buf[1] = '0' + rand() % 10;
-		buf[2] = '0' + rand() % 10;
-		buf[3] = '0' + rand() % 10;
-		ctx->challenge = 1 + (rand() % CHALLENGE_MAX);
-		ustoa((unsigned char *)(buf + 4), ctx->challenge + 0x01fd, 3);
-		send_packet(ctx, new_packet(PACKET_PT5_SEND_LOGIN, 7, buf, PACKET_F_COPY));
+		/* The rest happens in user_registered() */
+		if (!(reg = calloc(1, sizeof *reg)))
+			abort();
+
+		reg->handle = ctx->handle;
+		reg->db_w   = ctx->db_w;
+		reg->pt5    = 1;
+		reg->pw     = dec;
+		if (register_user(ctx->db_w, &ctx->user, user_registered, reg)) {
+			free_pending_reg(reg);
+			send_return_code(ctx, 2, registration_failed, REGISTRATION_FAILED_LEN);
+		}
 		break;
 	case PACKET_REGISTRATION_CHALLENGE:
 		/**
@@ -216,27 +340,32 @@ void registration_flow(struct pt_context *ctx)
 		 *  PACKET_REGISTRATION_NAME_IN_USE
 		 *  	n bytes: suggested nick
 		 */
-		i = -1;
-		if ((s = strtok(ctx->pkt_in.data, "\n"))) {
-			do {
-				/* Grab the question and response while we're in here */
-				if (i == 2) id = atoi(s);
-				if (i == 3) q  = pt_decode(ctx, field_encoded[i + 1], s);
-
-				/* noname == ignore */
-				if (!field_names[++i])
-					continue;
-
-				if (field_encoded[i]) {
-					if (!(dec = pt_decode(ctx, field_encoded[i], s))) {
-						ERROR(("Failed to decode %s", field_names[i]));
-						break;
-					}
-
-					user_from_named_field(&ctx->user, field_names[i], dec);
-					free(dec);
-				} else user_from_named_field(&ctx->user, field_names[i], s);
-			} while ((s = strtok(NULL, "\n")));
+		i      = -1;
+		in.p   = ctx->pkt_in.data;
+		in.len = ctx->pkt_in.length;
+		while (i + 1 < (int)(sizeof field_names / sizeof *field_names) &&
+		       span_next(&in, '\n', &f)) {
+			/* Grab the question and response while we're in here */
+			if (i == 2) id = (unsigned)span_tol(&f);
+			if (i == 3) q  = pt_decoden(ctx, field_encoded[i + 1], f.p, f.len);
+
+			/* noname == ignore, and so is an empty field */
+			if (!field_names[++i] || !f.len)
+				continue;
+
+			if (field_encoded[i]) {
+				if (!(dec = pt_decoden(ctx, field_encoded[i], f.p, f.len))) {
+					ERROR(("Failed to decode %s", field_names[i]));
+					break;
+				}
+
+				user_from_named_field(&ctx->user, field_names[i], dec);
+				free(dec);
+			} else {
+				k.p   = field_names[i];
+				k.len = strlen(k.p);
+				user_from_field(&ctx->user, &k, &f);
+			}
 		}
 
 		if (nickname_in_use(ctx->db_r, ctx->user.nickname)) {
@@ -249,24 +378,24 @@ void registration_flow(struct pt_context *ctx)
 			break;
 		}
 
-		if (!ctx->user.nickname || !ctx->user.password || register_user(ctx->db_w, &ctx->user)) {
+		if (!ctx->user.nickname || !ctx->user.password) {
 			free(q);
 			send_packet(ctx, new_packet(PACKET_REGISTRATION_FAILED, 0, NULL, 0));
 			break;
 		}
 
-		/* Reply with the uid */
-		user_set_password(ctx->db_w, ctx->user.uid, ctx->user.password);
-		user_set_secret_question(ctx->db_w, ctx->user.uid, id, q);
-		buf[0] = (ctx->user.uid >> 24) & 0xff;
-		buf[1] = (ctx->user.uid >> 16) & 0xff;
-		buf[2] = (ctx->user.uid >> 8)  & 0xff;
-		buf[3] = ctx->user.uid & 0xff;
-		send_packet(ctx, new_packet(PACKET_REGISTRATION_SUCCESS, 4, buf, PACKET_F_COPY));
-		free(q);
-
-		if (ctx->pkt_in.version < PROTOCOL_VERSION_82)
-			transition_fro(ctx);
+		/* The rest happens in user_registered() */
+		if (!(reg = calloc(1, sizeof *reg)) || !(reg->pw = strdup(ctx->user.password)))
+			abort();
+
+		reg->handle = ctx->handle;
+		reg->db_w   = ctx->db_w;
+		reg->id     = id;
+		reg->q      = q;
+		if (register_user(ctx->db_w, &ctx->user, user_registered, reg)) {
+			free_pending_reg(reg);
+			send_packet(ctx, new_packet(PACKET_REGISTRATION_FAILED, 0, NULL, 0));
+		}
 		break;
 	case PACKET_REGISTRATION_ADINFO:
 		/* [PT8] Advertising related info:
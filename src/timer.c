@@ -0,0 +1,186 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stddef.h>
+#include <time.h>
+
+#include "timer.h"
+
+#define TIMER_MASK  (TIMER_SLOTS - 1)
+
+/**
+ * Furthest a timer can be scheduled ahead (in ticks.) Anything beyond
+ * this is clamped to it. At 100ms per tick, that's about 19 days.
+ */
+#define TIMER_MAX_DELTA ((1UL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+static struct timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static unsigned long tick;    /**< Next tick to be run       */
+static unsigned long pending; /**< Number of pending timers  */
+static long base;             /**< Time of tick 0 (ms)       */
+
+/**
+ * Monotonic time in milliseconds
+ */
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+ * Put a timer in the slot for its expiry, at the lowest level whose
+ * range covers it.
+ */
+static void link_timer(struct timer *t)
+{
+	unsigned level = 0;
+	unsigned long delta;
+	struct timer **slot;
+
+	if (t->expires < tick)
+		t->expires = tick;
+
+	if ((delta = t->expires - tick) > TIMER_MAX_DELTA) {
+		delta      = TIMER_MAX_DELTA;
+		t->expires = tick + delta;
+	}
+
+	while (delta >> (TIMER_BITS * (level + 1)))
+		level++;
+
+	slot = &wheel[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+	if ((t->next = *slot))
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot    = t;
+}
+
+static void unlink_timer(struct timer *t)
+{
+	if (t->next)
+		t->next->pprev = t->pprev;
+	*t->pprev = t->next;
+	t->next   = NULL;
+	t->pprev  = NULL;
+}
+
+/**
+ * Move the timers in a higher level slot down, now that they're
+ * within range of the levels below.
+ */
+static void cascade(unsigned level, unsigned idx)
+{
+	struct timer *t, *next;
+
+	t = wheel[level][idx];
+	wheel[level][idx] = NULL;
+	for (; t; t = next) {
+		next = t->next;
+		link_timer(t);
+	}
+}
+
+void timer_init(struct timer *t, void (*fn)(void *), void *arg)
+{
+	t->next    = NULL;
+	t->pprev   = NULL;
+	t->expires = 0;
+	t->fn      = fn;
+	t->arg     = arg;
+}
+
+void timer_add(struct timer *t, unsigned long ms)
+{
+	if (t->pprev)
+		unlink_timer(t);
+	else pending++;
+
+	t->expires = tick + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	link_timer(t);
+}
+
+void timer_del(struct timer *t)
+{
+	if (!t->pprev)
+		return;
+
+	unlink_timer(t);
+	pending--;
+}
+
+int timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+void timers_init(void)
+{
+	base = now_ms();
+	tick = 0;
+}
+
+int timers_run(void)
+{
+	int fired = 0;
+	unsigned level, idx;
+	unsigned long now = (unsigned long)(now_ms() - base) / TIMER_TICK_MS;
+	struct timer *t, *expired;
+
+	while (tick <= now && pending) {
+		idx = tick & TIMER_MASK;
+		for (level = 1; !idx && level < TIMER_LEVELS; level++) {
+			idx = (tick >> (TIMER_BITS * level)) & TIMER_MASK;
+			cascade(level, idx);
+		}
+
+		/**
+		 * Take this tick's timers off the wheel, so that anything
+		 * the callbacks add goes into a later slot.
+		 */
+		if ((expired = wheel[0][tick & TIMER_MASK]))
+			expired->pprev = &expired;
+		wheel[0][tick & TIMER_MASK] = NULL;
+		tick++;
+
+		while ((t = expired)) {
+			unlink_timer(t);
+			pending--;
+			fired++;
+			t->fn(t->arg);
+		}
+	}
+
+	/* Nothing's pending, so skip ahead */
+	if (tick <= now)
+		tick = now + 1;
+	return fired;
+}
+
+int timers_next(void)
+{
+	unsigned long i;
+	long ms;
+
+	if (!pending)
+		return -1;
+
+	/**
+	 * Find the next tick with something due, or the next point at
+	 * which timers will be moved down from the levels above.
+	 */
+	for (i = 0; i < TIMER_SLOTS - 1; i++) {
+		if (!((tick + i) & TIMER_MASK) || wheel[0][(tick + i) & TIMER_MASK])
+			break;
+	}
+
+	ms = base + (long)(tick + i) * TIMER_TICK_MS - now_ms();
+	return (ms < 0) ? 0 : (int)ms;
+}
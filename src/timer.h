@@ -0,0 +1,83 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef TIMER_H
+#define TIMER_H
+
+/**
+ * Hierarchical timer wheel
+ *
+ * Time is divided into ticks of TIMER_TICK_MS. The wheel has
+ * TIMER_LEVELS levels of TIMER_SLOTS slots each: level 0 holds timers
+ * due within TIMER_SLOTS ticks, one slot per tick, and each level above
+ * it covers TIMER_SLOTS times the span of the one below. As the wheel
+ * turns, the timers in a higher level slot are moved down a level once
+ * they come within its range.
+ *
+ * Adding and removing a timer are O(1), and a timer is moved down at
+ * most TIMER_LEVELS - 1 times before it expires. Timers fire no earlier
+ * than requested, and at most two ticks late.
+ *
+ * Timers are intended to be embedded in the object they're for, and
+ * there's one wheel, driven by the event loop.
+ */
+
+#define TIMER_TICK_MS 100
+#define TIMER_BITS    6
+#define TIMER_SLOTS   (1 << TIMER_BITS)
+#define TIMER_LEVELS  4
+
+struct timer {
+	struct timer *next;     /**< Next timer in the slot          */
+	struct timer **pprev;   /**< Link to this timer, or NULL     */
+	unsigned long expires;  /**< Tick on which this timer is due */
+	void (*fn)(void *);     /**< Callback                        */
+	void *arg;              /**< Callback argument               */
+};
+
+/**
+ * Set up a timer's callback. The timer isn't pending until it's added.
+ */
+void timer_init(struct timer *t, void (*fn)(void *), void *arg);
+
+/**
+ * (Re)start a timer, to fire once \a ms milliseconds have passed.
+ */
+void timer_add(struct timer *t, unsigned long ms);
+
+/**
+ * Stop a timer, if it's pending
+ */
+void timer_del(struct timer *t);
+
+/**
+ * Non-zero if the timer is pending
+ */
+int timer_pending(const struct timer *t);
+
+/**
+ * Start the wheel's clock
+ */
+void timers_init(void);
+
+/**
+ * Fire any timers that have come due. A callback may add or remove
+ * any timer, including its own.
+ *
+ * \return the number of timers that fired.
+ */
+int timers_run(void);
+
+/**
+ * Number of milliseconds until the wheel next needs to be run, for
+ * use as the event loop's timeout.
+ *
+ * \return the timeout, or -1 if there are no pending timers.
+ */
+int timers_next(void);
+
+#endif /* TIMER_H */
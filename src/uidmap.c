@@ -0,0 +1,328 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "hash.h"
+#include "uidmap.h"
+
+/**
+ * Minimum table size (a power of 2)
+ */
+#define UIDMAP_MIN_BITS 6
+
+/**
+ * The map grows once it's half full, and shrinks once it's less than
+ * an eighth full, so that churn around either threshold doesn't cause
+ * it to repeatedly resize. Both count the entries still in the old
+ * table during a resize.
+ */
+#define UIDMAP_SIZE(M)   ((M)->t.size + (M)->old.size)
+#define UIDMAP_GROW(M)   ((UIDMAP_SIZE(M) + 1) * 2 > (M)->t.mask + 1)
+#define UIDMAP_SHRINK(M) (UIDMAP_SIZE(M) * 8 < (M)->t.mask + 1 && (M)->t.bits > UIDMAP_MIN_BITS)
+
+/**
+ * Number of old slots migrated to the new table on each uidmap_set() /
+ * uidmap_rm() during a resize.
+ *
+ * A grow leaves the map a quarter full, and a shrink leaves it less
+ * than a quarter full, so it takes at least capacity / 8 calls to reach
+ * either threshold again. By then, capacity * 2 old slots have been
+ * migrated, which is as many as the old table can have.
+ */
+#define UIDMAP_REHASH_STEP 16
+
+struct uidmap_slot {
+	uint32_t id; /**< Id, or 0 if empty */
+	void *val;
+};
+
+/**
+ * Table of slots
+ */
+struct table {
+	struct uidmap_slot *s; /**< Slots                    */
+	size_t size;           /**< Number of entries        */
+	uint32_t mask;         /**< Table size - 1           */
+	unsigned bits;         /**< log2(table size)         */
+};
+
+/**
+ * Resizing allocates a new table, and the entries in the old table are
+ * migrated a few slots at a time, so that no single login or logout
+ * has to rehash every online user. Until that's done, lookups check
+ * both tables. An id is only ever in one of them.
+ */
+struct uidmap {
+	struct table t;        /**< Current table            */
+	struct table old;      /**< Table being migrated     */
+	uint32_t migrate;      /**< Next slot to migrate     */
+	uint32_t max_pd;       /**< Max probe depth in t     */
+	unsigned long resizes; /**< Number of resizes        */
+	unsigned long rs_ns;   /**< Time spent resizing (ns) */
+};
+
+/**
+ * Fibonacci hashing: multiply by 2^32 / phi, and take the top bits,
+ * which spreads runs of sequential ids across the table.
+ */
+static uint32_t home(const struct table *t, uint32_t id)
+{
+	return (uint32_t)(id * UINT32_C(0x9e3779b9)) >> (32 - t->bits);
+}
+
+/**
+ * Number of probes needed to find the entry in slot \a i
+ */
+static uint32_t probes(const struct table *t, uint32_t i)
+{
+	return ((i - home(t, t->s[i].id)) & t->mask) + 1;
+}
+
+/**
+ * Find the slot holding \a id, or the empty slot that ends its chain
+ */
+static uint32_t find(const struct table *t, uint32_t id)
+{
+	uint32_t i;
+
+	for (i = home(t, id); t->s[i].id && t->s[i].id != id; i = (i + 1) & t->mask);
+	return i;
+}
+
+/**
+ * Empty slot \a i, shifting back any following entries that can't be
+ * reached from their home slot without passing through it.
+ *
+ * Entries only ever move back, towards the hole, so during a migration
+ * nothing can move into the old slots that have already been drained.
+ */
+static void remove_at(struct table *t, uint32_t i)
+{
+	uint32_t j, k;
+
+	for (j = i;;) {
+		j = (j + 1) & t->mask;
+		if (!t->s[j].id)
+			break;
+
+		k = home(t, t->s[j].id);
+		if ((j > i) ? (k <= i || k > j) : (k <= i && k > j)) {
+			t->s[i] = t->s[j];
+			i = j;
+		}
+	}
+
+	t->s[i].id  = 0;
+	t->s[i].val = NULL;
+	--t->size;
+}
+
+/**
+ * Add an entry that isn't in the map
+ */
+static void insert(struct uidmap *m, uint32_t id, void *val)
+{
+	uint32_t i = find(&m->t, id);
+
+	m->t.s[i].id  = id;
+	m->t.s[i].val = val;
+	++m->t.size;
+	if (probes(&m->t, i) > m->max_pd)
+		m->max_pd = probes(&m->t, i);
+}
+
+static unsigned long elapsed_ns(const struct timespec *start)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)((ts.tv_sec - start->tv_sec) * 1000000000L +
+	                       (ts.tv_nsec - start->tv_nsec));
+}
+
+/**
+ * Move up to \a n slots' worth of entries from the old table into the
+ * current one, freeing the old table once it's empty.
+ *
+ * Every slot before m->migrate is empty. Removing an entry can shift a
+ * later one back into its slot, so the slot is looked at again.
+ */
+static void migrate(struct uidmap *m, uint32_t n)
+{
+	struct uidmap_slot *s;
+	struct timespec start;
+
+	if (!m->old.s)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (m->old.s && n) {
+		s = &m->old.s[m->migrate];
+		if (s->id) {
+			insert(m, s->id, s->val);
+			remove_at(&m->old, m->migrate);
+			continue;
+		}
+
+		--n;
+		if (m->migrate++ == m->old.mask) {
+			free(m->old.s);
+			memset(&m->old, 0, sizeof m->old);
+			m->migrate = 0;
+		}
+	}
+
+	m->rs_ns += elapsed_ns(&start);
+}
+
+/**
+ * Start migrating to a new table of 2^bits slots
+ */
+static void resize(struct uidmap *m, unsigned bits)
+{
+	struct timespec start;
+
+	/* Finish any migration that's already in progress */
+	migrate(m, UINT32_MAX);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m->old = m->t;
+	if (!(m->t.s = calloc((size_t)1 << bits, sizeof *m->t.s)))
+		abort();
+
+	m->t.size  = 0;
+	m->t.bits  = bits;
+	m->t.mask  = ((uint32_t)1 << bits) - 1;
+	m->max_pd  = 0;
+	m->migrate = 0;
+
+	if (m->old.s) {
+		m->resizes++;
+		m->rs_ns += elapsed_ns(&start);
+	}
+}
+
+struct uidmap *uidmap_alloc(void)
+{
+	struct uidmap *m;
+
+	if (!(m = calloc(1, sizeof *m)))
+		abort();
+
+	resize(m, UIDMAP_MIN_BITS);
+	return m;
+}
+
+void *uidmap_get(struct uidmap *m, unsigned long id)
+{
+	uint32_t i;
+
+	if (!m || !id || id > UINT32_MAX)
+		return NULL;
+
+	if (m->t.s[i = find(&m->t, (uint32_t)id)].id)
+		return m->t.s[i].val;
+
+	if (m->old.s && m->old.s[i = find(&m->old, (uint32_t)id)].id)
+		return m->old.s[i].val;
+
+	return NULL;
+}
+
+int uidmap_set(struct uidmap *m, unsigned long id, void *val)
+{
+	uint32_t i;
+
+	if (!m || !id || id > UINT32_MAX || !val)
+		return EINVAL;
+
+	migrate(m, UIDMAP_REHASH_STEP);
+	if (m->t.s[i = find(&m->t, (uint32_t)id)].id) {
+		m->t.s[i].val = val;
+		return 0;
+	}
+
+	if (m->old.s && m->old.s[i = find(&m->old, (uint32_t)id)].id) {
+		m->old.s[i].val = val;
+		return 0;
+	}
+
+	if (UIDMAP_GROW(m))
+		resize(m, m->t.bits + 1);
+
+	insert(m, (uint32_t)id, val);
+	return 0;
+}
+
+void uidmap_rm(struct uidmap *m, unsigned long id, void *val)
+{
+	uint32_t i;
+
+	if (!m || !id || id > UINT32_MAX)
+		return;
+
+	migrate(m, UIDMAP_REHASH_STEP);
+	if (m->t.s[i = find(&m->t, (uint32_t)id)].id) {
+		if (m->t.s[i].val != val)
+			return;
+		remove_at(&m->t, i);
+	} else if (m->old.s && m->old.s[i = find(&m->old, (uint32_t)id)].id) {
+		if (m->old.s[i].val != val)
+			return;
+		remove_at(&m->old, i);
+	} else return;
+
+	if (UIDMAP_SHRINK(m))
+		resize(m, m->t.bits - 1);
+}
+
+size_t uidmap_size(struct uidmap *m)
+{
+	return m ? UIDMAP_SIZE(m) : 0;
+}
+
+static void table_stats(const struct table *t, struct ht_stats *st)
+{
+	uint32_t i, n;
+
+	for (i = 0; t->s && i <= t->mask; i++) {
+		if (!t->s[i].id)
+			continue;
+
+		n = probes(t, i);
+		st->probes[((n < HT_PROBE_HIST) ? n : HT_PROBE_HIST) - 1]++;
+	}
+}
+
+void uidmap_stats(struct uidmap *m, struct ht_stats *st)
+{
+	memset(st, 0, sizeof *st);
+	if (!m) return;
+
+	table_stats(&m->t, st);
+	table_stats(&m->old, st);
+	st->size      = UIDMAP_SIZE(m);
+	st->capacity  = (unsigned long)m->t.mask + 1;
+	st->migrating = m->old.size;
+	st->max_pd    = m->max_pd;
+	st->resizes   = m->resizes;
+	st->resize_ns = m->rs_ns;
+}
+
+void uidmap_free(struct uidmap *m)
+{
+	if (!m) return;
+	free(m->old.s);
+	free(m->t.s);
+	free(m);
+}
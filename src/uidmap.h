@@ -0,0 +1,77 @@
+/**
+ * ptserver - A server for the Paltalk protocol
+ * Copyright (C) 2004 - 2024 Tim Hentenaar.
+ *
+ * This code is licensed under the Simplified BSD License.
+ * See the LICENSE file for details.
+ */
+#ifndef UIDMAP_H
+#define UIDMAP_H
+
+#include <stddef.h>
+
+/**
+ * Map of 32-bit ids to pointers: uid -> context for logged in users,
+ * and room id -> room for occupied rooms.
+ *
+ * This is an open-addressed table with linear probing, keyed directly
+ * by the id, with the pointer stored inline. Removals shift the
+ * following entries back, rather than leaving tombstones, so lookups
+ * never have to probe past a removed entry.
+ *
+ * Growing or shrinking the table is done incrementally, a few slots
+ * per uidmap_set() / uidmap_rm(), so a login never waits on a rehash
+ * of every online user.
+ *
+ * Id 0 is used to mark empty slots, and can't be stored.
+ */
+
+struct ht_stats;
+struct uidmap;
+
+/**
+ * Allocate an empty map
+ *
+ * \return the map (aborts on out-of-memory.)
+ */
+struct uidmap *uidmap_alloc(void);
+
+/**
+ * Get the pointer for an id
+ *
+ * \return the pointer, or NULL if there's none (i.e. the user isn't
+ *         logged in.)
+ */
+void *uidmap_get(struct uidmap *m, unsigned long id);
+
+/**
+ * Add or replace the pointer for an id
+ *
+ * \return 0 on success, EINVAL on invalid args (including ids that
+ *         don't fit in 32 bits.)
+ */
+int uidmap_set(struct uidmap *m, unsigned long id, void *val);
+
+/**
+ * Remove the entry for an id, but only if it maps to \a val, so that
+ * a connection that's been replaced (i.e. by a login elsewhere) won't
+ * remove its replacement.
+ */
+void uidmap_rm(struct uidmap *m, unsigned long id, void *val);
+
+/**
+ * Number of entries in the map
+ */
+size_t uidmap_size(struct uidmap *m);
+
+/**
+ * Get the map's statistics (as with ht_stats(), this is O(capacity).)
+ */
+void uidmap_stats(struct uidmap *m, struct ht_stats *st);
+
+/**
+ * Destroy a map
+ */
+void uidmap_free(struct uidmap *m);
+
+#endif /* UIDMAP_H */
@@ -7,21 +7,9 @@
 #include "database.h"
 #include "logging.h"
 #include "protocol.h"
+#include "proto_ops.h"
 #include "user.h"
 
-/**
- * Write prepared statement handles
- *
- * We only need prepare these once as we only have one write
- * connection.
- */
-static void *set_pw;
-static void *set_pw_hint;
-static void *set_secret_q;
-static void *insert_user;
-static void *logged_in;
-static void *set_privacy;
-
 static int user_from_row(void *userdata, int cols, char *val[], char *col[])
 {
 	int i;
@@ -33,32 +21,29 @@ static int user_from_row(void *userdata, int cols, char *val[], char *col[])
 
 /**
  * Convert a user struct to a protocol record
- * \param version Target protocol version
+ * \param ops Target protocol's ops
  */
-char *user_to_record(struct user *user, unsigned short version)
+void user_to_record(struct strbuf *sb, struct user *user, const struct pt_proto_ops *ops)
 {
-	char *s;
 	char buf[32];
 
 	sprintf(buf, "%ld", user->uid);
-	s = append_field(NULL, "first", user->first);
-	s = append_field(s, "last", user->last);
-	s = append_field(s, "nickname", user->nickname);
-	s = append_field(s, "email", user->email);
-	s = append_field(s, "uid", buf);
-	s = append_field(s, "admin", user->admin ? "1" : "0");
-	s = append_field(s, "banners", user->banners ? "yes" : "no");
-	s = append_field(s, "get_offers_from_us", user->get_offers_from_us ? "Y" : "N");
-	s = append_field(s, "get_offers_from_affiliates", user->get_offers_from_affiliates ? "Y" : "N");
-	s = append_field(s, "random", user->random ? "Y" : "N");
-	s = append_field(s, "verified", user->verified ? "Y" : "N");
-	s = append_field(s, "privacy", user->privacy);
-
-	if (user->paid1 && *user->paid1 == 'E' && version < PROTOCOL_VERSION_80)
-		s = append_field(s, "paid1", "6");
-	else s = append_field(s, "paid1", user->paid1 ? user->paid1 : "N");
-
-	return s;
+	sb_append_field(sb, "first", user->first);
+	sb_append_field(sb, "last", user->last);
+	sb_append_field(sb, "nickname", user->nickname);
+	sb_append_field(sb, "email", user->email);
+	sb_append_field(sb, "uid", buf);
+	sb_append_field(sb, "admin", user->admin ? "1" : "0");
+	sb_append_field(sb, "banners", user->banners ? "yes" : "no");
+	sb_append_field(sb, "get_offers_from_us", user->get_offers_from_us ? "Y" : "N");
+	sb_append_field(sb, "get_offers_from_affiliates", user->get_offers_from_affiliates ? "Y" : "N");
+	sb_append_field(sb, "random", user->random ? "Y" : "N");
+	sb_append_field(sb, "verified", user->verified ? "Y" : "N");
+	sb_append_field(sb, "privacy", user->privacy);
+
+	if (user->paid1 && *user->paid1 == 'E' && ops->paid1_e)
+		sb_append_field(sb, "paid1", ops->paid1_e);
+	else sb_append_field(sb, "paid1", user->paid1 ? user->paid1 : "N");
 }
 
 /**
@@ -68,13 +53,11 @@ unsigned long lookup_uid(void *db_r, const char *nick) {
 	void *p;
 	unsigned long ret = 0;
 
-	if (!(p = db_prepare(db_r, "SELECT uid FROM users WHERE nickname=?")))
+	if (!(p = db_cached(db_r, "SELECT uid FROM users WHERE nickname=?")))
 		goto ret;
 
-	db_reset_prepared(p);
 	db_bind(p, "t", nick);
 	ret = db_get_int(p);
-	db_free_prepared(p);
 
 ret:
 	return ret ? ret : UID_ALL;
@@ -88,13 +71,11 @@ int nickname_in_use(void *db_r, const char *nick)
 	int ret;
 	void *p;
 
-	if (!(p = db_prepare(db_r, "SELECT COUNT(*) FROM users WHERE nickname=?")))
+	if (!(p = db_cached(db_r, "SELECT COUNT(*) FROM users WHERE nickname=?")))
 		return 0;
 
-	db_reset_prepared(p);
 	db_bind(p, "t", nick);
 	ret = db_get_count(p);
-	db_free_prepared(p);
 	return !!ret;
 }
 
@@ -109,7 +90,7 @@ char *suggest_nickname(void *db_r, const char *nick)
 	if (!db_r || !nick || !(s = malloc(min(NICKNAME_MAX, strlen(nick)) + 4)))
 		return NULL;
 
-	if (!(p = db_prepare(db_r, "SELECT COUNT(*) FROM users WHERE nickname=?"))) {
+	if (!(p = db_cached(db_r, "SELECT COUNT(*) FROM users WHERE nickname=?"))) {
 		free(s);
 		return NULL;
 	}
@@ -120,7 +101,6 @@ char *suggest_nickname(void *db_r, const char *nick)
 		db_bind(p, "t", s);
 	} while (db_get_count(p));
 
-	db_free_prepared(p);
 	return s;
 }
 
@@ -129,70 +109,76 @@ char *suggest_nickname(void *db_r, const char *nick)
  * field in the user struct pointed to by \a ud; ignoring unknown
  * fields.
  */
-void user_from_named_field(void *ud, const char *k, const char *v)
+void user_from_field(void *ud, const struct span *k, const struct span *v)
 {
 	int known = 0;
 	struct user *u = (struct user *)ud;
 
-	if (!u || !k || !*k || !v)
+	if (!u || !k->len || !v->p)
 		return;
 
-	switch(strlen(k)) {
+	switch(k->len) {
 	case 3:
-		switch (*k) {
-		case 'u': if (!strcmp(k, "uid")) { u->uid = atol(v); ++known; } break;
-		case 's': if (!strcmp(k, "sup")) { u->sup = atoi(v); ++known; } break;
+		switch (*k->p) {
+		case 'u': if (span_eq(k, "uid")) { u->uid = span_tol(v); ++known; } break;
+		case 's': if (span_eq(k, "sup")) { u->sup = span_tol(v); ++known; } break;
 		}
 	break;
 	case 4:
-		if (!strcmp(k, "last")) {
-			u->last = strdup(v);
+		if (span_eq(k, "last")) {
+			u->last = span_dup(v);
 			++known;
 		}
 	break;
 	case 5:
-		switch (*k) {
-		case 'a': if (!strcmp(k, "admin")) { u->admin = atoi(v);   ++known; } break;
-		case 'e': if (!strcmp(k, "email")) { u->email = strdup(v); ++known; } break;
-		case 'f': if (!strcmp(k, "first")) { u->first = strdup(v); ++known; } break;
-		case 'p': if (!strcmp(k, "paid1")) { u->paid1 = strdup(v); ++known; } break;
+		switch (*k->p) {
+		case 'a': if (span_eq(k, "admin")) { u->admin = span_tol(v); ++known; } break;
+		case 'e': if (span_eq(k, "email")) { u->email = span_dup(v); ++known; } break;
+		case 'f': if (span_eq(k, "first")) { u->first = span_dup(v); ++known; } break;
+		case 'p': if (span_eq(k, "paid1")) { u->paid1 = span_dup(v); ++known; } break;
 		}
 	break;
 	case 6:
-		if (!strcmp(k, "random")) {
-			u->random = tolower(*v) == 'y';
+		if (span_eq(k, "random")) {
+			u->random = v->len && tolower(*v->p) == 'y';
 			++known;
 		}
 	break;
 	case 7:
-		switch (*k) {
-		case 'b': if (!strcmp(k, "banners")) { u->banners = tolower(*v) == 'y'; ++known; } break;
-		case 'p': if (!strcmp(k, "privacy")) { u->privacy = strdup(v);          ++known; } break;
+		switch (*k->p) {
+		case 'b': if (span_eq(k, "banners")) { u->banners = v->len && tolower(*v->p) == 'y'; ++known; } break;
+		case 'p': if (span_eq(k, "privacy")) { u->privacy = span_dup(v);                    ++known; } break;
 		}
 	break;
 	case 8:
-		switch (*k) {
-		case 'n': if (!strcmp(k, "nickname")) { u->nickname = strdup(v);          ++known; } break;
-		case 'p': if (!strcmp(k, "password")) { u->password = strdup(v);          ++known; } break;
-		case 'v': if (!strcmp(k, "verified")) { u->verified = tolower(*v) == 'y'; ++known; } break;
+		switch (*k->p) {
+		case 'n': if (span_eq(k, "nickname")) { u->nickname = span_dup(v);                    ++known; } break;
+		case 'p': if (span_eq(k, "password")) { u->password = span_dup(v);                    ++known; } break;
+		case 'v': if (span_eq(k, "verified")) { u->verified = v->len && tolower(*v->p) == 'y'; ++known; } break;
 		}
 	break;
 	default:
-		if (!strcmp(k, "get_offers_from_affiliates")) {
-			u->get_offers_from_affiliates = tolower(*v) == 'y';
+		if (span_eq(k, "get_offers_from_affiliates")) {
+			u->get_offers_from_affiliates = v->len && tolower(*v->p) == 'y';
 			++known;
-		} else if (!strcmp(k, "get_offers_from_us")) {
-			u->get_offers_from_us = tolower(*v) == 'y';
+		} else if (span_eq(k, "get_offers_from_us")) {
+			u->get_offers_from_us = v->len && tolower(*v->p) == 'y';
 			++known;
 		}
 	}
 
 #ifndef NDEBUG
-	if (!known && strcmp(k, "created") && strcmp(k, "last_login"))
-		WARN(("Ignoring unknown user field `%s=%s'", k, v));
+	if (!known && !span_eq(k, "created") && !span_eq(k, "last_login"))
+		WARN(("Ignoring unknown user field `%.*s=%.*s'", (int)k->len, k->p, (int)v->len, v->p));
 #endif
 }
 
+void user_from_named_field(void *ud, const char *k, const char *v)
+{
+	struct span ks = { k, k ? strlen(k) : 0 }, vs = { v, v ? strlen(v) : 0 };
+	user_from_field(ud, &ks, &vs);
+}
+
 /**
  * Validate the password given by a user
  * \return 0 on failure, non-zero on success
@@ -206,16 +192,14 @@ int user_check_password(void *db_r, unsigned long uid, const char *pw)
 	if (!db_r || !pw || !*pw || UID_IS_ERROR(uid))
 		goto ret;
 
-	if (!(p = db_prepare(db_r, "SELECT password FROM secrets WHERE uid=?")))
+	if (!(p = db_cached(db_r, "SELECT password FROM secrets WHERE uid=?")))
 		goto ret;
 
-	db_reset_prepared(p);
-	db_bind(p, "i", uid);
+	db_bind(p, "l", uid);
 	if ((s = db_get_string(p))) {
 		ret = strlen(s) == strlen(pw) && !strcmp(s, pw);
 		free(s);
 	}
-	db_free_prepared(p);
 
 ret:
 	return ret;
@@ -230,16 +214,14 @@ int user_check_question_response(void *db_r, unsigned long uid, const char *resp
 	if (!db_r || !response)
 		goto ret;
 
-	if (!(p = db_prepare(db_r, "SELECT sq_answer FROM secrets WHERE uid=?")))
+	if (!(p = db_cached(db_r, "SELECT sq_answer FROM secrets WHERE uid=?")))
 		goto ret;
 
-	db_reset_prepared(p);
-	db_bind(p, "i", uid);
+	db_bind(p, "l", uid);
 	if ((s = db_get_string(p))) {
 		ret = strlen(s) == strlen(response) && !strcmp(s, response);
 		free(s);
 	}
-	db_free_prepared(p);
 
 ret:
 	return ret;
@@ -247,84 +229,33 @@ ret:
 
 int user_set_password(void *db_w, unsigned long uid, const char *pw)
 {
-	int ret = -1;
-
 	if (!db_w || !pw || !*pw || UID_IS_ERROR(uid))
-		goto ret;
-
-	if (!set_pw) {
-		set_pw = db_prepare(db_w,
-			"INSERT INTO secrets(uid, password) VALUES(?,?) ON CONFLICT "
-			"DO UPDATE SET password=excluded.password");
-
-		if (!set_pw) {
-			ERROR(("user_set_password: Failed to prepare query"))
-			goto ret;
-		}
-	}
-
-	db_reset_prepared(set_pw);
-	db_bind(set_pw, "it", uid, pw);
-	if (db_do_prepared(set_pw))
-		++ret;
-	else ERROR(("user_set_password: upsert failed: %s", db_errmsg(db_w)));
-	db_reset_prepared(set_pw);
+		return -1;
 
-ret:
-	return ret;
+	return db_write(db_w, NULL, NULL,
+	                "INSERT INTO secrets(uid, password) VALUES(?,?) ON CONFLICT "
+	                "DO UPDATE SET password=excluded.password",
+	                "lt", uid, pw);
 }
 
 int user_set_password_hint(void *db_w, unsigned long uid, const char *hint)
 {
-	int ret = -1;
-
 	if (!db_w || UID_IS_ERROR(uid))
-		goto ret;
-
-	if (!set_pw_hint) {
-		set_pw_hint = db_prepare(db_w, "UPDATE secrets SET password_hint=? WHERE uid=?");
-
-		if (!set_pw_hint) {
-			ERROR(("user_set_password_hint: Failed to prepare query"))
-			goto ret;
-		}
-	}
-
-	db_reset_prepared(set_pw_hint);
-	db_bind(set_pw_hint, "ti", hint, uid);
-	if (db_do_prepared(set_pw_hint))
-		++ret;
-	else ERROR(("user_set_password_hint: update failed: %s", db_errmsg(db_w)));
-	db_reset_prepared(set_pw_hint);
+		return -1;
 
-ret:
-	return ret;
+	return db_write(db_w, NULL, NULL,
+	                "UPDATE secrets SET password_hint=? WHERE uid=?",
+	                "tl", hint, uid);
 }
 
 int user_set_secret_question(void *db_w, unsigned long uid, unsigned id, const char *response)
 {
-	int ret = -1;
-
 	if (!db_w || UID_IS_ERROR(uid))
-		goto ret;
-
-	if (!set_secret_q) {
-		set_secret_q = db_prepare(db_w,	"UPDATE secrets SET sq_index=?, sq_answer=? WHERE uid=?");
-		if (!set_secret_q) {
-			ERROR(("user_set_secret_question: Failed to prepare query"))
-			goto ret;
-		}
-	}
-
-	db_reset_prepared(set_secret_q);
-	db_bind(set_secret_q, "iti", id, response, uid);
-	if (db_do_prepared(set_secret_q))
-		++ret;
-	else ERROR(("user_set_secret_question: update failed: %s", db_errmsg(db_w)));
-	db_reset_prepared(set_secret_q);
+		return -1;
 
-ret:
-	return ret;
+	return db_write(db_w, NULL, NULL,
+	                "UPDATE secrets SET sq_index=?, sq_answer=? WHERE uid=?",
+	                "itl", id, response, uid);
 }
 
 int user_get_secret_question(void *db_r, unsigned long uid, char **q)
@@ -335,13 +266,11 @@ int user_get_secret_question(void *db_r, unsigned long uid, char **q)
 	if (!db_r || !q || UID_IS_ERROR(uid))
 		goto ret;
 
-	if (!(p = db_prepare(db_r, "SELECT secret_q FROM secret_questions WHERE id=(SELECT sq_index FROM secrets WHERE uid=?)")))
+	if (!(p = db_cached(db_r, "SELECT secret_q FROM secret_questions WHERE id=(SELECT sq_index FROM secrets WHERE uid=?)")))
 		goto ret;
 
-	db_reset_prepared(p);
-	db_bind(p, "i", uid);
+	db_bind(p, "l", uid);
 	*q = db_get_string(p);
-	db_free_prepared(p);
 	ret += !!*q;
 
 ret:
@@ -349,41 +278,21 @@ ret:
 
 }
 
-int register_user(void *db_w, struct user *u)
+int register_user(void *db_w, struct user *u, db_done_cb done, void *userdata)
 {
-	int ret = -1;
-
-	if (!db_w)
-		goto ret;
-
-	if (!insert_user) {
-		insert_user = db_prepare(db_w,
-			"INSERT INTO users(nickname, email, first, last, privacy, "
-			"verified, random, paid1, get_offers_from_us, "
-			"get_offers_from_affiliates, banners, admin, sup, created) "
-			"VALUES(?,?,?,?,?,?,?,?,?,?,?,?,?,datetime('now','subsec')) "
-			"RETURNING uid");
-
-		if (!insert_user) {
-			ERROR(("register_user: Failed to prepare query: %s", db_errmsg(db_w)))
-			goto ret;
-		}
-	}
-
-	db_reset_prepared(insert_user);
-	db_bind(insert_user, "tttttiitiiiii", u->nickname, u->email, u->first,
-	        u->last, u->privacy ? u->privacy : "G", !!u->verified,
-	        !!u->random, u->paid1 ? u->paid1 : "Y",
-	        !!u->get_offers_from_us, !!u->get_offers_from_affiliates,
-	        !!u->banners, !!u->admin, !!u->sup);
-
-	if ((u->uid = db_get_int(insert_user)))
-		++ret;
-	else ERROR(("register_user: insert failed: %s", db_errmsg(db_w)));
-	db_reset_prepared(insert_user);
+	if (!db_w || !u)
+		return -1;
 
-ret:
-	return ret;
+	return db_write(db_w, done, userdata,
+	                "INSERT INTO users(nickname, email, first, last, privacy, "
+	                "verified, random, paid1, get_offers_from_us, "
+	                "get_offers_from_affiliates, banners, admin, sup, created) "
+	                "VALUES(?,?,?,?,?,?,?,?,?,?,?,?,?,datetime('now','subsec'))",
+	                "tttttiitiiiii", u->nickname, u->email, u->first,
+	                u->last, u->privacy ? u->privacy : "G", !!u->verified,
+	                !!u->random, u->paid1 ? u->paid1 : "Y",
+	                !!u->get_offers_from_us, !!u->get_offers_from_affiliates,
+	                !!u->banners, !!u->admin, !!u->sup);
 }
 
 int lookup_user(void *db_r, unsigned long uid, struct user *user)
@@ -405,13 +314,11 @@ int user_exists(void *db_r, unsigned long uid)
 	if (!db_r || UID_IS_ERROR(uid) || uid < UID_MIN || uid == UID_NEWUSER)
 		goto ret;
 
-	if (!(p = db_prepare(db_r, "SELECT COUNT(*) FROM users WHERE uid=?")))
+	if (!(p = db_cached(db_r, "SELECT COUNT(*) FROM users WHERE uid=?")))
 		goto ret;
 
-	db_reset_prepared(p);
-	db_bind(p, "i", uid);
+	db_bind(p, "l", uid);
 	ret += db_get_count(p);
-	db_free_prepared(p);
 
 ret:
 	return ret;
@@ -425,13 +332,11 @@ int user_is_staff(void *db_r, unsigned long uid)
 	if (!db_r || UID_IS_ERROR(uid) || uid < UID_MIN || uid == UID_NEWUSER)
 		goto ret;
 
-	if (!(p = db_prepare(db_r, "SELECT admin+sup FROM users WHERE uid=?")))
+	if (!(p = db_cached(db_r, "SELECT admin+sup FROM users WHERE uid=?")))
 		goto ret;
 
-	db_reset_prepared(p);
-	db_bind(p, "i", uid);
+	db_bind(p, "l", uid);
 	ret += db_get_count(p);
-	db_free_prepared(p);
 
 ret:
 	return ret;
@@ -442,18 +347,9 @@ void user_logged_in(void *db_w, unsigned long uid)
 	if (!db_w || UID_IS_ERROR(uid))
 		return;
 
-	if (!logged_in) {
-		logged_in = db_prepare(db_w, "UPDATE users SET last_login=datetime('now','subsec') WHERE uid=?");
-
-		if (!logged_in) {
-			ERROR(("user_logged_in: Failed to prepare query"))
-			return;
-		}
-	}
-
-	db_reset_prepared(logged_in);
-	db_bind(logged_in, "i", uid);
-	db_do_prepared(logged_in);
+	db_write(db_w, NULL, NULL,
+	         "UPDATE users SET last_login=datetime('now','subsec') WHERE uid=?",
+	         "l", uid);
 }
 
 void user_set_privacy(void *db_w, unsigned long uid, char privacy)
@@ -463,57 +359,43 @@ void user_set_privacy(void *db_w, unsigned long uid, char privacy)
 	if (!db_w || UID_IS_ERROR(uid))
 		return;
 
-	if (!set_privacy) {
-		set_privacy = db_prepare(db_w, "UPDATE users SET privacy=? WHERE uid=?");
-
-		if (!set_privacy) {
-			ERROR(("user_set_privacy: Failed to prepare query"))
-			return;
-		}
-	}
-
 	buf[0] = privacy;
 	buf[1] = '\0';
-	db_reset_prepared(set_privacy);
-	db_bind(set_privacy, "ti", buf, uid);
-	db_do_prepared(set_privacy);
+	db_write(db_w, NULL, NULL, "UPDATE users SET privacy=? WHERE uid=?", "tl", buf, uid);
 }
 
 static const char * const search_expr[3] = {
-	"%%%s%%", /* partial */
-	"%s",     /* exact   */
-	"%s%%",   /* prefix  */
+	"%%%.*s%%", /* partial */
+	"%.*s",     /* exact   */
+	"%.*s%%",   /* prefix  */
 };
 
-char *search_users(void *db_r, const char *field, const char *partial)
+int search_users(void *db_r, struct strbuf *sb, const char *field, const struct span *partial)
 {
 	void *p;
-	int e = 0;
-	char *buf, *sql = NULL, *s = NULL;
+	int e = 0, ret;
+	char *buf;
 
-	if (!db_r || !field || !partial || !(buf = calloc(strlen(field) + 64, 1)))
-		return NULL;
+	if (!db_r || !sb || !field || !partial || !partial->len ||
+	    !(buf = calloc(strlen(field) + partial->len + 64, 1)))
+		return -1;
 
 	/* 'p' for prefix, 'x' for exact */
 	if ((e = ((*field == 'p') << 1) | (*field == 'x')))
 		field++;
 
 	sprintf(buf, "SELECT uid,nickname,first,last,email FROM users WHERE %s LIKE ?", field);
-	if (!(p = db_prepare(db_r, buf))) {
+	if (!(p = db_cached(db_r, buf))) {
 		ERROR(("search_users: Failed to prepare query"));
 		free(buf);
-		return NULL;
+		return -1;
 	}
 
-	sprintf(buf, search_expr[e], partial);
-	db_reset_prepared(p);
+	sprintf(buf, search_expr[e], (int)partial->len, partial->p);
 	db_bind(p, "t", buf);
-	sql = db_get_prepared_sql(p);
-	db_exec(db_r, &s, sql, db_row_to_record);
-	db_free(sql);
-	db_free_prepared(p);
+	ret = db_get_records(p, sb, 0);
 	free(buf);
-	return s;
+	return ret;
 }
 
 void free_user(struct user *user)
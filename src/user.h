@@ -8,6 +8,11 @@
 #ifndef USER_H
 #define USER_H
 
+#include "database.h"
+
+struct span;
+struct pt_proto_ops;
+
 struct user {
 	unsigned long uid;
 	char *password;
@@ -46,13 +51,14 @@ char *suggest_nickname(void *db_r, const char *nick);
  * field in the user struct pointed to by \a ud; ignoring unknown
  * fields.
  */
+void user_from_field(void *ud, const struct span *k, const struct span *v);
 void user_from_named_field(void *ud, const char *k, const char *v);
 
 /**
- * Convert a user struct to a protocol record
- * \param version Target protocol version
+ * Append a user's fields to a protocol record
+ * \param ops Target protocol's ops
  */
-char *user_to_record(struct user *user, unsigned short version);
+void user_to_record(struct strbuf *sb, struct user *user, const struct pt_proto_ops *ops);
 
 /**
  * Validate the password given by a user
@@ -66,13 +72,25 @@ int user_set_password_hint(void *db_w, unsigned long uid, const char *hint);
 int user_set_secret_question(void *db_w, unsigned long uid, unsigned id, const char *response);
 int user_get_secret_question(void *db_r, unsigned long uid, char **q);
 
-int register_user(void *db_w, struct user *u);
+/**
+ * Queue the insertion of a new user. \a done gets the new uid as the
+ * rowid once it's committed.
+ */
+int register_user(void *db_w, struct user *u, db_done_cb done, void *userdata);
 int user_exists(void *db_r, unsigned long uid);
 int user_is_staff(void *db_r, unsigned long uid);
 void user_logged_in(void *db_w, unsigned long uid);
 void user_set_privacy(void *db_w, unsigned long uid, char privacy);
 int lookup_user(void *db_r, unsigned long uid, struct user *user);
-char *search_users(void *db_r, const char *field, const char *partial);
+
+/**
+ * Append a record to \a sb for each user whose \a field matches
+ * \a partial. \a field is prefixed with 'p' for a prefix match or
+ * 'x' for an exact one.
+ *
+ * \return 0 on success, or -1 on error.
+ */
+int search_users(void *db_r, struct strbuf *sb, const char *field, const struct span *partial);
 void free_user(struct user *user);
 
 #endif /* USER_H */